@@ -0,0 +1,114 @@
+// lookup throughput per NUMA node for a table placed by numa_allocator
+//
+// > g++ -std=c++17 -O3 -DNDEBUG -pthread bench_numa.cpp -o bench_numa
+// > ./bench_numa 100000000 partition
+//
+// prints one line per node: node, number of keys whose bucket lives on that
+// node and the lookups per second of a thread pinned to that node, once for
+// uniformly random keys and once for keys whose bucket is local to the node
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sched.h>
+#include "numa_allocator.hpp"
+
+using whash::numa_allocator;
+using whash::numa_node_of;
+using whash::numa_nodes;
+using whash::numa_patchmap;
+using whash::numa_policy;
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+uint64_t gen_rand(uint64_t i) {
+  return whash::hash<uint64_t>{}(i*8593922412848152131ull);
+}
+
+vector<int> cpus_of_node(const unsigned node){
+  vector<int> cpus;
+  std::ifstream in("/sys/devices/system/node/node"+std::to_string(node)
+                   +"/cpulist");
+  string range;
+  while (std::getline(in,range,',')) {
+    const size_t dash = range.find('-');
+    const int lo = std::stoi(range.substr(0,dash));
+    const int hi = dash==string::npos?lo:std::stoi(range.substr(dash+1));
+    for (int cpu=lo;cpu<=hi;++cpu) cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+void pin_to_node(const unsigned node){
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (const int cpu : cpus_of_node(node)) CPU_SET(cpu,&set);
+  if (CPU_COUNT(&set)) sched_setaffinity(0,sizeof(set),&set);
+}
+
+template<class map_type>
+double lookups_per_second(
+    const map_type& test,
+    const vector<uint64_t>& keys,
+    const size_t& M,
+    size_t& sand){
+  if (keys.empty()) return 0;
+  std::minstd_rand mr(keys.size());
+  std::uniform_int_distribution<size_t> distr(0,keys.size()-1);
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t i=0;i!=M;++i) sand+=test.count(keys[distr(mr)]);
+  const std::chrono::duration<double> t =
+    std::chrono::steady_clock::now()-start;
+  return M/t.count();
+}
+
+int main(int argc, char** argv){
+  if (argc<2) return 1;
+  const size_t N = std::stoull(argv[1]);
+  const string mode = argc>2?argv[2]:"interleave";
+  numa_policy policy = numa_policy::interleave;
+  if (mode=="partition") policy = numa_policy::partition;
+  else if (mode=="local") policy = numa_policy::local;
+  typedef numa_patchmap<uint64_t,uint64_t> map_type;
+  map_type test(map_type::allocator_type{policy});
+  test.reserve(N);
+  vector<uint64_t> keys(N);
+  for (size_t i=0;i!=N;++i) test[keys[i]=gen_rand(i)]=i;
+  const vector<unsigned> nodes = numa_nodes();
+  vector<vector<uint64_t>> local(nodes.size());
+  for (const uint64_t& k : keys) {
+    const int node = numa_node_of(&test.at(k));
+    for (size_t j=0;j!=nodes.size();++j)
+      if (int(nodes[j])==node) local[j].push_back(k);
+  }
+  const size_t M = std::min(N,size_t(1)<<24);
+  vector<double> all_rate(nodes.size()),local_rate(nodes.size());
+  vector<size_t> sand(nodes.size());
+  vector<std::thread> threads;
+  const map_type& ctest = test;
+  for (size_t j=0;j!=nodes.size();++j) {
+    threads.emplace_back([&,j](){
+        pin_to_node(nodes[j]);
+        all_rate[j]   = lookups_per_second(ctest,keys    ,M,sand[j]);
+        local_rate[j] = lookups_per_second(ctest,local[j],M,sand[j]);
+      });
+  }
+  for (auto& t : threads) t.join();
+  cout << "# " << mode << " " << N << " keys, " << nodes.size() << " nodes"
+       << endl;
+  cout << "# node keys_on_node lookups_per_s_all lookups_per_s_local" << endl;
+  size_t s = 0;
+  for (size_t j=0;j!=nodes.size();++j) {
+    cout << nodes[j] << " " << local[j].size() << " "
+         << all_rate[j] << " " << local_rate[j] << endl;
+    s+=sand[j];
+  }
+  return s==0;
+}
@@ -0,0 +1,203 @@
+#ifndef CONCURRENT_PATCH_MAP_H
+#define CONCURRENT_PATCH_MAP_H
+
+#include <atomic>
+#include <mutex>
+#include <optional>
+#include "patchmap.hpp"
+
+namespace whash{
+
+  // The hash of a key within its shard. The shard is chosen by the top
+  // shard_bits of the hash, which are therefore the same for all keys of a
+  // shard, rotating them to the bottom spreads the keys over the whole
+  // table of the shard again without changing their order.
+  template<class hash,size_t shard_bits>
+  class shard_hash : public hash{
+    public:
+      template<class key_type>
+      auto operator()(const key_type& k) const {
+        return rol(hash::operator()(k),shard_bits);
+      }
+      template<class hash_type,class H = hash>
+      auto unhash(const hash_type& v) const
+        -> decltype(declval<const H&>().unhash(v)) {
+        return H::unhash(ror(v,shard_bits));
+      }
+  };
+
+  // A patchmap for many concurrent readers and writers. The hash space is
+  // split into 2^shard_bits intervals and each of them is an ordinary
+  // patchmap with its own lock, which grows on its own. Since the shards are
+  // ordered by hash, visiting them one after another visits all elements in
+  // hash order.
+  template<
+    class key_type,
+    class mapped_type,
+    class hash        = whash::hash<key_type>,
+    class equal       = std::equal_to<key_type>,
+    size_t shard_bits = 6
+  >
+  class concurrent_patchmap{
+    private:
+      typedef shard_hash<hash,shard_bits> table_hash;
+      class table : public patchmap<key_type,mapped_type,table_hash,equal>{
+        public:
+          typedef patchmap<key_type,mapped_type,table_hash,equal> base;
+          typedef typename base::size_type size_type;
+          typedef typename base::hash_type hash_type;
+          typedef typename base::sizing_policy sizing_policy;
+          using base::base;
+          using base::data;
+          using base::datasize;
+          using base::num_data;
+          using base::allocator;
+          using base::hasher;
+          using base::find_node;
+          using base::find_next;
+          using base::reserve_node;
+          size_type find(const key_type& k,const hash_type& ok) const {
+            return find_node(k,ok);
+          }
+          // bucket of k, inserted with a default value if it was missing
+          pair<size_type,bool> emplace(const key_type& k,const hash_type& ok){
+            const size_type i = find_node(k,ok);
+            if (i<datasize) return {i,false};
+            sizing_policy policy(num_data,datasize);
+            if (!policy.is_sufficient()) base::resize(policy.nextsize());
+            const size_type j = reserve_node(k,ok);
+            typedef typename base::allocator_type allocator_type;
+            if constexpr (unhash_defined<table_hash,hash_type>::value) {
+              allocator_traits<allocator_type>::construct(allocator,data+j,
+                  ok,typename base::_mapped_type());
+            } else {
+              allocator_traits<allocator_type>::construct(allocator,data+j,
+                  k,typename base::_mapped_type());
+            }
+            return {j,true};
+          }
+          key_type key(const size_type& i) const {
+            if constexpr (unhash_defined<table_hash,hash_type>::value) {
+              return hasher.unhash(get<0>(data[i]));
+            } else {
+              return get<0>(data[i]);
+            }
+          }
+          template<class F>
+          void for_each(F&& f){
+            for (size_type i=find_next(0);i<datasize;i=find_next(i+1))
+              f(key(i),get<1>(data[i]));
+          }
+      };
+      struct alignas(64) shard{
+        mutable std::mutex lock;
+        table map;
+      };
+    public:
+      typedef typename table::size_type size_type;
+      typedef typename table::hash_type hash_type;
+      static constexpr size_type shard_count = size_type(1)<<shard_bits;
+    private:
+      unique_ptr<shard[]> shards;
+      std::atomic<size_type> num_data{0};
+      hash hasher;
+      hash_type order(const key_type& k) const { return hasher(k); }
+      size_type shard_of(const hash_type& h) const {
+        return shr(h,digits<hash_type>()-shard_bits);
+      }
+      hash_type shard_order(const hash_type& h) const {
+        return rol(h,shard_bits);
+      }
+    public:
+      explicit concurrent_patchmap(const size_type& n = 0)
+        :shards(new shard[shard_count]) {
+        if (n) reserve(n);
+      }
+      concurrent_patchmap(const concurrent_patchmap&) = delete;
+      concurrent_patchmap& operator=(const concurrent_patchmap&) = delete;
+      size_type count(const key_type& k) const {
+        const hash_type h = order(k);
+        const shard& s = shards[shard_of(h)];
+        std::lock_guard<std::mutex> lock(s.lock);
+        return s.map.find(k,shard_order(h))<s.map.datasize;
+      }
+      std::optional<mapped_type> find(const key_type& k) const {
+        const hash_type h = order(k);
+        const shard& s = shards[shard_of(h)];
+        std::lock_guard<std::mutex> lock(s.lock);
+        const size_type i = s.map.find(k,shard_order(h));
+        if (i>=s.map.datasize) return std::optional<mapped_type>();
+        return get<1>(s.map.data[i]);
+      }
+      mapped_type at(const key_type& k) const {
+        const std::optional<mapped_type> v = find(k);
+        if (!v) throw std::out_of_range(
+            std::string(typeid(*this).name())
+            +".at(key_type k) key not found"
+           );
+        return *v;
+      }
+      // insert k with value v if k is not in the table yet, returns whether
+      // it was inserted
+      bool insert(const key_type& k,const mapped_type& v){
+        return update(k,[&v](mapped_type& m,const bool inserted){
+            if (inserted) m = v;
+          });
+      }
+      // insert k with value v or overwrite the value of k
+      bool insert_or_assign(const key_type& k,const mapped_type& v){
+        return update(k,[&v](mapped_type& m,const bool){ m = v; });
+      }
+      // call f(value,inserted) for the value of k while holding the lock of
+      // its shard, k is inserted with a default value if it was missing
+      template<class F>
+      bool update(const key_type& k,F&& f){
+        const hash_type h = order(k);
+        shard& s = shards[shard_of(h)];
+        std::lock_guard<std::mutex> lock(s.lock);
+        const auto [i,inserted] = s.map.emplace(k,shard_order(h));
+        if (inserted) num_data.fetch_add(1,std::memory_order_relaxed);
+        f(get<1>(s.map.data[i]),inserted);
+        return inserted;
+      }
+      size_type erase(const key_type& k){
+        const hash_type h = order(k);
+        shard& s = shards[shard_of(h)];
+        std::lock_guard<std::mutex> lock(s.lock);
+        if (!s.map.erase(k,shard_order(h))) return 0;
+        num_data.fetch_sub(1,std::memory_order_relaxed);
+        return 1;
+      }
+      // call f(key,value) for all elements of shard i, in hash order, while
+      // holding its lock; different shards can be visited in parallel
+      template<class F>
+      void for_each_in_shard(const size_type& i,F&& f){
+        std::lock_guard<std::mutex> lock(shards[i].lock);
+        shards[i].map.for_each(f);
+      }
+      // call f(key,value) for all elements in hash order, locking one shard
+      // after another
+      template<class F>
+      void for_each(F&& f){
+        for (size_type i=0;i!=shard_count;++i) for_each_in_shard(i,f);
+      }
+      void reserve(const size_type& n){
+        for (size_type i=0;i!=shard_count;++i) {
+          std::lock_guard<std::mutex> lock(shards[i].lock);
+          shards[i].map.reserve((n+shard_count-1)/shard_count);
+        }
+      }
+      void clear(){
+        for (size_type i=0;i!=shard_count;++i) {
+          std::lock_guard<std::mutex> lock(shards[i].lock);
+          num_data.fetch_sub(shards[i].map.size(),std::memory_order_relaxed);
+          shards[i].map.clear();
+        }
+      }
+      size_type size() const {
+        return num_data.load(std::memory_order_relaxed);
+      }
+      bool empty() const { return size()==0; }
+  };
+}
+#endif // CONCURRENT_PATCH_MAP_H
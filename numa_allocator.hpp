@@ -0,0 +1,166 @@
+#ifndef NUMA_ALLOCATOR_H
+#define NUMA_ALLOCATOR_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include "patchmap.hpp"
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace whash{
+
+  enum class numa_policy{
+    local,      // leave placement to the kernel, usually first touch
+    interleave, // spread the pages round robin over all allowed nodes
+    partition   // split the allocation into one contiguous part per node
+  };
+
+#ifdef __linux__
+  namespace numa_detail{
+    // bit mask of the nodes this process may allocate on
+    inline vector<unsigned long> allowed_node_mask(){
+      vector<unsigned long> m(16,0);
+      const long r = syscall(SYS_get_mempolicy,nullptr,m.data(),
+          m.size()*digits<unsigned long>(),nullptr,MPOL_F_MEMS_ALLOWED);
+      if (r!=0) {
+        m.assign(1,1ul);
+      }
+      return m;
+    }
+    inline long mbind(
+        void* p,
+        const size_t& len,
+        const int& mode,
+        const vector<unsigned long>& nodes){
+      return syscall(SYS_mbind,p,len,mode,nodes.data(),
+          nodes.size()*digits<unsigned long>()+1,0);
+    }
+  }
+#endif
+
+  // nodes this process may allocate memory on, in increasing order
+  inline vector<unsigned> numa_nodes(){
+    vector<unsigned> nodes;
+#ifdef __linux__
+    const auto m = numa_detail::allowed_node_mask();
+    for (size_t i=0;i!=m.size()*digits<unsigned long>();++i)
+      if (m[i/digits<unsigned long>()]&(1ul<<(i%digits<unsigned long>())))
+        nodes.push_back(i);
+#endif
+    if (nodes.empty()) nodes.push_back(0);
+    return nodes;
+  }
+
+  // node the page containing p resides on, or -1 if not known (yet)
+  inline int numa_node_of(const void* p){
+#ifdef __linux__
+    int node = -1;
+    if (syscall(SYS_get_mempolicy,&node,nullptr,0,p,
+          MPOL_F_NODE|MPOL_F_ADDR)==0) return node;
+#endif
+    return -1;
+  }
+
+  // An allocator that places large allocations according to a numa_policy.
+  // A patchmap takes mask and buckets in one allocation from it, so with
+  // numa_policy::interleave the pages of a big table are spread over all
+  // nodes, and with numa_policy::partition node k holds the k-th contiguous
+  // slice of buckets, which, as the buckets are ordered by hash, is the k-th
+  // slice of the hash range. Small allocations are left to operator new.
+  template<class T>
+  class numa_allocator{
+    public:
+      typedef T value_type;
+      typedef std::true_type propagate_on_container_copy_assignment;
+      typedef std::true_type propagate_on_container_move_assignment;
+      typedef std::true_type propagate_on_container_swap;
+      typedef std::false_type is_always_equal;
+      static constexpr size_t threshold = size_t(1)<<16;
+      numa_policy policy;
+      numa_allocator(const numa_policy& policy = numa_policy::interleave)
+        :policy(policy) {}
+      template<class U>
+      numa_allocator(const numa_allocator<U>& other)
+        :policy(other.policy) {}
+      T* allocate(const size_t& n){
+        const size_t bytes = n*sizeof(T);
+#ifdef __linux__
+        if (bytes>=threshold) {
+          void* p = mmap(nullptr,bytes,PROT_READ|PROT_WRITE,
+                         MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+          if (p==MAP_FAILED) throw std::bad_alloc();
+          place(p,bytes);
+          return static_cast<T*>(p);
+        }
+#endif
+        return static_cast<T*>(::operator new(bytes,std::align_val_t(alignof(T))));
+      }
+      void deallocate(T* p,const size_t& n){
+        const size_t bytes = n*sizeof(T);
+#ifdef __linux__
+        if (bytes>=threshold) {
+          munmap(p,bytes);
+          return;
+        }
+#endif
+        ::operator delete(p,std::align_val_t(alignof(T)));
+      }
+      template<class U>
+      bool operator==(const numa_allocator<U>& other) const {
+        return policy==other.policy;
+      }
+      template<class U>
+      bool operator!=(const numa_allocator<U>& other) const {
+        return policy!=other.policy;
+      }
+    private:
+      // the placement is only advisory, if the kernel refuses we keep the
+      // memory where it ends up
+      void place(void* p,const size_t& bytes) const {
+#ifdef __linux__
+        if (policy==numa_policy::local) return;
+        const vector<unsigned> nodes = numa_nodes();
+        if (nodes.size()<2) return;
+        if (policy==numa_policy::interleave) {
+          numa_detail::mbind(p,bytes,MPOL_INTERLEAVE,
+              numa_detail::allowed_node_mask());
+          return;
+        }
+        const size_t page = sysconf(_SC_PAGESIZE);
+        const size_t pages = (bytes+page-1)/page;
+        for (size_t k=0;k!=nodes.size();++k) {
+          const size_t lo = pages*k/nodes.size();
+          const size_t hi = pages*(k+1)/nodes.size();
+          if (lo==hi) continue;
+          vector<unsigned long> m(nodes[k]/digits<unsigned long>()+1,0);
+          m[nodes[k]/digits<unsigned long>()] =
+            1ul<<(nodes[k]%digits<unsigned long>());
+          numa_detail::mbind(static_cast<char*>(p)+lo*page,(hi-lo)*page,
+              MPOL_BIND,m);
+        }
+#endif
+      }
+  };
+
+  template<
+    class key_type,
+    class mapped_type,
+    class hash        = whash::hash<key_type>,
+    class equal       = std::equal_to<key_type>
+  >
+  using numa_patchmap = patchmap<
+    key_type,
+    mapped_type,
+    hash,
+    equal,
+    patchmap_default_comp<key_type,hash>,
+    numa_allocator<patchmap_default_value_type<key_type,mapped_type,hash>>
+  >;
+}
+#endif // NUMA_ALLOCATOR_H
@@ -0,0 +1,538 @@
+#ifndef PARALLEL_PATCH_MAP_H
+#define PARALLEL_PATCH_MAP_H
+
+#include <atomic>
+#include <optional>
+#include <thread>
+#include <vector>
+#include "patchmap.hpp"
+
+namespace whash{
+
+  // run f(0) ... f(n-1) on n threads, f(0) on the calling one
+  template<class F>
+  void parallel_run(const size_t& n,F&& f){
+    vector<std::thread> threads;
+    for (size_t i=1;i<n;++i) threads.emplace_back([&f,i](){ f(i); });
+    if (n) f(0);
+    for (auto& t : threads) t.join();
+  }
+
+  // how parallel algorithms split their work: the number of threads and
+  // the number of mask words, 64 buckets each, a thread takes at a time
+  struct parallel_policy{
+    size_t threads     = std::thread::hardware_concurrency();
+    size_t chunk_words = 64;
+  };
+
+  template<
+    class key_type,
+    class mapped_type,
+    class hash,
+    class equal,
+    class comp,
+    class alloc,
+    size_t inline_capacity,
+    bool fenced
+  >
+  class patchmap_parallel<patchmap<
+    key_type,
+    mapped_type,
+    hash,
+    equal,
+    comp,
+    alloc,
+    inline_capacity,
+    fenced
+  >>{
+    public:
+      typedef patchmap<
+        key_type,
+        mapped_type,
+        hash,
+        equal,
+        comp,
+        alloc,
+        inline_capacity,
+        fenced
+      > map_type;
+      typedef typename map_type::size_type size_type;
+      typedef typename map_type::hash_type hash_type;
+      // buckets covered by one word of the summaries of the mask, threads
+      // working on different blocks never write to the same word
+      static constexpr size_type block =
+        digits<size_type>()*digits<size_type>();
+    private:
+      template<class value>
+      static void construct(
+          map_type& map,
+          const size_type& i,
+          const value& val,
+          const hash_type& ok){
+        if constexpr (unhash_defined<hash,hash_type>::value) {
+          if constexpr (is_same<void,mapped_type>::value) {
+            allocator_traits<alloc>::construct(map.allocator,map.data+i,
+                ok,true_type{});
+          } else {
+            allocator_traits<alloc>::construct(map.allocator,map.data+i,
+                ok,map.mapped_of(val));
+          }
+        } else {
+          if constexpr (is_same<void,mapped_type>::value) {
+            allocator_traits<alloc>::construct(map.allocator,map.data+i,
+                val,true_type{});
+          } else {
+            allocator_traits<alloc>::construct(map.allocator,map.data+i,val);
+          }
+        }
+      }
+      // the key of the element in bucket i, by reference if it is stored
+      static decltype(auto) key_at(const map_type& map,const size_type& i){
+        const typename map_type::value_type& v = map.data[i];
+        if constexpr (unhash_defined<hash,hash_type>::value) {
+          return map.hasher.unhash(get<0>(v));
+        } else {
+          return get<0>(v);
+        }
+      }
+      // call f(i) for every occupied bucket i, the threads take chunks of
+      // mask words from a shared counter until none are left, f(i,t) gets
+      // the index t of the thread
+      template<class F>
+      static void visit(
+          const map_type& map,
+          const parallel_policy& policy,
+          F&& f){
+        const size_type words  = std::max(size_t(1),policy.chunk_words);
+        const size_type chunks = (map.masksize+words-1)/words;
+        const size_t threads =
+          std::max(size_t(1),std::min(policy.threads,size_t(chunks)));
+        std::atomic<size_type> next{0};
+        parallel_run(threads,[&](const size_t& t){
+            while (true) {
+              const size_type c = next.fetch_add(1,std::memory_order_relaxed);
+              if (c>=chunks) break;
+              const size_type end = std::min(map.masksize,(c+1)*words);
+              for (size_type k=map.next_word(map.used_words(),0,c*words);
+                   k<end;
+                   k=map.next_word(map.used_words(),0,k+1)) {
+                for (size_type w=map.mask[k];w;w&=w-1) {
+                  f(k*digits<size_type>()+digits<size_type>()-1-ctz(w),t);
+                }
+              }
+            }
+          });
+      }
+      // the hash of the element in bucket i
+      static hash_type ok_at(const map_type& map,const size_type& i){
+        if constexpr (unhash_defined<hash,hash_type>::value) {
+          return get<0>(map.data[i]);
+        } else {
+          return map.order(get<0>(map.data[i]));
+        }
+      }
+      // split the buckets of map into at most threads ranges of whole
+      // blocks, returns their bounds
+      static vector<size_type> partition(
+          const map_type& map,
+          const size_t& threads){
+        const size_type m = map.datasize;
+        const size_type blocks = (m+block-1)/block;
+        const size_t parts =
+          std::max(size_t(1),std::min(threads,size_t(blocks)));
+        vector<size_type> bound(parts+1);
+        for (size_t p=0;p<=parts;++p)
+          bound[p] = std::min(m,size_type(blocks*p/parts*block));
+        return bound;
+      }
+      // Put the elements 0..n-1, given in table order with hashes ok(j),
+      // into the buckets [lo,hi), each in its ideal bucket or right after
+      // its predecessor. put(j,i) constructs element j in bucket i. Returns
+      // the number of elements that fit, the others have to be inserted
+      // afterwards.
+      template<class O,class P>
+      static size_t place(
+          map_type& map,
+          const size_type& lo,
+          const size_type& hi,
+          const size_t& n,
+          O&& ok,
+          P&& put){
+        size_type i = lo;
+        for (size_t j=0;j!=n;++j) {
+          i = std::max(i,map.map(ok(j)));
+          if (i>=hi) return j;
+          put(j,i);
+          map.set(i);
+          ++i;
+        }
+        return n;
+      }
+      // the first bucket of map whose element lies in bucket b or later of
+      // out, or the size of map if there is none
+      static size_type lower_bound(
+          const map_type& map,
+          const map_type& out,
+          const size_type& b){
+        size_type lo = 0, hi = map.datasize;
+        while (lo<hi) {
+          const size_type mid = lo+(hi-lo)/2;
+          const size_type j = map.find_next(mid);
+          if ((j>=map.datasize)||(out.map(ok_at(map,j))>=b)) hi = mid;
+          else lo = j+1;
+        }
+        return lo;
+      }
+    public:
+      // call f(key,value) for every element, on a const map with a const
+      // value, or f(key) if there are no values
+      template<class M,class F>
+      static void for_each(const parallel_policy& policy,M& map,F&& f){
+        visit(map,policy,[&](const size_type& i,const size_t&){
+            if constexpr (is_same<void,mapped_type>::value) {
+              f(key_at(map,i));
+            } else if constexpr (is_const<M>::value) {
+              const typename map_type::value_type& v = map.data[i];
+              f(key_at(map,i),get<1>(v));
+            } else {
+              f(key_at(map,i),get<1>(map.data[i]));
+            }
+          });
+      }
+      // reduce(init,transform(key,value)...) in unspecified order and
+      // grouping, so reduce has to be associative and commutative
+      template<class T,class R,class F>
+      static T transform_reduce(
+          const parallel_policy& policy,
+          const map_type& map,
+          T init,
+          R&& reduce,
+          F&& transform){
+        vector<std::optional<T>> partial(std::max(size_t(1),policy.threads));
+        visit(map,policy,[&](const size_type& i,const size_t& t){
+            const typename map_type::value_type& v = map.data[i];
+            if constexpr (is_same<void,mapped_type>::value) {
+              if (partial[t]) partial[t] =
+                reduce(std::move(*partial[t]),transform(key_at(map,i)));
+              else partial[t] = transform(key_at(map,i));
+            } else {
+              if (partial[t]) partial[t] = reduce(std::move(*partial[t]),
+                  transform(key_at(map,i),get<1>(v)));
+              else partial[t] = transform(key_at(map,i),get<1>(v));
+            }
+          });
+        for (auto& p : partial)
+          if (p) init = reduce(std::move(init),std::move(*p));
+        return init;
+      }
+      // A new table with the elements of all maps, values of equal keys
+      // combined in the order of maps. Every thread takes one range of
+      // buckets of a table sized for the largest map, finds the part of
+      // every map that belongs to it by binary search and groups the equal
+      // keys of these parts in hash order. The result is then sized for the
+      // number of keys and filled by assign_sorted.
+      template<class C>
+      static map_type merge(
+          const parallel_policy& policy,
+          const vector<const map_type*>& maps,
+          C&& combine){
+        typedef pair<size_t,size_type> source; // map and bucket
+        map_type out(maps[0]->allocator);
+        size_type largest = 0;
+        for (const map_type* m : maps) largest = std::max(largest,m->size());
+        if (largest==0) return out;
+        out.reserve(largest);
+        const vector<size_type> bound = partition(out,policy.threads);
+        const size_t parts = bound.size()-1;
+        // per range the sources in table order and where each key starts
+        vector<vector<source>> items(parts);
+        vector<vector<size_t>> keys(parts);
+        vector<vector<hash_type>> oks(parts);
+        const auto put =
+          [&](const size_t& p,const size_t& j,const size_type& i){
+          const source& s = items[p][keys[p][j]];
+          allocator_traits<alloc>::construct(out.allocator,out.data+i,
+              maps[s.first]->data[s.second]);
+          if constexpr (!is_same<void,mapped_type>::value) {
+            for (size_t k=keys[p][j]+1;k!=keys[p][j+1];++k) {
+              const source& o = items[p][k];
+              combine(get<1>(out.data[i]),
+                      get<1>(maps[o.first]->data[o.second]));
+            }
+          }
+        };
+        parallel_run(parts,[&](const size_t& p){
+            vector<size_type> at(maps.size()),end(maps.size());
+            for (size_t t=0;t!=maps.size();++t) {
+              at[t]  = lower_bound(*maps[t],out,bound[p]);
+              end[t] = p+1==parts?maps[t]->datasize
+                                 :lower_bound(*maps[t],out,bound[p+1]);
+              at[t]  = maps[t]->find_next(at[t]);
+            }
+            const auto key = [&](const source& s){
+              return key_at(*maps[s.first],s.second);
+            };
+            vector<source>& item = items[p];
+            while (true) {
+              bool any = false;
+              hash_type h = 0;
+              for (size_t t=0;t!=maps.size();++t) {
+                if (at[t]>=end[t]) continue;
+                const hash_type o = ok_at(*maps[t],at[t]);
+                if ((!any)||(o<h)) h = o;
+                any = true;
+              }
+              if (!any) break;
+              const size_t g = item.size();
+              for (size_t t=0;t!=maps.size();++t) {
+                while ((at[t]<end[t])&&(ok_at(*maps[t],at[t])==h)) {
+                  item.emplace_back(t,at[t]);
+                  at[t] = maps[t]->find_next(at[t]+1);
+                }
+              }
+              if constexpr (is_injective<hash,hash_type>::value) {
+                keys[p].push_back(g);
+                oks[p].push_back(h);
+              } else {
+                // different keys with equal hashes in table order, equal
+                // keys of different maps next to each other
+                std::stable_sort(item.begin()+g,item.end(),
+                    [&](const source& a,const source& b){
+                      return out.comparator(key(a),key(b));
+                    });
+                for (size_t a=g;a!=item.size();++a) {
+                  if ((a==g)||(!out.equator(key(item[a-1]),key(item[a])))) {
+                    keys[p].push_back(a);
+                    oks[p].push_back(h);
+                  }
+                  for (size_t b=a+1;b<item.size();++b) {
+                    if (!out.equator(key(item[a]),key(item[b]))) continue;
+                    std::rotate(item.begin()+a+1,item.begin()+b,
+                                item.begin()+b+1);
+                    break;
+                  }
+                }
+              }
+            }
+            keys[p].push_back(item.size());
+          });
+        // the keys of range p are numbered from first[p] on
+        vector<size_t> first(parts+1,0);
+        for (size_t p=0;p!=parts;++p) first[p+1] = first[p]+oks[p].size();
+        const auto range = [&](const size_t& j){
+          return size_t(std::upper_bound(first.begin(),first.end(),j)
+                        -first.begin()-1);
+        };
+        assign_sorted(out,first[parts],
+            [&](const size_t& j){
+              const size_t p = range(j);
+              return oks[p][j-first[p]];
+            },
+            [&](const size_t& j){
+              const size_t p = range(j);
+              const source& s = items[p][keys[p][j-first[p]]];
+              return key_at(*maps[s.first],s.second);
+            },
+            [&](const size_t& j,const size_type& i){
+              const size_t p = range(j);
+              put(p,j-first[p],i);
+            },policy.threads);
+        return out;
+      }
+      // Replace the contents of map by the elements 0..n-1, given in table
+      // order without equal keys, with hashes ok(j) and keys key(j), growing
+      // map only if it has too few buckets for them. put(j,i) constructs
+      // element j in bucket i. Every thread finds the elements of one range
+      // of buckets by binary search and places them, those that would run
+      // over its end are inserted afterwards.
+      template<class O,class K,class P>
+      static void assign_sorted(
+          map_type& map,
+          const size_t& n,
+          O&& ok,
+          K&& key,
+          P&& put,
+          const size_t& threads){
+        map.clear();
+        if (n==0) return;
+        typename map_type::sizing_policy policy(n,map.datasize);
+        if (!policy.is_sufficient()) map.resize(n*3/2);
+        const vector<size_type> bound = partition(map,threads);
+        const size_t parts = bound.size()-1;
+        vector<size_t> first(parts+1,n);
+        first[0] = 0;
+        for (size_t p=1;p<parts;++p) {
+          size_t lo = first[p-1], hi = n;
+          while (lo<hi) {
+            const size_t mid = lo+(hi-lo)/2;
+            if (map.map(ok(mid))>=bound[p]) hi = mid;
+            else lo = mid+1;
+          }
+          first[p] = lo;
+        }
+        vector<size_t> placed(parts,0);
+        parallel_run(parts,[&](const size_t& p){
+            placed[p] = place(map,bound[p],bound[p+1],first[p+1]-first[p],
+                [&](const size_t& j){ return ok(first[p]+j); },
+                [&](const size_t& j,const size_type& i){ put(first[p]+j,i); });
+          });
+        map.num_data = 0;
+        for (size_t p=0;p!=parts;++p) map.num_data+=placed[p];
+        map.rebuild_fences();
+        for (size_t p=0;p!=parts;++p)
+          for (size_t j=first[p]+placed[p];j!=first[p+1];++j)
+            put(j,map.reserve_node(key(j),ok(j)));
+        assert(map.check_ordering());
+      }
+      // Replace the contents of map by the elements of [first,last). Every
+      // thread hashes a slice of the input and sorts it into one bin per
+      // contiguous range of buckets. Then every thread sorts the bins of one
+      // range and places them in order, each element in its ideal bucket or
+      // right after its predecessor. Elements that would run over the end
+      // of their range are inserted one by one afterwards.
+      template<class RandomIt>
+      static void build(
+          map_type& map,
+          RandomIt first,
+          RandomIt last,
+          const size_t& threads){
+        typedef pair<hash_type,size_t> entry; // hash and index in the input
+        const size_t n = last-first;
+        map.clear();
+        if (n==0) return;
+        typename map_type::sizing_policy policy(n,map.datasize);
+        if (!policy.is_sufficient()) map.resize(n*3/2);
+        const vector<size_type> bound = partition(map,threads);
+        const size_t parts = bound.size()-1;
+        vector<vector<vector<entry>>> bins(parts,vector<vector<entry>>(parts));
+        parallel_run(parts,[&](const size_t& t){
+            for (size_t i=n*t/parts;i!=n*(t+1)/parts;++i) {
+              const hash_type  ok = map.order(map.key_of(first[i]));
+              const size_type mok = map.map(ok);
+              const size_t p =
+                std::upper_bound(bound.begin()+1,bound.end()-1,mok)
+                -(bound.begin()+1);
+              bins[t][p].emplace_back(ok,i);
+            }
+          });
+        vector<vector<entry>> spill(parts);
+        vector<size_type> placed(parts,0);
+        parallel_run(parts,[&](const size_t& p){
+            // counting sort by ideal bucket, which map keeps in hash order,
+            // then sort the few elements of every bucket
+            const size_type lo = bound[p];
+            vector<size_t> first_of(bound[p+1]-lo+1,0);
+            for (size_t t=0;t!=parts;++t)
+              for (const entry& e : bins[t][p])
+                ++first_of[map.map(e.first)-lo+1];
+            for (size_t i=1;i<first_of.size();++i) first_of[i]+=first_of[i-1];
+            vector<entry> part(first_of.back());
+            for (size_t t=0;t!=parts;++t) {
+              for (const entry& e : bins[t][p])
+                part[first_of[map.map(e.first)-lo]++] = e;
+              vector<entry>().swap(bins[t][p]);
+            }
+            for (size_t i=0,j=0;i!=part.size();i=j) {
+              const size_type mok = map.map(part[i].first);
+              for (j=i+1;(j!=part.size())&&(map.map(part[j].first)==mok);++j);
+              if (j-i>1) std::sort(part.begin()+i,part.begin()+j);
+            }
+            // of equal keys the first one in the input is kept, as insert
+            // would, different keys with equal hashes are put in table order
+            size_t u = 0;
+            for (size_t j=0,l;j!=part.size();j=l) {
+              for (l=j+1;(l!=part.size())&&(part[l].first==part[j].first);++l);
+              const size_t g = u;
+              for (size_t a=j;a!=l;++a) {
+                bool duplicate = false;
+                if constexpr (is_injective<hash,hash_type>::value) {
+                  duplicate = u!=g;
+                } else {
+                  for (size_t b=g;b!=u;++b)
+                    duplicate |= map.equator(map.key_of(first[part[b].second]),
+                                             map.key_of(first[part[a].second]));
+                }
+                if (!duplicate) part[u++] = part[a];
+              }
+              if constexpr (!is_injective<hash,hash_type>::value) {
+                std::stable_sort(part.begin()+g,part.begin()+u,
+                    [&](const entry& a,const entry& b){
+                      return map.comparator(map.key_of(first[a.second]),
+                                            map.key_of(first[b.second]));
+                    });
+              }
+            }
+            part.resize(u);
+            placed[p] = place(map,bound[p],bound[p+1],part.size(),
+                [&](const size_t& j){ return part[j].first; },
+                [&](const size_t& j,const size_type& i){
+                  construct(map,i,first[part[j].second],part[j].first);
+                });
+            spill[p].assign(part.begin()+placed[p],part.end());
+          });
+        map.num_data = 0;
+        for (size_t p=0;p!=parts;++p) map.num_data+=placed[p];
+        map.rebuild_fences();
+        for (size_t p=0;p!=parts;++p) {
+          for (const entry& e : spill[p]) {
+            const size_type j =
+              map.reserve_node(map.key_of(first[e.second]),e.first);
+            construct(map,j,first[e.second],e.first);
+          }
+        }
+        assert(map.check_ordering());
+      }
+  };
+
+  // Merge the maps in [first,last) into map, combining the values of a key
+  // that is in more than one of them with combine(value,other), in the
+  // order map, *first, ..., *(last-1). All maps are walked in their common
+  // hash order, the result is built in parallel over ranges of hashes.
+  template<class map_type,class It,class C>
+  void merge_with(
+      const parallel_policy& policy,
+      map_type& map,
+      It first,
+      It last,
+      C&& combine){
+    vector<const map_type*> maps{&map};
+    for (It it=first;it!=last;++it) maps.push_back(&*it);
+    map = patchmap_parallel<map_type>::merge(policy,maps,combine);
+  }
+
+  // Replace the contents of map by the elements of [first,last) using the
+  // given number of threads. As with insert, of equal keys the first one
+  // is kept.
+  template<class map_type,class RandomIt>
+  void parallel_build(
+      map_type& map,
+      RandomIt first,
+      RandomIt last,
+      const size_t& threads = std::thread::hardware_concurrency()){
+    patchmap_parallel<map_type>::build(map,first,last,threads);
+  }
+
+  // Call f(key,value) for every element of map, or f(key) if it has no
+  // values. The mask is split into chunks that threads visit directly,
+  // without iterators; f may be called concurrently and in any order.
+  template<class map_type,class F>
+  void for_each(const parallel_policy& policy,map_type& map,F&& f){
+    patchmap_parallel<typename remove_const<map_type>::type>::for_each(
+        policy,map,f);
+  }
+
+  // Reduce init and transform(key,value), or transform(key), of all
+  // elements of map with reduce in parallel, which like for
+  // std::transform_reduce has to be associative and commutative.
+  template<class map_type,class T,class R,class F>
+  T transform_reduce(
+      const parallel_policy& policy,
+      const map_type& map,
+      T init,
+      R&& reduce,
+      F&& transform){
+    return patchmap_parallel<map_type>::transform_reduce(
+        policy,map,std::move(init),reduce,transform);
+  }
+}
+#endif // PARALLEL_PATCH_MAP_H
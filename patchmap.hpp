@@ -4,16 +4,22 @@
 #include <algorithm>
 #include <bitset>
 #include <cassert>
+#include <cmath>
 #include <cstdint>
 #include <cstring>
 #include <functional>
 #include <iomanip>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <stdexcept>
 #include <typeinfo>
 #include <exception>
 #include <memory>
+#include <memory_resource>
+#if defined(__AVX2__)||defined(__AVX512F__)||defined(__BMI2__)
+#include <immintrin.h>
+#endif
 
 namespace whash{
   bool constexpr VERBOSE_PATCHMAP = false;
@@ -122,7 +128,7 @@ namespace whash{
   }
   
   template <typename T>
-  constexpr size_t popcount(const T n){
+  constexpr size_t popcount(T n){
     size_t c=0;
     while(n) (n&=(n-1),++c);
     return c;
@@ -143,29 +149,28 @@ namespace whash{
   
   template <typename T>
   typename std::enable_if<std::is_unsigned<T>::value,T>::type
-  constexpr clz(const T x,const T lower=0,const T upper=digits<T>()){
-    return (upper-lower==T(1))?digits<T>()-upper:
-      (x&(T(0)-T(1)<<((upper+lower)/2))?
-           clz(x,(upper+lower)/2,upper):
-           clz(x,lower,(upper+lower)/2));
+  constexpr clz(const T x){
+    if (x==0) return digits<T>();
+    T n = 0, y = x;
+    for (T s=digits<T>()/2;s;s/=2)
+      if (T(y>>(digits<T>()-s))==0) (n+=s,y<<=s);
+    return n;
   }
  
   template <typename T>
   typename std::enable_if<std::is_unsigned<T>::value,T>::type
-  constexpr ctz(const T x,const T lower=0,const T upper=digits<T>()){
-    return
-      (upper-lower==T(1))?lower:(x&(T(0)-T(1)<<((upper+lower)/2))?
-          ctz(x,(upper+lower)/2,upper):
-          ctz(x,lower,(upper+lower)/2));
-    // TODO
+  constexpr ctz(const T x){
+    if (x==0) return digits<T>();
+    T n = 0, y = x;
+    for (T s=digits<T>()/2;s;s/=2)
+      if (T(y<<(digits<T>()-s))==0) (n+=s,y>>=s);
+    return n;
   }
 
   template <typename T>
   typename std::enable_if<std::is_unsigned<T>::value,T>::type
-  constexpr log2(const T x,const T lower=0,const T upper=digits<T>()){
-    return (upper-lower==T(1))?lower:(x&(T(0)-T(1)<<((upper+lower)/2))?
-           log2(x,(upper+lower)/2,upper):
-           log2(x,lower,(upper+lower)/2));
+  constexpr log2(const T x){
+    return x==0?0:digits<T>()-1-clz(x);
   }
 
 #if __GNUC__ > 3 || __clang__
@@ -193,6 +198,125 @@ namespace whash{
     return x==0?0:63-__builtin_clzll(x);
   }
 #endif
+
+  // Kernels on arrays of mask words, the vector versions are selected at
+  // compile time (-mavx2, -mavx512f, -mavx512vpopcntdq, -mbmi2 or simply
+  // -march=native), otherwise they fall back to one word at a time.
+
+  // index of the first word in [i,n) that is not w, or n
+  template<typename T>
+  size_t inline find_word_not(const T* a,size_t i,const size_t n,const T w){
+    for (;i<n;++i) if (a[i]!=w) return i;
+    return n;
+  }
+
+  size_t inline find_word_not(
+      const uint64_t* a,
+            size_t    i,
+      const size_t    n,
+      const uint64_t  w){
+#if defined(__AVX512F__)
+    const __m512i v = _mm512_set1_epi64(w);
+    for (;i+8<=n;i+=8) {
+      const uint32_t m = _mm512_cmpneq_epu64_mask(_mm512_loadu_si512(a+i),v);
+      if (m) return i+ctz(m);
+    }
+#elif defined(__AVX2__)
+    const __m256i v = _mm256_set1_epi64x(w);
+    for (;i+4<=n;i+=4) {
+      const __m256i e = _mm256_cmpeq_epi64(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a+i)),v);
+      const uint32_t m = (~_mm256_movemask_pd(_mm256_castsi256_pd(e)))&0xfu;
+      if (m) return i+ctz(m);
+    }
+#endif
+    for (;i<n;++i) if (a[i]!=w) return i;
+    return n;
+  }
+
+  // index of the last word in [0,n) that is not w, or ~size_t(0)
+  template<typename T>
+  size_t inline rfind_word_not(const T* a,size_t n,const T w){
+    while (n) if (a[--n]!=w) return n;
+    return ~size_t(0);
+  }
+
+  size_t inline rfind_word_not(const uint64_t* a,size_t n,const uint64_t w){
+#if defined(__AVX512F__)
+    const __m512i v = _mm512_set1_epi64(w);
+    for (;n>=8;n-=8) {
+      const uint32_t m = _mm512_cmpneq_epu64_mask(_mm512_loadu_si512(a+n-8),v);
+      if (m) return n-8+log2(m);
+    }
+#elif defined(__AVX2__)
+    const __m256i v = _mm256_set1_epi64x(w);
+    for (;n>=4;n-=4) {
+      const __m256i e = _mm256_cmpeq_epi64(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a+n-4)),v);
+      const uint32_t m = (~_mm256_movemask_pd(_mm256_castsi256_pd(e)))&0xfu;
+      if (m) return n-4+log2(m);
+    }
+#endif
+    while (n) if (a[--n]!=w) return n;
+    return ~size_t(0);
+  }
+
+  // number of set bits in the words [i,n)
+  template<typename T>
+  size_t inline popcount_words(const T* a,size_t i,const size_t n){
+    size_t c = 0;
+    for (;i<n;++i) c+=popcount(a[i]);
+    return c;
+  }
+
+  size_t inline popcount_words(const uint64_t* a,size_t i,const size_t n){
+    size_t c = 0;
+#if defined(__AVX512VPOPCNTDQ__)
+    __m512i s = _mm512_setzero_si512();
+    for (;i+8<=n;i+=8)
+      s = _mm512_add_epi64(s,_mm512_popcnt_epi64(_mm512_loadu_si512(a+i)));
+    c = _mm512_reduce_add_epi64(s);
+#elif defined(__AVX2__)
+    // nibble lookup, summed up bytewise with sad
+    const __m256i lookup = _mm256_setr_epi8(
+        0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+        0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i s = _mm256_setzero_si256();
+    for (;i+4<=n;i+=4) {
+      const __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a+i));
+      const __m256i b = _mm256_add_epi8(
+          _mm256_shuffle_epi8(lookup,_mm256_and_si256(v,low)),
+          _mm256_shuffle_epi8(lookup,
+            _mm256_and_si256(_mm256_srli_epi16(v,4),low)));
+      s = _mm256_add_epi64(s,_mm256_sad_epu8(b,_mm256_setzero_si256()));
+    }
+    c = _mm256_extract_epi64(s,0)+_mm256_extract_epi64(s,1)
+       +_mm256_extract_epi64(s,2)+_mm256_extract_epi64(s,3);
+#endif
+    for (;i<n;++i) c+=popcount(a[i]);
+    return c;
+  }
+
+  // position, counted from the most significant bit, of the r-th set bit of
+  // w, also counted from the most significant bit, r<popcount(w)
+  template<typename T>
+  typename std::enable_if<std::is_unsigned<T>::value,T>::type
+  constexpr select_bit(const T w,T r){
+    T s = 0;
+    for (T h=digits<T>()/2;h;h/=2) {
+      const T c = popcount(T(T(w<<s)>>(digits<T>()-h)));
+      if (r>=c) (r-=c,s+=h);
+    }
+    return s;
+  }
+
+#ifdef __BMI2__
+  inline uint64_t select_bit(const uint64_t w,const uint64_t r){
+    return clz(_pdep_u64(uint64_t(1)<<(popcount(w)-1-r),w));
+  }
+#endif
   
   template <typename T,typename S>
   typename std::enable_if<std::is_unsigned<T>::value,T>::type
@@ -304,8 +428,10 @@ namespace whash{
   template<>
   class hash<uint32_t,void>{
     private:
-      const uint32_t p = 0x55555555ul;
-      const uint32_t a = 3370923577ul;
+      static constexpr uint32_t p = 0x55555555ul;
+      static constexpr uint32_t a = 3370923577ul;
+      static constexpr uint32_t ip = modular_inverse(p);
+      static constexpr uint32_t ia = modular_inverse(a);
     public:
       typedef typename true_type::type is_injective;
       typedef typename true_type::type unhash_defined;
@@ -320,9 +446,9 @@ namespace whash{
         return v;
       }
       constexpr uint32_t unhash(uint32_t v) const {
-        v*= modular_inverse(a);
+        v*= ia;
         v^= v>>16;
-        v*= modular_inverse(p);
+        v*= ip;
         v^= v>>16;
         return v;
       }
@@ -331,8 +457,10 @@ namespace whash{
   template<>
   class hash<uint64_t,void>{
     private:
-      const uint64_t  p = 0x5555555555555555ull;
-      const uint64_t  a = 15864664792644967873ull;
+      static constexpr uint64_t  p = 0x5555555555555555ull;
+      static constexpr uint64_t  a = 15864664792644967873ull;
+      static constexpr uint64_t  ip = modular_inverse(p);
+      static constexpr uint64_t  ia = modular_inverse(a);
     public:
       typedef typename true_type::type is_injective;
       typedef typename true_type::type unhash_defined;
@@ -347,9 +475,9 @@ namespace whash{
         return v;
       }  
       uint64_t constexpr unhash(uint64_t v) const {
-        v*= modular_inverse(a);
+        v*= ia;
         v^= v>>32;
-        v*= modular_inverse(p);
+        v*= ip;
         v^= v>>32;
         return v;
       }
@@ -491,17 +619,14 @@ namespace whash{
       }
   };
   
-  template<
-    class key_type,
-    class mapped_type,
-    class hash        = hash<key_type>,
-    class equal       = std::equal_to<key_type>,
-    class comp        = typename conditional<
+  template<class key_type,class hash>
+  using patchmap_default_comp = typename conditional<
       is_injective<hash,typename invoke_result<hash,key_type&>::type>::value,
       dummy_comp<key_type>,
-      std::less<key_type>>::type,
-    class alloc       = typename std::allocator
-    <
+      std::less<key_type>>::type;
+
+  template<class key_type,class mapped_type,class hash>
+  using patchmap_default_value_type =
       tuple
       <
         typename conditional<
@@ -518,24 +643,124 @@ namespace whash{
           std::true_type,
           mapped_type
         >::type
-      >
-    >
+      >;
+
+  template<class key_type,class mapped_type,class hash>
+  using patchmap_default_alloc =
+    typename std::allocator<patchmap_default_value_type<key_type,mapped_type,hash>>;
+
+  // The occupancy mask and the buckets of a patchmap share one allocation,
+  // made of units aligned for both. The mask words come first, followed by
+  // two summaries of one bit per mask word, whether it is full and whether
+  // it is not empty, and for fenced tables one fence per mask word, the
+  // buckets start at the next unit.
+  template<class value_type,class size_type,bool fenced=false>
+  struct alignas(
+      alignof(value_type)>alignof(size_type)?
+      alignof(value_type):alignof(size_type))
+  patchmap_storage_unit{
+    static constexpr size_t alignment =
+      alignof(value_type)>alignof(size_type)?
+      alignof(value_type):alignof(size_type);
+    unsigned char bytes[alignment];
+    static constexpr size_t mask_words(const size_t& n){
+      const size_t m = (n+digits<size_type>()-1)/digits<size_type>();
+      return m+2*((m+digits<size_type>()-1)/digits<size_type>())
+              +(fenced?m:0);
+    }
+    static constexpr size_t mask_units(const size_t& n){
+      return (mask_words(n)*sizeof(size_type)+alignment-1)/alignment;
+    }
+    static constexpr size_t units(const size_t& n){
+      return mask_units(n)+(n*sizeof(value_type)+alignment-1)/alignment;
+    }
+  };
+
+  // storage of tables with at most a few buckets, kept inside the patchmap
+  // object itself so that small tables need no allocation at all
+  template<class unit,size_t n>
+  struct patchmap_inline_storage{
+    unit block[n];
+    unit* units() { return block; }
+    const unit* units() const { return block; }
+  };
+
+  template<class unit>
+  struct patchmap_inline_storage<unit,0>{
+    unit* units() { return nullptr; }
+    const unit* units() const { return nullptr; }
+  };
+
+  // the inline storage of a patchmap, which is its base class so that it
+  // takes no room at all if inline_capacity is 0
+  template<
+    class alloc,
+    size_t inline_capacity,
+    bool fenced,
+    class unit = patchmap_storage_unit<
+      typename allocator_traits<alloc>::value_type,
+      typename allocator_traits<alloc>::size_type,
+      fenced>
   >
-  class patchmap{
+  using patchmap_inline_base =
+    patchmap_inline_storage<unit,unit::units(inline_capacity)>;
+
+  // access to the internals of a patchmap for the parallel algorithms of
+  // parallel_patchmap.hpp
+  template<class map_type>
+  class patchmap_parallel;
+
+  // access to the internals of a patchmap for the file format of
+  // patchmap_file.hpp
+  template<class map_type>
+  class patchmap_file;
+
+  // access to the internals of a patchmap for the streamed formats of
+  // patchmap_stream.hpp
+  template<class map_type>
+  class patchmap_stream;
+
+  // access to the internals of a patchmap for the set operations of
+  // patchmap_algebra.hpp
+  template<class map_type>
+  class patchmap_algebra;
+
+  template<
+    class key_type,
+    class mapped_type,
+    class hash        = hash<key_type>,
+    class equal       = std::equal_to<key_type>,
+    class comp        = patchmap_default_comp<key_type,hash>,
+    class alloc       = patchmap_default_alloc<key_type,mapped_type,hash>,
+    size_t inline_capacity = 0,
+    bool fenced       = false
+  >
+  class patchmap
+    : protected patchmap_inline_base<alloc,inline_capacity,fenced>{
     public:
       typedef alloc allocator_type;
-      typedef typename alloc::value_type value_type;
-      typedef typename alloc::pointer value_pointer;
-      typedef typename alloc::reference reference;
-      typedef typename alloc::const_reference const_reference;
-      typedef typename alloc::difference_type difference_type;
-      typedef typename alloc::size_type size_type;
+      typedef typename allocator_traits<alloc>::value_type value_type;
+      typedef typename allocator_traits<alloc>::pointer value_pointer;
+      typedef value_type& reference;
+      typedef const value_type& const_reference;
+      typedef typename allocator_traits<alloc>::difference_type difference_type;
+      typedef typename allocator_traits<alloc>::size_type size_type;
       typedef typename std::invoke_result<hash,key_type&>::type hash_type;
       typedef typename conditional<is_same<mapped_type,void>::value,
                                   std::true_type,
                                   mapped_type>::type
                                   _mapped_type;
-    private:
+    protected:
+      template<class,class,class,class,class,class,size_t,bool>
+      friend class patchmap;
+      template<class>
+      friend class patchmap_parallel;
+      template<class>
+      friend class patchmap_file;
+      template<class>
+      friend class patchmap_stream;
+      template<class>
+      friend class patchmap_algebra;
       template
       <
         size_type resize_nom  ,size_type resize_denom,
@@ -571,10 +796,15 @@ namespace whash{
       value_type * data;
       size_type  * mask;
       allocator_type allocator;
-      std::allocator<size_type> maskallocator;
       comp  comparator;
       equal equator;
       hash  hasher;
+      typedef patchmap_storage_unit<value_type,size_type,fenced> storage_unit;
+      typedef typename allocator_traits<alloc>::template
+        rebind_alloc<storage_unit> storage_allocator_type;
+      typedef allocator_traits<storage_allocator_type> storage_traits;
+      typedef patchmap_inline_base<alloc,inline_capacity,fenced>
+        inline_storage;
       using uphold_iterator_validity = true_type;
       // size_type const inline masksize() const {
       //  return (datasize+digits<size_type>()-1)/digits<size_type>();
@@ -712,19 +942,95 @@ namespace whash{
         const size_type m1 = (~size_type(0))<<(digits<size_type>()-l1-1);
         if (k0==k1) return ((m0&m1&mask[k0])!=0);
         if (((m0&mask[k0])!=0)||((m1&mask[k1])!=0)) return true;
-        for (size_type i = k0+1;i!=k1;++i)
-          if (mask[i]!=0) return true;
-        return false;
+        return next_word(used_words(),0,k0+1)<k1;
+      }
+      // one bit per mask word, set if the word is completely occupied
+      size_type inline * full_words() const {
+        return mask+masksize;
+      }
+      // one bit per mask word, set if any bucket of the word is occupied
+      size_type inline * used_words() const {
+        return mask+masksize+(masksize+digits<size_type>()-1)/digits<size_type>();
+      }
+      // for fenced tables the hash of the first occupied bucket of the block
+      // of buckets of each mask word, meaningless for empty blocks
+      size_type inline * fences() const {
+        return mask+masksize
+              +2*((masksize+digits<size_type>()-1)/digits<size_type>());
+      }
+      // recompute the fences of the blocks of buckets lo to hi, bucket i is
+      // reserved for a node with hash oi but not yet constructed
+      void inline update_fences(
+          const size_type& lo,
+          const size_type& hi,
+          const size_type& i  = ~size_type(0),
+          const hash_type& oi = hash_type(0)){
+        if constexpr (fenced) {
+          for (size_type k =lo/digits<size_type>();
+                         k<=hi/digits<size_type>();++k) {
+            if (mask[k]==0) continue;
+            const size_type f = k*digits<size_type>()+clz(mask[k]);
+            if (f==i) {
+              fences()[k] = oi;
+            } else if constexpr (unhash_defined<hash,hash_type>::value) {
+              fences()[k] = get<0>(data[f]);
+            } else {
+              fences()[k] = order(get<0>(data[f]));
+            }
+          }
+        }
+      }
+      void inline rebuild_fences(){
+        if (masksize) update_fences(0,datasize-1);
+      }
+      // index of the first mask word at or after k whose bit in summary,
+      // xored with flip, is set, or masksize if there is none
+      size_type inline next_word(
+          const size_type* summary,
+          const size_type& flip,
+          const size_type& k) const {
+        if (k>=masksize) return masksize;
+        const size_type n = (masksize+digits<size_type>()-1)/digits<size_type>();
+              size_type i = k/digits<size_type>();
+        const size_type w = (summary[i]^flip)<<(k%digits<size_type>());
+        if (w) return std::min(k+clz(w),masksize);
+        i = find_word_not(summary,i+1,n,flip);
+        if (i>=n) return masksize;
+        return std::min(i*digits<size_type>()+clz(summary[i]^flip),masksize);
+      }
+      // index of the last mask word at or before k whose bit in summary,
+      // xored with flip, is set, or ~size_type(0) if there is none
+      size_type inline prev_word(
+          const size_type* summary,
+          const size_type& flip,
+          const size_type& k) const {
+        if (k>=masksize) return ~size_type(0);
+              size_type i = k/digits<size_type>();
+        const size_type l = k%digits<size_type>();
+        const size_type w = (summary[i]^flip)>>(digits<size_type>()-l-1);
+        if (w) return k-ctz(w);
+        i = rfind_word_not(summary,i,flip);
+        if (i==~size_type(0)) return i;
+        return i*digits<size_type>()+digits<size_type>()-1
+              -ctz(summary[i]^flip);
       }
       void inline set(const size_type& n) {
         const size_type i = n/digits<size_type>();
         const size_type j = n%digits<size_type>();
         mask[i]|=size_type(1)<<(digits<size_type>()-j-1);
+        const size_type k = i/digits<size_type>();
+        const size_type b = size_type(1)<<(digits<size_type>()-i%digits<size_type>()-1);
+        used_words()[k]|=b;
+        if (mask[i]==~size_type(0)) full_words()[k]|=b;
       }
       void inline unset(const size_type& n) {
         const size_type i = n/digits<size_type>();
         const size_type j = n%digits<size_type>();
         mask[i]&=((~size_type(0))^(size_type(1)<<(digits<size_type>()-j-1)));
+        const size_type k = i/digits<size_type>();
+        const size_type b = size_type(1)<<(digits<size_type>()-i%digits<size_type>()-1);
+        full_words()[k]&=~b;
+        if (mask[i]==0) used_words()[k]&=~b;
       }
       void inline swap_set(const size_type& i,const size_type& j){
         if (is_set(i)==is_set(j)) return;
@@ -793,10 +1099,15 @@ namespace whash{
         const {
         return index_index_is_less(j,i);
       }
-      size_type inline find_first() const {
-        size_type i=0;
+      // search for the first occupied bucket at or after i
+      size_type inline find_next(size_type i) const {
         if (i>=datasize) return ~size_type(0);
         while(true){
+          if (mask[i/digits<size_type>()]==0) { // skip empty words at once
+            const size_type k = next_word(used_words(),0,i/digits<size_type>());
+            if (k>=masksize) return ~size_type(0);
+            i = k*digits<size_type>();
+          }
           const size_type k = i/digits<size_type>();
           const size_type l = i%digits<size_type>();
           const size_type m = (~size_type(0))>>l; 
@@ -810,9 +1121,38 @@ namespace whash{
           if (i>=datasize) return ~size_type(0);
         }
       }
+      size_type inline find_first() const {
+        return find_next(0);
+      }
+      // search for the last occupied bucket at or before i
+      size_type inline find_prev(size_type i) const {
+        if (i>=datasize) return ~size_type(0);
+        while(true){
+          if (mask[i/digits<size_type>()]==0) { // skip empty words at once
+            const size_type k = prev_word(used_words(),0,i/digits<size_type>());
+            if (k>=masksize) return ~size_type(0);
+            i = k*digits<size_type>()+digits<size_type>()-1;
+          }
+          const size_type k = i/digits<size_type>();
+          const size_type l = i%digits<size_type>();
+          const size_type m = (~size_type(0))<<(digits<size_type>()-l-1);
+          size_type p = (mask[k]&m)>>(digits<size_type>()-l-1);
+          if (k!=0) p|=shl(mask[k-1]&(~m),l+1);
+          const size_type s = ctz(p);
+          if (s==0) return i;
+          i-=s;
+          if (i>=datasize) return ~size_type(0);
+        }
+      }
       // search for free bucket in decreasing order
       size_type inline search_free_dec(size_type i) const {
         while(true){
+          if (mask[i/digits<size_type>()]==~size_type(0)) { // skip full words
+            const size_type k =
+              prev_word(full_words(),~size_type(0),i/digits<size_type>());
+            if (k>=masksize) return ~size_type(0);
+            i = k*digits<size_type>()+digits<size_type>()-1;
+          }
           const size_type k = i/digits<size_type>();
           const size_type l = i%digits<size_type>();
           const size_type m = (~size_type(0))<<(digits<size_type>()-l-1);
@@ -831,6 +1171,13 @@ namespace whash{
       // search for free bucket in increasing order
       size_type inline search_free_inc(size_type i) const {
         while(true){
+          if (mask[i/digits<size_type>()]==~size_type(0)) { // skip full words
+            const size_type k =
+              next_word(full_words(),~size_type(0),i/digits<size_type>());
+            if (k>=masksize) return ~size_type(0);
+            i = k*digits<size_type>();
+            if (i>=datasize) return ~size_type(0);
+          }
           const size_type k = i/digits<size_type>();
           const size_type l = i%digits<size_type>();
           const size_type m = (~size_type(0))>>l; 
@@ -859,6 +1206,9 @@ namespace whash{
       }
       // search for free bucket truly bidirectional
       // this is optimal vor very high load factors > 0.98
+      // it is not used by place_node, which takes search_free_bidir_v0, and
+      // is left scalar: it looks at one word on each side per step, and the
+      // searches of search_free_bidir_v0 skip full words by the summaries
       size_type inline search_free_bidir(const size_type& n) const {
         size_type i = n, j = n, si=~size_type(0),sj=~size_type(0);
         while(true){
@@ -901,21 +1251,22 @@ namespace whash{
         }
         return ~size_type(0);
       }
-      size_type const inline reserve_node(
+      // mark a bucket for a node with hash ok as occupied, shifting the nodes
+      // between it and the nearest free bucket, without counting it
+      size_type const inline place_node(
           const  key_type&   k,
           const hash_type&  ok,
           const size_type& mok
           ){
         if (!is_set(mok)) {
           set(mok);
-          ++num_data;
+          update_fences(mok,mok,mok,ok);
           return mok;
         }
         const size_type j = search_free_bidir_v0(mok);
         assert(j<datasize);
         assert(!is_set(j));
         set(j);
-        ++num_data;
         size_type i = j;
         while(true){
           if (i==0) break;
@@ -925,10 +1276,13 @@ namespace whash{
           } else {
             if (is_less(get<0>(data[i-1]),k,order(get<0>(data[i-1])),ok)) break; 
           }
-          swap(data[i],data[i-1]);
+          std::swap(data[i],data[i-1]);
           --i;
         }
-        if (i!=j) return i;
+        if (i!=j) {
+          update_fences(i,j,i,ok);
+          return i;
+        }
         while(true){
           if (i+1>=datasize) break;
           if (!is_set(i+1)) break;
@@ -937,11 +1291,52 @@ namespace whash{
           } else {
             if (is_less(k,get<0>(data[i+1]),ok,order(get<0>(data[i+1])))) break; 
           }
-          swap(data[i],data[i+1]);
+          std::swap(data[i],data[i+1]);
           ++i;
         }
+        update_fences(j,i,i,ok);
         return i;
       }
+      size_type const inline reserve_node(
+          const  key_type&   k,
+          const hash_type&  ok,
+          const size_type& mok
+          ){
+        ++num_data;
+        return place_node(k,ok,mok);
+      }
+      // free bucket i, shifting the nodes after or before it back towards
+      // their ideal bucket, without counting it
+      void inline remove_node(size_type i){
+        const size_type j = i;
+        while(true){
+          if (i+1==datasize) break;
+          if (!is_set(i+1)) break;
+          if constexpr (unhash_defined<hash,hash_type>::value) {
+            if (map(get<0>(data[i+1]))>i) break;
+          } else {
+            if (map(order(get<0>(data[i+1])))>i) break;
+          }
+          std::swap(data[i],data[i+1]);
+          ++i;
+        }
+        if (i==j){
+          while(true){
+            if (i==0) break;
+            if (!is_set(i-1)) break;
+            if constexpr (unhash_defined<hash,hash_type>::value) {
+              if (map(get<0>(data[i-1]))<i) break;  
+            } else {
+              if (map(order(get<0>(data[i-1])))<i) break;
+            }
+            std::swap(data[i],data[i-1]);
+            --i;
+          }
+        }
+        unset(i);
+        data[i]=value_type();
+        update_fences(std::min(i,j),std::max(i,j));
+      }
       size_type inline reserve_node(
           const key_type&   k,
           const hash_type& ok) {
@@ -969,7 +1364,7 @@ namespace whash{
         const size_type n   = clz(get<0>(lm));
         const size_type m   = digits<size_type>()-n;
         const hash_type den = (size_type(ohi)-size_type(olo))>>m;
-        const hash_type nom = (get<0>(lm)<<n)+(get<1>(lm)>>m);
+        const hash_type nom = shl(get<0>(lm),n)+(get<1>(lm)>>m);
         return lo+nom/den;
       }
 
@@ -1107,6 +1502,7 @@ namespace whash{
           omi =       get<0>(data[mok]);
         else
           omi = order(get<0>(data[mok]));
+        if constexpr (fenced) return find_node_fenced(k,ok,mok,omi);
         if (omi<ok) {
           return find_node_interpol(k,ok,mok,
               mok       ,omi          ,true ,
@@ -1117,6 +1513,57 @@ namespace whash{
               mok       ,          omi,true );
         }
       }
+
+      // bucket mok is occupied by a node with hash omi, the fences of the
+      // following or preceding blocks give the other bound of the search
+      size_type inline find_node_fenced(
+          const  key_type&   k,
+          const hash_type&  ok,
+          const size_type& mok,
+          const hash_type& omi) const {
+        size_type  lo = 0         ,  hi = datasize-1;
+        hash_type olo = 0         , ohi = ~hash_type(0);
+        bool is_set_lo = false    , is_set_hi = false;
+        if (omi<ok) {
+          lo = mok; olo = omi; is_set_lo = true;
+          for (size_type b=mok/digits<size_type>()+1;;++b) {
+            if ((b<masksize)&&(mask[b]==0)) b = next_word(used_words(),0,b);
+            if (b>=masksize) break;
+            const size_type f = b*digits<size_type>()+clz(mask[b]);
+            const hash_type of = fences()[b];
+            if (of>ok) {
+              hi = f; ohi = of; is_set_hi = true;
+              break;
+            }
+            if (of<ok) {
+              lo = f; olo = of;
+            } else if (is_equal({k,ok},get<0>(data[f]))) {
+              return f;
+            }
+          }
+        } else {
+          hi = mok; ohi = omi; is_set_hi = true;
+          for (size_type b=mok/digits<size_type>();;--b) {
+            if ((b<masksize)&&(mask[b]==0)) b = prev_word(used_words(),0,b);
+            if (b>=masksize) break;
+            const size_type f = b*digits<size_type>()+clz(mask[b]);
+            const hash_type of = fences()[b];
+            if (of<ok) {
+              lo = f; olo = of; is_set_lo = true;
+              break;
+            }
+            if (of>ok) {
+              hi = f; ohi = of;
+            } else if (is_equal({k,ok},get<0>(data[f]))) {
+              return f;
+            }
+            if (b==0) break;
+          }
+        }
+        return find_node_interpol(k,ok,mok,
+            lo,olo,is_set_lo,
+            hi,ohi,is_set_hi);
+      }
       
       size_type const inline find_node(
           const  key_type&  k,
@@ -1137,7 +1584,7 @@ namespace whash{
           for(size_type j=i;j!=0;--j){
             if (index_index_is_less(j-1,j)) break;
             swap_set(j,j-1);
-            swap(data[j],data[j-1]);
+            std::swap(data[j],data[j-1]);
           }
         }
       }
@@ -1158,23 +1605,128 @@ namespace whash{
            );
         return get<1>(hashmap.data[i]);
       }
+      bool inline is_inline() const {
+        return (inline_capacity!=0)
+             &&(reinterpret_cast<const storage_unit*>(mask)
+                ==inline_storage::units());
+      }
+      // mask and buckets for a table of size n, inline if they fit and the
+      // inline storage is not in use
+      void allocate_storage(
+          const size_type& n,
+          value_type*& data,
+          size_type*& mask) {
+        const size_type u = storage_unit::units(n);
+        storage_unit * p = nullptr;
+        if ((n<=inline_capacity)&&(!is_inline())) {
+          p = inline_storage::units();
+        } else if (u) {
+          storage_allocator_type storage_allocator(allocator);
+          p = &*storage_traits::allocate(storage_allocator,u);
+        }
+        mask = reinterpret_cast<size_type*>(p);
+        data = reinterpret_cast<value_type*>(p+storage_unit::mask_units(n));
+        const size_type m = storage_unit::mask_words(n);
+        for (size_type i=0;i!=m;++i) mask[i]=0;
+      }
+      void deallocate_storage(const size_type& n,size_type* mask) {
+        storage_unit * p = reinterpret_cast<storage_unit*>(mask);
+        if ((inline_capacity!=0)&&(p==inline_storage::units())) return;
+        const size_type u = storage_unit::units(n);
+        if (u==0) return;
+        storage_allocator_type storage_allocator(allocator);
+        storage_traits::deallocate(
+            storage_allocator,
+            std::pointer_traits<typename storage_traits::pointer>::pointer_to(*p),
+            u);
+      }
+      // move the contents of the inline storage to the heap, so it can be
+      // reused for the next table
+      void spill_inline() {
+        value_type * heap_data = nullptr;
+        size_type  * heap_mask = nullptr;
+        const size_type u = storage_unit::units(datasize);
+        if (u) {
+          storage_allocator_type storage_allocator(allocator);
+          storage_unit * p = &*storage_traits::allocate(storage_allocator,u);
+          heap_mask = reinterpret_cast<size_type*>(p);
+          heap_data =
+            reinterpret_cast<value_type*>(p+storage_unit::mask_units(datasize));
+        }
+        for (size_type i=0;i!=storage_unit::mask_words(datasize);++i)
+          heap_mask[i] = mask[i];
+        for (size_type i=0;i!=datasize;++i) if (is_set(i))
+          allocator_traits<alloc>::construct(allocator,heap_data+i,
+              std::move(data[i]));
+        data = heap_data;
+        mask = heap_mask;
+      }
+      // Whether steal can not throw, given the allocators are equal. An
+      // inline table is moved element by element.
+      static constexpr bool nothrow_steal =
+        (inline_capacity==0)
+      ||std::is_nothrow_move_constructible<value_type>::value;
+      // Whether move assignment can not throw. An allocator that does not
+      // propagate and may be unequal makes steal allocate a new table.
+      static constexpr bool nothrow_move_assignment = nothrow_steal
+      &&(allocator_traits<alloc>::propagate_on_container_move_assignment::value
+       ||allocator_traits<alloc>::is_always_equal::value);
+      // take over the table of other, which must not be this, leaving it
+      // empty; this must not hold any storage
+      void steal(patchmap& other) {
+        num_data = other.num_data;
+        datasize = other.datasize;
+        masksize = other.masksize;
+        if (other.is_inline()||(
+              (!allocator_traits<alloc>::is_always_equal::value)
+            &&(allocator!=other.allocator))) {
+          allocate_storage(datasize,data,mask);
+          for (size_type i=0;i!=storage_unit::mask_words(datasize);++i)
+            mask[i] = other.mask[i];
+          for (size_type i=0;i!=datasize;++i) if (is_set(i))
+            allocator_traits<alloc>::construct(allocator,data+i,
+                std::move(other.data[i]));
+          other.clear();
+          return;
+        }
+        data = other.data;
+        mask = other.mask;
+        other.num_data = 0;
+        other.datasize = 0;
+        other.masksize = 0;
+        other.data = nullptr;
+        other.mask = nullptr;
+      }
+      // copy the table of other, this must not hold any storage
+      void copy(const patchmap& other) {
+        num_data = other.num_data;
+        datasize = other.datasize;
+        masksize = other.masksize;
+        allocate_storage(datasize,data,mask);
+        if (datasize==0) return;
+        memcpy(reinterpret_cast<void*>(mask),
+               reinterpret_cast<void*>(other.mask),
+               storage_unit::mask_words(datasize)*sizeof(size_type));
+        if constexpr (is_trivially_copyable<value_type>::value)
+          memcpy(reinterpret_cast<void*>(data),
+                 reinterpret_cast<void*>(other.data),
+                 datasize*sizeof(value_type));
+        else for (size_type i=0;i!=datasize;++i) if (is_set(i))
+          allocator_traits<alloc>::construct(allocator,data+i,other.data[i]);
+      }
       void const resize_out_of_place(const size_type& n) {
+        if ((n<=inline_capacity)&&is_inline()) spill_inline();
         size_type old_datasize = n;
         size_type old_masksize =
           (old_datasize+digits<size_type>()-1)/digits<size_type>();
-        value_pointer old_data =
-          std::allocator_traits<alloc>::allocate(allocator,
-                                                     old_datasize);
-        size_type * old_mask =
-          std::allocator_traits<std::allocator<size_type>>::allocate(
-              maskallocator,
-              old_masksize);
-        for (size_type i=0;i!=old_masksize;++i) old_mask[i]=0;
+        value_type * old_data;
+        size_type  * old_mask;
+        allocate_storage(old_datasize,old_data,old_mask);
         num_data = 0;
-        swap(old_mask,mask);
-        swap(old_data,data);
-        swap(old_datasize,datasize);
-        swap(old_masksize,masksize);
+        std::swap(old_mask,mask);
+        std::swap(old_data,data);
+        std::swap(old_datasize,datasize);
+        std::swap(old_masksize,masksize);
         for (size_type n=0;n<old_datasize;++n) {
           const size_type i = n/digits<size_type>();
           const size_type j = n%digits<size_type>();
@@ -1182,7 +1734,7 @@ namespace whash{
             size_type l;
             if constexpr (unhash_defined<hash,hash_type>::value) {
               l = reserve_node(
-                  hasher.unhash(get<0>(data[n])),
+                  hasher.unhash(get<0>(old_data[n])),
                   get<0>(old_data[n]));
             } else {
               l = reserve_node(get<0>(old_data[n]));
@@ -1192,16 +1744,7 @@ namespace whash{
           }
         }
         assert(check_ordering());
-        std::allocator_traits<std::allocator<size_type>>::deallocate(
-            maskallocator,
-            old_mask,
-            old_masksize
-            );
-        std::allocator_traits<alloc>::deallocate(
-            allocator,
-            old_data,
-            old_datasize
-            );
+        deallocate_storage(old_datasize,old_mask);
       }
 #if 0
       void const resize_inplace(const size_type& n) {
@@ -1253,42 +1796,29 @@ namespace whash{
 #endif
     public:
       // constructor
-      patchmap(const size_type& datasize = 0)
-        :datasize(datasize)
+      patchmap(
+          const size_type& datasize = inline_capacity,
+          const allocator_type& allocator = allocator_type())
+        :datasize(datasize),mask(nullptr),allocator(allocator)
       {
         num_data = 0;
         masksize = (datasize+digits<size_type>()-1)/digits<size_type>();
-        if (datasize) {
-          data = allocator_traits<alloc>::allocate(allocator,datasize);
-        } else {
-          data = nullptr;
-        }
-        if (masksize) {
-          mask = allocator_traits<std::allocator<size_type>>::allocate(
-              maskallocator,
-              masksize);
-        } else {
-          mask = nullptr;
-        }
-        for (size_type i=0;i!=masksize;++i) mask[i]=0;
+        allocate_storage(datasize,data,mask);
       }
+      explicit patchmap(const allocator_type& allocator)
+        :patchmap(inline_capacity,allocator) {}
       ~patchmap(){                                 // destructor
-        allocator_traits<std::allocator<size_type>>::deallocate(
-            maskallocator,
-            mask,
-            masksize);
-        allocator_traits<alloc>::deallocate(allocator,data,datasize);
+        deallocate_storage(datasize,mask);
       }
-      patchmap(patchmap&& other) noexcept          // move constructor
+      patchmap(patchmap&& other) noexcept(nothrow_steal) // move constructor
+        :mask(nullptr),allocator(std::move(other.allocator))
       {
-        mask = nullptr;
-        masksize = 0;
-        data = nullptr;
-        datasize = 0;
-        swap(mask,other.mask);
-        swap(data,other.data);
-        swap(datasize,other.datasize);
-        swap(masksize,other.masksize);
+        steal(other);
+      }
+      patchmap(patchmap&& other,const allocator_type& allocator)
+        :mask(nullptr),allocator(allocator)
+      {
+        steal(other);
       }
       template<
         class key_type_other,
@@ -1296,7 +1826,9 @@ namespace whash{
         class hash_other,
         class equal_other,
         class comp_other,
-        class alloc_other
+        class alloc_other,
+        size_t inline_capacity_other,
+        bool fenced_other
               >
       inline patchmap& operator=                   // copy assignment
         (const patchmap<
@@ -1305,7 +1837,9 @@ namespace whash{
            hash_other,
            equal_other,
            comp_other,
-           alloc_other
+           alloc_other,
+           inline_capacity_other,
+           fenced_other
          >& other)
       {
         typedef patchmap<
@@ -1314,33 +1848,26 @@ namespace whash{
            hash_other,
            equal_other,
            comp_other,
-           alloc_other
+           alloc_other,
+           inline_capacity_other,
+           fenced_other
          > other_type;
-        allocator_traits<std::allocator<size_type>>::deallocate(
-            maskallocator,
-            data,
-            masksize);
-        allocator_traits<alloc>::deallocate(allocator,data,datasize);
+        deallocate_storage(datasize,mask);
+        mask = nullptr;
         num_data = other.num_data;
         datasize = other.datasize;
         masksize = other.masksize;
-        if (masksize)
-          mask = allocator_traits<std::allocator<size_type>>::allocate(
-            maskallocator,
-            masksize);
-        else mask = nullptr;
-        for (size_type i=0;i!=masksize;++i) mask[i]=0;
-        if (datasize)
-          data = allocator_traits<alloc>::allocate(allocator,datasize);
-        else data = nullptr;
+        allocate_storage(datasize,data,mask);
         if constexpr (
             is_same<hash , hash_other>::value
           &&is_same<equal,equal_other>::value
           &&is_same<comp , comp_other>::value
           ){
+          // the fences, if any, come after the words both layouts share
           memcpy(reinterpret_cast<void*>(mask),
                  reinterpret_cast<void*>(other.mask),
-                 masksize*sizeof(size_t));
+                 patchmap_storage_unit<value_type,size_type>::
+                 mask_words(datasize)*sizeof(size_type));
           if constexpr (
               is_trivially_copyable<value_type>::value
             &&is_same<value_type,typename other_type::value_type>::value)
@@ -1348,47 +1875,67 @@ namespace whash{
                    reinterpret_cast<void*>(other.data),
                    datasize*sizeof(value_type));
           else for (size_type i=0;i!=datasize;++i) data[i]=other.data[i];
+          rebuild_fences();
         } else {
+          num_data = 0;
           for (auto it=other.begin();it!=other.end();++it) insert(*it);
         }
+        return *this;
       }
-      patchmap(const patchmap& other){             // copy constructor
-        num_data = other.num_data;
-        datasize = other.datasize;
-        masksize = other.masksize;
-        if (masksize)
-          mask = allocator_traits<std::allocator<size_type>>::allocate(
-              maskallocator,
-              masksize);
-        else
-          mask = nullptr;
-        for (size_type i=0;i!=masksize;++i) mask[i]=0;
-        if (datasize)
-          data = allocator_traits<alloc>::allocate(allocator,datasize);
-        else data = nullptr;
-        memcpy(reinterpret_cast<void*>(mask),
-               reinterpret_cast<void*>(other.mask),
-               masksize*sizeof(size_t));
-          if constexpr (is_trivially_copyable<value_type>::value)
-            memcpy(reinterpret_cast<void*>(data),
-                   reinterpret_cast<void*>(other.data),
-                   datasize*sizeof(value_type));
-        else for (size_type i=0;i!=datasize;++i) data[i]=other.data[i];
+      patchmap(const patchmap& other)              // copy constructor
+        :mask(nullptr),
+         allocator(allocator_traits<alloc>::
+           select_on_container_copy_construction(other.allocator))
+      {
+        copy(other);
+      }
+      patchmap(const patchmap& other,const allocator_type& allocator)
+        :mask(nullptr),allocator(allocator)
+      {
+        copy(other);
       }
       inline patchmap& operator=                   // copy assignment
         (const patchmap& other)
       {
-        return *this = patchmap(other);
+        if (this==&other) return *this;
+        deallocate_storage(datasize,mask);
+        mask = nullptr;
+        if constexpr (
+            allocator_traits<alloc>::propagate_on_container_copy_assignment::value)
+          allocator = other.allocator;
+        copy(other);
+        return *this;
       }
       inline patchmap& operator=                   // move assignment
         (patchmap&& other)
-        noexcept{
-        swap(mask,other.mask);
-        swap(data,other.data);
-        swap(datasize,other.datasize);
-        swap(masksize,other.masksize);
+        noexcept(nothrow_move_assignment){
+        if (this==&other) return *this;
+        deallocate_storage(datasize,mask);
+        mask = nullptr;
+        if constexpr (
+            allocator_traits<alloc>::propagate_on_container_move_assignment::value)
+          allocator = std::move(other.allocator);
+        steal(other);
         return *this;
       }
+      void swap(patchmap& other){
+        if constexpr (
+            allocator_traits<alloc>::propagate_on_container_swap::value) {
+          if ((!is_inline())&&(!other.is_inline())) {
+            using std::swap;
+            swap(num_data,other.num_data);
+            swap(datasize,other.datasize);
+            swap(masksize,other.masksize);
+            swap(data,other.data);
+            swap(mask,other.mask);
+            swap(allocator,other.allocator);
+            return;
+          }
+        }
+        patchmap tmp(std::move(other),other.allocator);
+        other = std::move(*this);
+        *this = std::move(tmp);
+      }
       void print() const {
         cerr << datasize << " " << num_data << endl;
         for (size_type i=0;i!=datasize;++i) {
@@ -1417,35 +1964,9 @@ namespace whash{
           const  key_type&   k,
           const hash_type&  ok,
           const size_type& mok){
-        size_type i = find_node(k,ok,mok);
+        const size_type i = find_node(k,ok,mok);
         if (i>=datasize) return 0;
-        const size_type j = i;
-        while(true){
-          if (i+1==datasize) break;
-          if (!is_set(i+1)) break;
-          if constexpr (unhash_defined<hash,hash_type>::value) {
-            if (map(get<0>(data[i+1]))>i) break;
-          } else {
-            if (map(order(get<0>(data[i+1])))>i) break;
-          }
-          swap(data[i],data[i+1]);
-          ++i;
-        }
-        if (i==j){
-          while(true){
-            if (i==0) break;
-            if (!is_set(i-1)) break;
-            if constexpr (unhash_defined<hash,hash_type>::value) {
-              if (map(get<0>(data[i-1]))<i) break;  
-            } else {
-              if (map(order(get<0>(data[i-1])))<i) break;
-            }
-            swap(data[i],data[i-1]);
-            --i;
-          }
-        }
-        unset(i);
-        data[i]=value_type();
+        remove_node(i);
         --num_data;
         assert(num_data<datasize);
         assert(check_ordering());
@@ -1460,7 +1981,8 @@ namespace whash{
         return erase(k,ok);
       }
       void inline clear(){
-        for (size_type i=0;i!=masksize;++i) mask[i]=0;
+        for (size_type i=0;i!=storage_unit::mask_words(datasize);++i)
+          mask[i]=0;
         num_data=0;
       }
       void const resize(const size_type& n){
@@ -1484,6 +2006,20 @@ namespace whash{
                << i << " " << j << endl;
           ordered = false;
         }
+        if constexpr (fenced) {
+          for (size_type k=0;k<masksize;++k) {
+            if (mask[k]==0) continue;
+            const size_type f = k*digits<size_type>()+clz(mask[k]);
+            hash_type of;
+            if constexpr (unhash_defined<hash,hash_type>::value)
+              of = get<0>(data[f]);
+            else
+              of = order(get<0>(data[f]));
+            if (fences()[k]==size_type(of)) continue;
+            cout << "fence " << k << " is stale" << endl;
+            ordered = false;
+          }
+        }
         if (!ordered) print();
         return ordered;
       }
@@ -1554,7 +2090,9 @@ namespace whash{
                class hash_other,
                class equal_other,
                class comp_other,
-               class alloc_other
+               class alloc_other,
+               size_t inline_capacity_other,
+               bool fenced_other
               >
       bool operator==(
           const patchmap<
@@ -1563,14 +2101,17 @@ namespace whash{
             hash_other,
             equal_other,
             comp_other,
-            alloc_other>& other)
+            alloc_other,
+            inline_capacity_other,
+            fenced_other>& other)
       const {
-        if (datasize!=other.datasize) return false;
+        if (size()!=other.size()) return false;
         if constexpr (
             is_same<hash , hash_other>::value
           &&is_same<equal,equal_other>::value
           &&is_same<comp , comp_other>::value
           ){
+          // both are in hash order, whatever their number of buckets
           auto it0 = begin();
           auto it1 = other.begin();
           while (true){
@@ -1580,7 +2121,11 @@ namespace whash{
           }
         } else {
           for (auto it=other.begin();it!=other.end();++it){
-            if (nount(it->first)) if (at(it->first)==it->second) continue;
+            if constexpr (is_same<mapped_type,void>::value) {
+              if (count(*it)) continue;
+            } else {
+              if (count(it->first)) if (at(it->first)==it->second) continue;
+            }
             return false;
           }
           return true;
@@ -1591,7 +2136,9 @@ namespace whash{
                class hash_other,
                class equal_other,
                class comp_other,
-               class alloc_other
+               class alloc_other,
+               size_t inline_capacity_other,
+               bool fenced_other
               >
       bool operator!=(
           const patchmap<
@@ -1600,7 +2147,9 @@ namespace whash{
             hash_other,
             equal_other,
             comp_other,
-            alloc_other>& o)
+            alloc_other,
+            inline_capacity_other,
+            fenced_other>& o)
       const{ return !((*this)==o); }
       equal key_eq() const{ // get key equivalence predicate
         return equal{};
@@ -1627,6 +2176,7 @@ namespace whash{
         private:
           void inline update_hint(){
             if constexpr (!uphold_iterator_validity::value) return;
+            if (hint==~size_type(0)) return; // end stays end
             if (hint<map->datasize) {
               if constexpr (unhash_defined<hash,hash_type>::value) {
                 if (map->equator(map->hasher.unhash(get<0>(map->data[hint])),key))
@@ -1638,122 +2188,99 @@ namespace whash{
             hint = map->find_node(key);
             if (hint>=map->datasize) hint = ~size_type(0);
           }
-          void inline unsafe_increment(){ // assuming hint is valid
-            if (++hint>=map->datasize){
-              hint=~size_type(0);
-              return;
-            }
-            while(true){
-              const size_type k = hint/digits<size_type>();
-              const size_type l = hint%digits<size_type>();
-              const size_type m = (~size_type(0))>>l; 
-              assert(k<map->masksize);
-              size_type p = (map->mask[k]&m)<<l;
-              if (k+1<map->masksize)
-                p|=shr(map->mask[k+1]&(~m),digits<size_type>()-l);
-              const size_type s = clz(p);
-              if (s==0) break;
-              hint+=s;
-              if (hint>=map->datasize){
-                hint=~size_type(0);
-                return;
-              }
-            }
-            if constexpr (is_same<mapped_type,void>::value) {
-              if constexpr (unhash_defined<hash,hash_type>::value) {
-                key = map->hasher.unhash(get<0>(map->data[hint]));
-              } else {
-                key = get<0>(map->data[hint]);
-              }
+          void inline load_key(){
+            if constexpr (unhash_defined<hash,hash_type>::value) {
+              key = map->hasher.unhash(get<0>(map->data[hint]));
             } else {
-              if constexpr (unhash_defined<hash,hash_type>::value) {
-                key = map->hasher.unhash(get<0>(map->data[hint]));
-              } else {
-                key = get<0>(map->data[hint]);
-              }
+              key = get<0>(map->data[hint]);
             }
           }
+          void inline unsafe_increment(){ // assuming hint is valid
+            hint = map->find_next(hint+1);
+            if (hint>=map->datasize) return;
+            load_key();
+          }
           void inline unsafe_decrement(){ // assuming hint is valid
-            if (--hint>=map->datasize){
-              hint=~size_type(0);
-              return;
-            }
-            while(true){
-              const size_type k = hint/digits<size_type>();
-              const size_type l = hint%digits<size_type>();
-              const size_type m = (~size_type(0))<<(digits<size_type>()-l-1);
-              assert(k<map->masksize);
-              size_type p = (map->mask[k]&m)>>(digits<size_type>()-l-1);
-              if (k!=0) p|=shl(map->mask[k-1]&(~m),l+1);
-              const size_type s = ctz(p);
-              if (s==0) break;
-              hint-=s;
-              if (hint>=map->datasize){
-                hint=~size_type(0);
-                return;
-              }
-            }
-            key = map->data[hint].first;
+            hint = map->find_prev(hint-1);
+            if (hint>=map->datasize) return;
+            load_key();
           }
+          // *this-it, counting the elements in between with popcount
           template<bool is_const_other>
-            difference_type inline friend diff(
-                const_noconst_iterator<is_const>& it0,
-                const_noconst_iterator<is_const_other>& it1){
-              if (it1<it0) return -diff(it0,it1);
-              it0.update_hint();
-              it1.update_hint();
-              const size_type k0 = it0->hint/digits<size_type>();
-              const size_type l0 = it0->hint%digits<size_type>();
-              const size_type m0 = (~size_type(0))>>l0;
-              const size_type k1 = it1->hint/digits<size_type>();
-              const size_type l1 = it1->hint%digits<size_type>();
-              const size_type m1 = (~size_type(0))<<(digits<size_type>()-l1-1);
-              if (k0==k1) return popcount(m0&m1&it0.map->mask[k0])-1;
-            size_type d = popcount(m0&it0.map->mask[k0])
-                         +popcount(m1&it1.map->mask[k1]);
-            for (size_type i = k0+1;i!=k1;++i)
-              d+=popcount(it0.map->mask[i]);
-            return d;
-          }
-          void inline add(const size_type& n){
+          difference_type inline diff(const_noconst_iterator<is_const_other>& it){
             update_hint();
+            it.update_hint();
+            size_type lo = std::min(hint,map->datasize);
+            size_type hi = std::min(it.hint,map->datasize);
+            if (lo==hi) return 0;
+            const bool ahead = hi<lo;
+            if (ahead) std::swap(lo,hi);
+            // count the elements in [lo,hi)
+            const size_type* mask = map->mask;
+            const size_type k0 = lo/digits<size_type>();
+            const size_type l0 = lo%digits<size_type>();
+            const size_type k1 = hi/digits<size_type>();
+            const size_type l1 = hi%digits<size_type>();
+            const size_type m0 = (~size_type(0))>>l0;
+            const size_type m1 = shl(~size_type(0),digits<size_type>()-l1);
+            difference_type d;
+            if (k0==k1) {
+              d = popcount(mask[k0]&m0&m1);
+            } else {
+              d = popcount(mask[k0]&m0)+popcount_words(mask,k0+1,k1);
+              if (l1) d+=popcount(mask[k1]&m1);
+            }
+            return ahead?d:-d;
+          }
+          // advance by n elements, skipping whole mask words by popcount and
+          // selecting within the last word
+          void inline add(size_type n){
+            if (n==0) return;
+            update_hint();
+            if (hint>=map->datasize) return;
                   size_type k = hint/digits<size_type>();
             const size_type l = hint%digits<size_type>();
-            const size_type m = (~size_type(0))>>l;
-                  size_type i = 0;
-                  size_type p = popcount(map->mask[k]&m)-1; 
-            while (i+p<n){
-              if (++k>=map->mapsize){
+                  size_type w = map->mask[k]&shr(~size_type(0),l+1);
+                  size_type p = popcount(w);
+            while (p<n) {
+              n-=p;
+              if (++k>=map->masksize){
                 hint=~size_type(0);
                 return;
               }
-              hint+=digits<size_type>();
-              p = popcount(map->mask[k]);
+              w = map->mask[k];
+              p = popcount(w);
             }
-            for (;i!=n;++i) unsafe_increment();
-            key = map->data[hint].first;
+            hint = k*digits<size_type>()+select_bit(w,size_type(n-1));
+            load_key();
           }
-          void inline sub(const size_type& n){
+          // step back by n elements, the end iterator steps back from
+          // datasize
+          void inline sub(size_type n){
+            if (n==0) return;
             update_hint();
-                  size_type k = hint/digits<size_type>();
-            const size_type l = hint%digits<size_type>();
-            const size_type m = (~size_type(0))<<(digits<size_type>()-l-1);
-                  size_type i = 0;
-                  size_type p = popcount(map->mask[k]&m)-1;
-            while (i+p<n) {
-              if (--k>=map->mapsize){
+            const size_type i = std::min(hint,map->datasize);
+                  size_type k = i/digits<size_type>();
+            const size_type l = i%digits<size_type>();
+                  size_type w = (k<map->masksize)?
+                    map->mask[k]&shl(~size_type(0),digits<size_type>()-l):0;
+                  size_type p = popcount(w);
+            while (p<n) {
+              n-=p;
+              if (k--==0){
                 hint=~size_type(0);
                 return;
               }
-              hint+=digits<size_type>();
-              p = popcount(map->mask[k]);
+              w = map->mask[k];
+              p = popcount(w);
             }
-            for (;i!=n;++i) unsafe_decrement();
-            key = map->data[hint].first;
+            hint = k*digits<size_type>()+select_bit(w,size_type(p-n));
+            load_key();
           }
         public:
-          typedef typename alloc::difference_type difference_type;
-          typedef typename alloc::value_type value_type;
+          typedef typename allocator_traits<alloc>::difference_type
+            difference_type;
+          typedef typename allocator_traits<alloc>::value_type value_type;
           typedef typename conditional<
             is_const,
             typename conditional<
@@ -1818,9 +2345,9 @@ namespace whash{
           const_noconst_iterator(
               const_noconst_iterator<is_const_other>&& o) noexcept{
             //cout << "move constructor" << endl;
-            swap(hint,o.hint);
-            swap(key,o.key);
-            swap(map,o.map);
+            std::swap(hint,o.hint);
+            std::swap(key,o.key);
+            std::swap(map,o.map);
           }
           // copy assignment
           template<bool is_const_other>
@@ -1922,7 +2449,7 @@ namespace whash{
               const const_noconst_iterator<is_const_other>& o) const {
             iterator it0(*this);
             iterator it1(o);
-            return diff(it0,it1);
+            return it0.diff(it1);
           }
           const_noconst_iterator<is_const>& operator+=(const size_type& n){
             add(n);
@@ -2054,8 +2581,8 @@ namespace whash{
     typedef const_noconst_iterator<false> iterator;
     typedef const_noconst_iterator<true>  const_iterator;    
     iterator begin(){
-      if (datasize==0) return end();
       const size_type i = find_first();
+      if (i>=datasize) return end();
       if constexpr (unhash_defined<hash,hash_type>::value) {
         return iterator(i,hasher.unhash(get<0>(data[i])),this);
       } else {
@@ -2063,8 +2590,8 @@ namespace whash{
       }
     }
     const_iterator begin() const {
-      if (datasize==0) return end();
       const size_type i = find_first();
+      if (i>=datasize) return end();
       if constexpr (unhash_defined<hash,hash_type>::value) {
         return const_iterator(i,hasher.unhash(get<0>(data[i])),this);
       } else {
@@ -2072,8 +2599,8 @@ namespace whash{
       }
     }
     const_iterator cbegin() const {
-      if (datasize==0) return cend();
       const size_type i = find_first();
+      if (i>=datasize) return cend();
       if constexpr (unhash_defined<hash,hash_type>::value) {
         return const_iterator(i,hasher.unhash(get<0>(data[i])),this);
       } else {
@@ -2081,7 +2608,6 @@ namespace whash{
       }
     }
     iterator end() {
-      const size_type i = find_first();
       return iterator(~size_type(0),this);
     }
     const_iterator end() const {
@@ -2090,7 +2616,6 @@ namespace whash{
     const_iterator cend() const {
       return const_iterator(~size_type(0),this);
     }
-    // void swap(unpatchmap&); // TODO
     size_type max_size()         const {
       return std::numeric_limits<size_type>::max();
     }
@@ -2246,17 +2771,82 @@ namespace whash{
     }
   }; 
 
-  /* TODO
-  template<class K,
-           class T,
-           class hash=hash_functor<K>,
-           class equal = std::equal_to<K>,
-           class comp = std::less<K>,
-           class A = std::allocator<std::pair<K,T>>
-          >
-  void swap(patchmap<K,K,hash,equal,comp,A>&,
-            patchmap<K,K,hash,equal,comp,A>&);
-  */
-  
+  // a patchmap that keeps tables of up to inline_capacity buckets inside the
+  // object and only allocates once it outgrows them
+  template<
+    class key_type,
+    class mapped_type,
+    size_t inline_capacity,
+    class hash        = hash<key_type>,
+    class equal       = std::equal_to<key_type>
+  >
+  using small_patchmap = patchmap<
+    key_type,
+    mapped_type,
+    hash,
+    equal,
+    patchmap_default_comp<key_type,hash>,
+    patchmap_default_alloc<key_type,mapped_type,hash>,
+    inline_capacity
+  >;
+
+  // a patchmap that also keeps the lowest hash of every block of 64 buckets,
+  // one more word per 64 buckets, so that a lookup finds both bounds of its
+  // search within one or two blocks without probing the buckets in between
+  template<
+    class key_type,
+    class mapped_type,
+    class hash        = hash<key_type>,
+    class equal       = std::equal_to<key_type>
+  >
+  using fenced_patchmap = patchmap<
+    key_type,
+    mapped_type,
+    hash,
+    equal,
+    patchmap_default_comp<key_type,hash>,
+    patchmap_default_alloc<key_type,mapped_type,hash>,
+    0,
+    true
+  >;
+
+  template<
+    class key_type,
+    class mapped_type,
+    class hash,
+    class equal,
+    class comp,
+    class alloc,
+    size_t inline_capacity,
+    bool fenced
+  >
+  void swap(
+      patchmap<key_type,mapped_type,hash,equal,comp,alloc,inline_capacity,fenced>& a,
+      patchmap<key_type,mapped_type,hash,equal,comp,alloc,inline_capacity,fenced>& b){
+    a.swap(b);
+  }
+
+  namespace pmr{
+    // a patchmap that takes its storage from a std::pmr::memory_resource,
+    // e.g. a monotonic_buffer_resource that frees many tables at once
+    template<
+      class key_type,
+      class mapped_type,
+      class hash        = whash::hash<key_type>,
+      class equal       = std::equal_to<key_type>,
+      size_t inline_capacity = 0
+    >
+    using patchmap = whash::patchmap<
+      key_type,
+      mapped_type,
+      hash,
+      equal,
+      patchmap_default_comp<key_type,hash>,
+      std::pmr::polymorphic_allocator<
+        patchmap_default_value_type<key_type,mapped_type,hash>
+      >,
+      inline_capacity
+    >;
+  }
 }
 #endif // ORDERED_PATCH_MAP_H
@@ -0,0 +1,299 @@
+#ifndef PATCH_MAP_ALGEBRA_H
+#define PATCH_MAP_ALGEBRA_H
+
+#include <vector>
+#include "parallel_patchmap.hpp"
+
+namespace whash{
+
+  template<class map_type>
+  class patchmap_algebra;
+
+  // Set operations between two patchmaps of the same type, which hash and
+  // order their keys alike. Both tables are swept once in hash order, like
+  // sorted ranges by the algorithms of the same name in <algorithm>, and
+  // the result, coming out in hash order too, is placed by
+  // patchmap_parallel::assign_sorted, each element in its ideal bucket or
+  // right after the one before. The result is cleared and sized for its
+  // elements.
+  template<
+    class key_type,
+    class mapped_type,
+    class hash,
+    class equal,
+    class comp,
+    class alloc,
+    size_t inline_capacity,
+    bool fenced
+  >
+  class patchmap_algebra<patchmap<
+    key_type,
+    mapped_type,
+    hash,
+    equal,
+    comp,
+    alloc,
+    inline_capacity,
+    fenced
+  >>{
+    public:
+      typedef patchmap<
+        key_type,
+        mapped_type,
+        hash,
+        equal,
+        comp,
+        alloc,
+        inline_capacity,
+        fenced
+      > map_type;
+      typedef typename map_type::size_type size_type;
+      typedef typename map_type::hash_type hash_type;
+      typedef typename map_type::value_type value_type;
+      typedef typename map_type::_mapped_type _mapped_type;
+      static constexpr size_type none = ~size_type(0);
+      // bytes of a table that are taken to stay in the cache
+      static constexpr size_t cached = size_t(1)<<22;
+      static hash_type ok_at(const map_type& map,const size_type& i){
+        if constexpr (unhash_defined<hash,hash_type>::value) {
+          return get<0>(map.data[i]);
+        } else {
+          return map.order(get<0>(map.data[i]));
+        }
+      }
+      static key_type key_at(const map_type& map,const size_type& i){
+        if constexpr (unhash_defined<hash,hash_type>::value) {
+          return map.hasher.unhash(get<0>(map.data[i]));
+        } else {
+          return get<0>(map.data[i]);
+        }
+      }
+      // Call f(i,j) for the buckets i of a and j of b of each key in hash
+      // order, i or j being none if only the other table holds it, until f
+      // returns false.
+      template<class F>
+      static void sweep(const map_type& a,const map_type& b,F&& f){
+        size_type i = a.find_next(0);
+        size_type j = b.find_next(0);
+        hash_type oi = i<a.datasize?ok_at(a,i):0;
+        hash_type oj = j<b.datasize?ok_at(b,j):0;
+        while ((i<a.datasize)||(j<b.datasize)) {
+          bool take_i = j>=b.datasize, take_j = i>=a.datasize;
+          if (!(take_i||take_j)) {
+            if (oi!=oj) {
+              take_i = oi<oj;
+              take_j = oj<oi;
+            } else if (is_injective<hash,hash_type>::value
+                     ||a.is_equal({key_at(a,i),oi},get<0>(b.data[j]))) {
+              take_i = take_j = true;
+            } else {
+              take_i = a.is_less(key_at(a,i),key_at(b,j),oi,oj);
+              take_j = !take_i;
+            }
+          }
+          if (!f(take_i?i:none,take_j?j:none)) return;
+          if (take_i&&((i=a.find_next(i+1))<a.datasize)) oi = ok_at(a,i);
+          if (take_j&&((j=b.find_next(j+1))<b.datasize)) oj = ok_at(b,j);
+        }
+      }
+      // whether a holds all keys of b
+      static bool includes(const map_type& a,const map_type& b){
+        if (b.size()>a.size()) return false;
+        bool all = true;
+        sweep(a,b,[&](const size_type& i,const size_type&){
+            return all = i!=none;
+          });
+        return all;
+      }
+      // Put the elements of a and b for whose keys keep(in_a,in_b) holds
+      // into out, which is neither of them, with combine(va,vb) giving the
+      // value of a key held by both.
+      template<class K,class C>
+      static void assign(
+          const map_type& a,
+          const map_type& b,
+          map_type& out,
+          K&& keep,
+          C&& combine){
+        assert((&out!=&a)&&(&out!=&b));
+        vector<pair<size_type,size_type>> picked;
+        sweep(a,b,[&](const size_type& i,const size_type& j){
+            if (keep(i!=none,j!=none)) picked.emplace_back(i,j);
+            return true;
+          });
+        patchmap_parallel<map_type>::assign_sorted(out,picked.size(),
+            [&](const size_t& s){
+              const auto& [i,j] = picked[s];
+              return i!=none?ok_at(a,i):ok_at(b,j);
+            },
+            [&](const size_t& s){
+              const auto& [i,j] = picked[s];
+              return i!=none?key_at(a,i):key_at(b,j);
+            },
+            [&](const size_t& s,const size_type& k){
+              const auto& [i,j] = picked[s];
+              if (j==none) {
+                allocator_traits<alloc>::construct(out.allocator,out.data+k,
+                    a.data[i]);
+              } else if (i==none) {
+                allocator_traits<alloc>::construct(out.allocator,out.data+k,
+                    b.data[j]);
+              } else {
+                allocator_traits<alloc>::construct(out.allocator,out.data+k,
+                    get<0>(a.data[i]),
+                    combine(get<1>(a.data[i]),get<1>(b.data[j])));
+              }
+            },1);
+      }
+      // Call f(j,value) for the keys keys[0,n), with a pointer to the value
+      // of keys[j] or nullptr. A table of at most cached bytes is probed in
+      // the order of the keys. Larger ones are probed in roughly hash order:
+      // the hashes are sorted by a radix sort of only as many of their top
+      // bits as tell apart the buckets, or the keys if there are fewer, so
+      // that the lookups start at increasing buckets and read the table in
+      // one sweep. No position is carried from one probe to the next, each
+      // key is looked up on its own from its ideal bucket by find_node.
+      template<class F>
+      static void probe_sorted(
+          const map_type& map,
+          const key_type* keys,
+          const size_t& n,
+          F&& f){
+        if (map.datasize*sizeof(value_type)<=cached) {
+          for (size_t j=0;j!=n;++j) {
+            const size_type i = map.find_node(keys[j]);
+            f(j,i<map.datasize?&get<1>(map.data[i]):nullptr);
+          }
+          return;
+        }
+        struct probe{
+          hash_type ok;
+          size_t j;
+        };
+        constexpr size_t radix = 13;
+        const size_t bits = std::min(size_t(digits<hash_type>()),
+            size_t(log2(uint64_t(std::min(size_t(map.datasize),n))))+1);
+        unique_ptr<probe[]> probes(new probe[n]), sorted(new probe[n]);
+        for (size_t j=0;j!=n;++j) probes[j] = {map.order(keys[j]),j};
+        vector<size_t> bin(size_t(1)<<radix);
+        for (size_t low=0;low<bits;low+=radix) {
+          const size_t shift = digits<hash_type>()-bits+low;
+          const size_t digit = (size_t(1)<<std::min(radix,bits-low))-1;
+          std::fill(bin.begin(),bin.begin()+digit+1,0);
+          for (size_t s=0;s!=n;++s) ++bin[(probes[s].ok>>shift)&digit];
+          size_t at = 0;
+          for (size_t b=0;b<=digit;++b) {
+            const size_t c = bin[b];
+            bin[b] = at;
+            at+=c;
+          }
+          for (size_t s=0;s!=n;++s)
+            sorted[bin[(probes[s].ok>>shift)&digit]++] = probes[s];
+          probes.swap(sorted);
+        }
+        for (size_t s=0;s!=n;++s) {
+          const auto& [ok,j] = probes[s];
+          const size_type i = map.find_node(keys[j],ok);
+          f(j,i<map.datasize?&get<1>(map.data[i]):nullptr);
+        }
+      }
+  };
+
+  // the first value, the one in a, for keys held by both tables
+  struct keep_first{
+    template<class T>
+    const T& operator()(const T& a,const T&) const { return a; }
+  };
+
+  // whether a holds all keys of b
+  template<class map_type>
+  bool includes(const map_type& a,const map_type& b){
+    return patchmap_algebra<map_type>::includes(a,b);
+  }
+
+  // the elements of a and b in out, combine(va,vb) giving the value of a
+  // key held by both; out may be neither a nor b, for this and the
+  // following operations
+  template<class map_type,class C>
+  void merge(const map_type& a,const map_type& b,map_type& out,C&& combine){
+    patchmap_algebra<map_type>::assign(a,b,out,
+        [](const bool&,const bool&){ return true; },combine);
+  }
+
+  template<class map_type,class C>
+  map_type merge(const map_type& a,const map_type& b,C&& combine){
+    map_type out;
+    merge(a,b,out,combine);
+    return out;
+  }
+
+  // the elements of a and those of b whose keys are not in a in out
+  template<class map_type>
+  void set_union(const map_type& a,const map_type& b,map_type& out){
+    merge(a,b,out,keep_first());
+  }
+
+  template<class map_type>
+  map_type set_union(const map_type& a,const map_type& b){
+    map_type out;
+    set_union(a,b,out);
+    return out;
+  }
+
+  // the elements of a whose keys are in b in out
+  template<class map_type>
+  void set_intersection(const map_type& a,const map_type& b,map_type& out){
+    patchmap_algebra<map_type>::assign(a,b,out,
+        [](const bool& in_a,const bool& in_b){ return in_a&&in_b; },
+        keep_first());
+  }
+
+  template<class map_type>
+  map_type set_intersection(const map_type& a,const map_type& b){
+    map_type out;
+    set_intersection(a,b,out);
+    return out;
+  }
+
+  // the elements of a whose keys are not in b in out
+  template<class map_type>
+  void set_difference(const map_type& a,const map_type& b,map_type& out){
+    patchmap_algebra<map_type>::assign(a,b,out,
+        [](const bool& in_a,const bool& in_b){ return in_a&&!in_b; },
+        keep_first());
+  }
+
+  template<class map_type>
+  map_type set_difference(const map_type& a,const map_type& b){
+    map_type out;
+    set_difference(a,b,out);
+    return out;
+  }
+
+  // Look up the keys keys[0,n) of a large batch, calling f(j,value) with a
+  // pointer to the value of keys[j] or nullptr. Tables larger than the cache
+  // are probed in roughly hash order so that they are read in one sweep,
+  // smaller ones in the order of the keys.
+  template<class map_type,class key_type,class F>
+  void probe_sorted(
+      const map_type& map,
+      const key_type* keys,
+      const size_t& n,
+      F&& f){
+    patchmap_algebra<map_type>::probe_sorted(map,keys,n,f);
+  }
+
+  // out[j] points to the value of keys[j] or is nullptr
+  template<class map_type,class key_type>
+  void probe_sorted(
+      const map_type& map,
+      const vector<key_type>& keys,
+      vector<const typename map_type::_mapped_type*>& out){
+    out.resize(keys.size());
+    patchmap_algebra<map_type>::probe_sorted(map,keys.data(),keys.size(),
+        [&out](const size_t& j,const typename map_type::_mapped_type* v){
+          out[j] = v;
+        });
+  }
+}
+#endif // PATCH_MAP_ALGEBRA_H
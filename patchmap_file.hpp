@@ -0,0 +1,580 @@
+#ifndef PATCH_MAP_FILE_H
+#define PATCH_MAP_FILE_H
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "patchmap.hpp"
+#if defined(__unix__)||defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/falloc.h>
+#endif
+#else
+#error "patchmap_file.hpp needs mmap"
+#endif
+
+namespace whash{
+
+  // A patchmap file starts with this header, in the byte order of the
+  // machine that wrote it. At offset, a multiple of 4096, follow the mask
+  // words with their summaries and fences, and then the buckets, exactly as
+  // a patchmap holds them in memory, so that a table can be used right from
+  // a mapping of the file. A file that is being modified has state
+  // modified until its next checkpoint.
+  struct patchmap_file_header{
+    static constexpr uint32_t current_version = 1;
+    static constexpr uint32_t native_order    = 0x01020304;
+    static constexpr uint32_t clean           = 0;
+    static constexpr uint32_t modified        = 1;
+    char     magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t datasize;
+    uint64_t num_data;
+    uint32_t size_size;
+    uint32_t key_size;
+    uint32_t mapped_size;
+    uint32_t value_size;
+    uint32_t hash_size;
+    uint32_t alignment;
+    uint32_t fenced;
+    uint32_t state;
+    uint64_t hash_identity; // hashes of a few probe keys
+    uint64_t offset;        // of the mask words from the start of the file
+    uint64_t mask_bytes;
+    uint64_t data_bytes;
+  };
+
+  // A file mapped into memory, read only or shared writable.
+  class patchmap_mapping{
+    private:
+      int fd = -1;
+      unsigned char* base = nullptr;
+      size_t length = 0;
+      bool writable = false;
+      string path;
+      [[noreturn]] static void fail(const string& what,const string& path){
+        throw std::runtime_error(
+            string(typeid(patchmap_mapping).name())+": "
+            +what+" "+path+": "+std::strerror(errno));
+      }
+    public:
+      patchmap_mapping() = default;
+      patchmap_mapping(const string& path,const bool& writable)
+        :patchmap_mapping(::open(path.c_str(),writable?O_RDWR:O_RDONLY),
+                          path,writable) {}
+      // map the file open as fd, which is closed with the mapping, as the
+      // shared memory objects of shm_open are
+      patchmap_mapping(const int& fd,const string& path,const bool& writable)
+        :fd(fd),writable(writable),path(path) {
+        if (fd<0) fail("can not open",path);
+        struct stat st;
+        if (fstat(fd,&st)!=0) {
+          ::close(fd);
+          fail("can not stat",path);
+        }
+        length = st.st_size;
+        if (length==0) return;
+        void* p = mmap(nullptr,length,PROT_READ|(writable?PROT_WRITE:0),
+                       MAP_SHARED,fd,0);
+        if (p==MAP_FAILED) {
+          ::close(fd);
+          fail("can not map",path);
+        }
+        base = static_cast<unsigned char*>(p);
+      }
+      patchmap_mapping(const patchmap_mapping&) = delete;
+      patchmap_mapping& operator=(const patchmap_mapping&) = delete;
+      patchmap_mapping(patchmap_mapping&& other) noexcept { swap(other); }
+      patchmap_mapping& operator=(patchmap_mapping&& other) noexcept {
+        swap(other);
+        return *this;
+      }
+      ~patchmap_mapping(){
+        if (base) munmap(base,length);
+        if (fd>=0) ::close(fd);
+      }
+      void swap(patchmap_mapping& other) noexcept {
+        std::swap(fd,other.fd);
+        std::swap(base,other.base);
+        std::swap(length,other.length);
+        std::swap(writable,other.writable);
+        std::swap(path,other.path);
+      }
+      unsigned char* data() const { return base; }
+      size_t size() const { return length; }
+      int descriptor() const { return fd; }
+      // change the size of a writable file and its mapping, which may move,
+      // bytes beyond the old end are zero
+      void resize(const size_t& n){
+        if (ftruncate(fd,n)!=0) fail("can not resize",path);
+        void* p;
+#ifdef __linux__
+        if (base) p = mremap(base,length,n,MREMAP_MAYMOVE);
+        else p = mmap(nullptr,n,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+#else
+        if (base) munmap(base,length);
+        p = mmap(nullptr,n,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+#endif
+        if (p==MAP_FAILED) fail("can not map",path);
+        base = static_cast<unsigned char*>(p);
+        length = n;
+      }
+      // map the file anew after another process changed its size
+      void refresh(){
+        struct stat st;
+        if (fstat(fd,&st)!=0) fail("can not stat",path);
+        const size_t n = st.st_size;
+        if (n==length) return;
+        const int prot = PROT_READ|(writable?PROT_WRITE:0);
+        void* p;
+#ifdef __linux__
+        if (base) p = mremap(base,length,n,MREMAP_MAYMOVE);
+        else p = mmap(nullptr,n,prot,MAP_SHARED,fd,0);
+#else
+        if (base) munmap(base,length);
+        p = mmap(nullptr,n,prot,MAP_SHARED,fd,0);
+#endif
+        if (p==MAP_FAILED) fail("can not map",path);
+        base = static_cast<unsigned char*>(p);
+        length = n;
+      }
+      // write the n bytes at offset back to the file and wait for it
+      void sync(const size_t& offset,const size_t& n) const {
+        const size_t page = sysconf(_SC_PAGESIZE);
+        const size_t lo = offset/page*page;
+        if (n&&msync(base+lo,offset+n-lo,MS_SYNC)!=0)
+          fail("can not sync",path);
+      }
+      // give the storage of the n bytes at offset back, they read as zeros
+      // afterwards; only a hint where holes in files are not supported
+      void release(const size_t& offset,const size_t& n) const {
+#ifdef __linux__
+        if (n) fallocate(fd,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,offset,n);
+#endif
+      }
+  };
+
+  template<
+    class key_type,
+    class mapped_type,
+    class hash,
+    class equal,
+    class comp,
+    class alloc,
+    size_t inline_capacity,
+    bool fenced
+  >
+  class patchmap_file<patchmap<
+    key_type,
+    mapped_type,
+    hash,
+    equal,
+    comp,
+    alloc,
+    inline_capacity,
+    fenced
+  >>{
+    public:
+      typedef patchmap<
+        key_type,
+        mapped_type,
+        hash,
+        equal,
+        comp,
+        alloc,
+        inline_capacity,
+        fenced
+      > map_type;
+      typedef typename map_type::size_type size_type;
+      typedef typename map_type::hash_type hash_type;
+      typedef typename map_type::value_type value_type;
+      typedef typename map_type::_mapped_type _mapped_type;
+      typedef typename map_type::storage_unit storage_unit;
+      typedef typename std::tuple_element<0,value_type>::type stored_key_type;
+      static_assert(
+          is_trivially_copyable<
+            typename std::tuple_element<0,value_type>::type>::value
+        &&is_trivially_copyable<
+            typename std::tuple_element<1,value_type>::type>::value,
+          "only patchmaps of trivially copyable elements can be files");
+      // the mask words start on a page of their own
+      static constexpr uint64_t offset = 4096;
+      // tells apart hash functions, or seeds of one, that would order the
+      // same keys differently
+      static uint64_t hash_identity(const map_type& map){
+        uint64_t id = 0;
+        for (const unsigned char b : {0x00,0x01,0x5a,0xff}) {
+          unsigned char bytes[sizeof(key_type)];
+          std::memset(bytes,b,sizeof(key_type));
+          key_type k;
+          std::memcpy(&k,bytes,sizeof(key_type));
+          id = rol(id,16)^uint64_t(map.order(k));
+        }
+        return id;
+      }
+      // bytes of the mask words with summaries and fences and of the
+      // buckets of a table of n buckets, each padded to whole storage units
+      static uint64_t mask_bytes(const size_type& n){
+        return storage_unit::mask_units(n)*sizeof(storage_unit);
+      }
+      static uint64_t data_bytes(const size_type& n){
+        return storage_unit::units(n)*sizeof(storage_unit)-mask_bytes(n);
+      }
+      static patchmap_file_header header(const map_type& map){
+        patchmap_file_header h;
+        std::memset(&h,0,sizeof(h));
+        std::memcpy(h.magic,"PATCHMAP",8);
+        h.version       = patchmap_file_header::current_version;
+        h.byte_order    = patchmap_file_header::native_order;
+        h.datasize      = map.datasize;
+        h.num_data      = map.num_data;
+        h.size_size     = sizeof(size_type);
+        h.key_size      = sizeof(stored_key_type);
+        h.mapped_size   = sizeof(_mapped_type);
+        h.value_size    = sizeof(value_type);
+        h.hash_size     = sizeof(hash_type);
+        h.alignment     = storage_unit::alignment;
+        h.fenced        = fenced;
+        h.hash_identity = hash_identity(map);
+        h.offset        = offset;
+        h.mask_bytes    = mask_bytes(map.datasize);
+        h.data_bytes    = data_bytes(map.datasize);
+        return h;
+      }
+      // throws if a file with header h can not be used as a map_type
+      static void check(
+          const map_type& map,
+          const patchmap_file_header& h,
+          const size_t& length,
+          const string& path){
+        string what;
+        if (length<sizeof(h)||std::memcmp(h.magic,"PATCHMAP",8))
+          what = "is not a patchmap file";
+        else if (h.version!=patchmap_file_header::current_version)
+          what = "has unknown version "+to_string(h.version);
+        else if (h.byte_order!=patchmap_file_header::native_order)
+          what = "has foreign byte order";
+        else if (h.state!=patchmap_file_header::clean)
+          what = "was modified after its last checkpoint";
+        else if ((h.offset<offset)||(h.offset%offset))
+          what = "has a misaligned table";
+        else {
+          patchmap_file_header e = header(map);
+          e.offset     = h.offset;
+          e.datasize   = h.datasize;
+          e.num_data   = h.num_data;
+          e.mask_bytes = mask_bytes(h.datasize);
+          e.data_bytes = data_bytes(h.datasize);
+          if (std::memcmp(&e,&h,sizeof(h)))
+            what = "does not hold a table of this type";
+          else if (length<h.offset+h.mask_bytes+h.data_bytes)
+            what = "is truncated";
+        }
+        if (what.size())
+          throw std::runtime_error(
+              string(typeid(map_type).name())+": "+path+" "+what);
+      }
+      // Write map to path. The file is written next to it first and then
+      // renamed, so readers see either the old or the new file.
+      static void save(const map_type& map,const string& path){
+        const string tmp = path+".tmp";
+        FILE* f = std::fopen(tmp.c_str(),"wb");
+        if (f==nullptr)
+          throw std::runtime_error(
+              string(typeid(map_type).name())+": can not write "+tmp);
+        const patchmap_file_header h = header(map);
+        vector<unsigned char> buffer(offset,0);
+        std::memcpy(buffer.data(),&h,sizeof(h));
+        bool ok = std::fwrite(buffer.data(),1,offset,f)==offset;
+        if (h.mask_bytes)
+          ok &= std::fwrite(map.mask,1,h.mask_bytes,f)==h.mask_bytes;
+        // free buckets are written as zeros
+        const size_type chunk = 1<<12;
+        buffer.assign(chunk*sizeof(value_type),0);
+        for (size_type i=0;i<map.datasize;i+=chunk) {
+          const size_type n = std::min(chunk,map.datasize-i);
+          std::fill(buffer.begin(),buffer.end(),0);
+          for (size_type j=0;j!=n;++j)
+            if (map.is_set(i+j))
+              std::memcpy(buffer.data()+j*sizeof(value_type),
+                          reinterpret_cast<const void*>(map.data+i+j),
+                          sizeof(value_type));
+          ok &= std::fwrite(buffer.data(),sizeof(value_type),n,f)==n;
+        }
+        const size_t padding = h.data_bytes-map.datasize*sizeof(value_type);
+        std::fill(buffer.begin(),buffer.end(),0);
+        if (padding) ok &= std::fwrite(buffer.data(),1,padding,f)==padding;
+        ok &= std::fclose(f)==0;
+        if ((!ok)||std::rename(tmp.c_str(),path.c_str()))
+          throw std::runtime_error(
+              string(typeid(map_type).name())+": can not write "+path);
+      }
+      // let map use the table described by h in the file mapped at base, map
+      // must not hold any buckets and has to be detached before it is
+      // destroyed
+      static void attach(
+          map_type& map,
+          unsigned char* base,
+          const patchmap_file_header& h){
+        map.datasize = h.datasize;
+        map.masksize = (h.datasize+digits<size_type>()-1)/digits<size_type>();
+        map.num_data = h.num_data;
+        map.mask = reinterpret_cast<size_type*>(base+h.offset);
+        map.data = reinterpret_cast<value_type*>(
+            base+h.offset+h.mask_bytes);
+      }
+      static void attach(
+          map_type& map,
+          const patchmap_mapping& file,
+          const string& path){
+        patchmap_file_header h;
+        if (file.size()>=sizeof(h)) std::memcpy(&h,file.data(),sizeof(h));
+        check(map,h,file.size(),path);
+        attach(map,file.data(),h);
+      }
+      static void detach(map_type& map){
+        map.datasize = 0;
+        map.masksize = 0;
+        map.num_data = 0;
+        map.mask = nullptr;
+        map.data = nullptr;
+      }
+      // the hash of the element in bucket i
+      static hash_type ok_at(const map_type& map,const size_type& i){
+        if constexpr (unhash_defined<hash,hash_type>::value) {
+          return get<0>(map.data[i]);
+        } else {
+          return map.order(get<0>(map.data[i]));
+        }
+      }
+      // The header of an empty table of n buckets appended to file, whose
+      // header is h. The file is extended by it and its mapping may move.
+      static patchmap_file_header append(
+          patchmap_mapping& file,
+          const patchmap_file_header& h,
+          const size_type& n){
+        patchmap_file_header a = h;
+        a.offset     = (file.size()+offset-1)/offset*offset;
+        a.datasize   = n;
+        a.num_data   = 0;
+        a.mask_bytes = mask_bytes(n);
+        a.data_bytes = data_bytes(n);
+        file.resize(a.offset+a.mask_bytes+a.data_bytes);
+        return a;
+      }
+      // Rebuild the table of the file path, which may have been changed
+      // after its last checkpoint by a process that died, and mark the file
+      // as clean. The occupied buckets are inserted one by one into a new
+      // table appended to the file, so the counts, the word summaries and
+      // the fences are made anew and copies of an element left by an
+      // interrupted shift are dropped. Returns the number of elements.
+      static size_type recover(const string& path){
+        patchmap_mapping file(path,true);
+        map_type old(0), table(0);
+        patchmap_file_header h;
+        if (file.size()>=sizeof(h)) std::memcpy(&h,file.data(),sizeof(h));
+        h.state = patchmap_file_header::clean;
+        check(old,h,file.size(),path);
+        patchmap_file_header r = append(file,h,h.datasize);
+        attach(old,file.data(),h);
+        attach(table,file.data(),r);
+        table.rebuild_fences();
+        for (size_type i=0;i!=old.datasize;++i) {
+          if (!old.is_set(i)) continue;
+          const hash_type ok = ok_at(old,i);
+          size_type j;
+          if constexpr (unhash_defined<hash,hash_type>::value) {
+            const key_type k = old.hasher.unhash(get<0>(old.data[i]));
+            if (table.find_node(k,ok)<table.datasize) continue;
+            j = table.reserve_node(k,ok);
+          } else {
+            const key_type& k = get<0>(old.data[i]);
+            if (table.find_node(k,ok)<table.datasize) continue;
+            j = table.reserve_node(k);
+          }
+          std::memcpy(reinterpret_cast<void*>(table.data+j),
+                      reinterpret_cast<const void*>(old.data+i),
+                      sizeof(value_type));
+        }
+        const bool ordered = table.check_ordering();
+        r.num_data = table.size();
+        detach(old);
+        detach(table);
+        if (!ordered)
+          throw std::runtime_error(string(typeid(map_type).name())+": "
+                                   +path+" can not be recovered");
+        file.sync(r.offset,r.mask_bytes+r.data_bytes);
+        std::memcpy(file.data(),&r,sizeof(r));
+        file.sync(0,sizeof(r));
+        file.release(h.offset,h.mask_bytes+h.data_bytes);
+        return r.num_data;
+      }
+      // the size to grow map to before the next insertion, or 0 if it has
+      // room enough
+      static size_type next_size(const map_type& map){
+        typename map_type::sizing_policy policy(map.num_data,map.datasize);
+        if (policy.is_sufficient()) return 0;
+        return policy.nextsize();
+      }
+      // the size to grow map to for room for n elements, or 0 if it has
+      // room enough
+      static size_type reserve_size(const map_type& map,const size_type& n){
+        if ((3*n<2*(map.num_data+1))||(n*3/2<=map.datasize)) return 0;
+        return n*3/2;
+      }
+      // Put the elements of from into the empty table to. They are visited
+      // in hash order, so each one goes to its ideal bucket or right after
+      // the one before, apart from those running over the end.
+      static void rehash(const map_type& from,map_type& to){
+        size_type j = 0;
+        vector<size_type> spill;
+        for (size_type i=from.find_next(0);
+             i<from.datasize;
+             i=from.find_next(i+1)) {
+          j = std::max(j,to.map(ok_at(from,i)));
+          if (j>=to.datasize) {
+            spill.push_back(i);
+            continue;
+          }
+          std::memcpy(reinterpret_cast<void*>(to.data+j),
+                      reinterpret_cast<const void*>(from.data+i),
+                      sizeof(value_type));
+          to.set(j++);
+          ++to.num_data;
+        }
+        to.rebuild_fences();
+        for (const size_type& i : spill) {
+          if constexpr (unhash_defined<hash,hash_type>::value) {
+            j = to.reserve_node(from.hasher.unhash(get<0>(from.data[i])),
+                                get<0>(from.data[i]));
+          } else {
+            j = to.reserve_node(get<0>(from.data[i]));
+          }
+          std::memcpy(reinterpret_cast<void*>(to.data+j),
+                      reinterpret_cast<const void*>(from.data+i),
+                      sizeof(value_type));
+        }
+      }
+      // Move map, the table of file, to a table of n buckets appended to the
+      // file, in hash order. publish(h) has to switch the header of the file
+      // to the new table h, the old one is given back as a hole afterwards.
+      template<class F>
+      static void grow(
+          patchmap_mapping& file,
+          map_type& map,
+          const size_type& n,
+          F&& publish){
+        patchmap_file_header old_header;
+        std::memcpy(&old_header,file.data(),sizeof(old_header));
+        detach(map);
+        patchmap_file_header h = append(file,old_header,n);
+        map_type old(0);
+        attach(old,file.data(),old_header);
+        attach(map,file.data(),h);
+        rehash(old,map);
+        detach(old);
+        h.num_data = map.size();
+        publish(h);
+        file.release(old_header.offset,
+                     old_header.mask_bytes+old_header.data_bytes);
+      }
+      template<class K>
+      static const _mapped_type* find(const map_type& map,const K& k){
+        const size_type i = map.find_node(k);
+        if (i>=map.datasize) return nullptr;
+        return &get<1>(map.data[i]);
+      }
+      // The value of k, or nullptr. Elements are never displaced
+      // across a free bucket, so k is in the run of occupied buckets around
+      // its ideal bucket, which is bisected by hash. Unlike find_node this
+      // divides by nothing read from the table and looks at no bucket
+      // outside of it, so it is safe on a table another process is writing
+      // meanwhile, whose result only has to be discarded then.
+      template<class K>
+      static const _mapped_type* find_stable(const map_type& map,const K& k){
+        constexpr size_type d = digits<size_type>();
+        if (map.datasize==0) return nullptr;
+        const hash_type  ok = map.order(k);
+        const size_type mok = map.map(ok);
+        if (!map.is_set(mok)) return nullptr;
+        size_type k0 = mok/d, k1 = mok/d;
+        size_type w0 = (~map.mask[k0])&((~size_type(0))<<(d-1-mok%d));
+        size_type w1 = (~map.mask[k1])&((~size_type(0))>>(mok%d));
+        while ((w0==0)&&(k0!=0)) w0 = ~map.mask[--k0];
+        while ((w1==0)&&(++k1<map.masksize)) w1 = ~map.mask[k1];
+        size_type lo = w0?k0*d+d-ctz(w0):0;
+        size_type hi = w1?std::min(map.datasize,k1*d+clz(w1)):map.datasize;
+        while (lo<hi) {
+          const size_type mi = lo+(hi-lo)/2;
+          if (ok_at(map,mi)<ok) lo = mi+1;
+          else hi = mi;
+        }
+        for (;(lo<map.datasize)&&map.is_set(lo)&&(ok_at(map,lo)==ok);++lo)
+          if (map.is_equal({k,ok},get<0>(map.data[lo])))
+            return &get<1>(map.data[lo]);
+        return nullptr;
+      }
+  };
+
+  // write map to a file that patchmap_view can map
+  template<class map_type>
+  void save_patchmap(const map_type& map,const string& path){
+    patchmap_file<map_type>::save(map,path);
+  }
+
+  // Make the file of a persistent_patchmap whose process died after a
+  // change usable again, returns the number of elements it holds.
+  template<class map_type>
+  size_t recover_patchmap(const string& path){
+    return patchmap_file<map_type>::recover(path);
+  }
+
+  // A read only patchmap right in the mapping of a file written by
+  // save_patchmap, nothing is read until it is looked at, and processes
+  // viewing the same file share its pages.
+  template<class map_type>
+  class patchmap_view{
+    private:
+      typedef patchmap_file<map_type> file_type;
+      patchmap_mapping file;
+      map_type table;
+    public:
+      typedef typename map_type::size_type size_type;
+      typedef typename file_type::_mapped_type mapped_type;
+      explicit patchmap_view(const string& path)
+        :file(path,false),table(0) {
+        file_type::attach(table,file,path);
+      }
+      patchmap_view(const patchmap_view&) = delete;
+      patchmap_view& operator=(const patchmap_view&) = delete;
+      ~patchmap_view(){ file_type::detach(table); }
+      const map_type& operator*()  const { return  table; }
+      const map_type* operator->() const { return &table; }
+      template<class key_type>
+      const mapped_type* find(const key_type& k) const {
+        return file_type::find(table,k);
+      }
+      template<class key_type>
+      size_type count(const key_type& k) const { return find(k)!=nullptr; }
+      template<class key_type>
+      const mapped_type& at(const key_type& k) const {
+        const mapped_type* v = find(k);
+        if (v==nullptr) throw std::out_of_range(
+            std::string(typeid(*this).name())
+            +".at(key_type k) key not found"
+           );
+        return *v;
+      }
+      size_type size() const { return table.size(); }
+      bool empty() const { return table.empty(); }
+  };
+}
+#endif // PATCH_MAP_FILE_H
@@ -0,0 +1,1060 @@
+#ifndef PATCH_MAP_STREAM_H
+#define PATCH_MAP_STREAM_H
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "parallel_patchmap.hpp"
+#if defined(__unix__)||defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+namespace whash{
+
+  // A streamed patchmap is this header followed by chunks, each of them a
+  // chunk header and the elements of a range of buckets in table order,
+  // every element as its key and then its value. All integers, including
+  // keys and values of integral type, are written little endian with a
+  // fixed width, so a stream can be read on machines of any byte order and
+  // word size. Other keys and values are copied as they are.
+  struct patchmap_stream_header{
+    static constexpr uint32_t current_version = 1;
+    static constexpr size_t   bytes           = 36;
+    char     magic[8];
+    uint32_t version;
+    uint32_t key_size;
+    uint32_t mapped_size;  // 0 for a set
+    uint64_t count;
+    uint64_t chunks;
+  };
+
+  // A chunk can be checked and decoded on its own.
+  struct patchmap_stream_chunk{
+    static constexpr size_t bytes = 24;
+    uint64_t count;
+    uint64_t length;       // of the elements in bytes
+    uint64_t checksum;     // of the elements
+  };
+
+  // A snapshot is this header followed by chunks like those of a streamed
+  // patchmap, but of the compressed hashes of the keys and of the values.
+  struct patchmap_snapshot_header{
+    static constexpr uint32_t current_version = 1;
+    static constexpr size_t   bytes           = 44;
+    char     magic[8];
+    uint32_t version;
+    uint32_t hash_size;
+    uint32_t mapped_size;  // 0 for a set
+    uint64_t count;
+    uint64_t chunks;
+    uint64_t hash_identity; // hashes of a few probe keys
+  };
+
+  // where a streamed patchmap is written to or read from
+  class patchmap_ostream{
+    public:
+      virtual ~patchmap_ostream() = default;
+      virtual void write(const unsigned char* p,const size_t& n) = 0;
+  };
+  class patchmap_istream{
+    public:
+      virtual ~patchmap_istream() = default;
+      virtual void read(unsigned char* p,const size_t& n) = 0;
+  };
+
+  template<class map_type>
+  class patchmap_stream;
+
+  template<
+    class key_type,
+    class mapped_type,
+    class hash,
+    class equal,
+    class comp,
+    class alloc,
+    size_t inline_capacity,
+    bool fenced
+  >
+  class patchmap_stream<patchmap<
+    key_type,
+    mapped_type,
+    hash,
+    equal,
+    comp,
+    alloc,
+    inline_capacity,
+    fenced
+  >>{
+    public:
+      typedef patchmap<
+        key_type,
+        mapped_type,
+        hash,
+        equal,
+        comp,
+        alloc,
+        inline_capacity,
+        fenced
+      > map_type;
+      typedef typename map_type::size_type size_type;
+      typedef typename map_type::hash_type hash_type;
+      typedef typename map_type::_mapped_type _mapped_type;
+      static constexpr bool is_set = is_same<void,mapped_type>::value;
+      static_assert(
+          is_trivially_copyable<key_type>::value
+        &&is_trivially_copyable<_mapped_type>::value,
+          "only patchmaps of trivially copyable keys and values can be "
+          "streamed");
+      static constexpr size_t key_size    = sizeof(key_type);
+      static constexpr size_t mapped_size = is_set?0:sizeof(_mapped_type);
+      static constexpr size_t element_size = key_size+mapped_size;
+      [[noreturn]] static void fail(const string& what){
+        throw std::runtime_error(
+            string(typeid(map_type).name())+": "+what);
+      }
+      template<class T>
+      static void store_le(unsigned char* p,const T& x){
+        if constexpr (is_integral<T>::value&&(sizeof(T)>1)) {
+          const typename make_unsigned<T>::type u = x;
+          for (size_t i=0;i!=sizeof(T);++i) p[i] = u>>(8*i);
+        } else {
+          std::memcpy(p,&x,sizeof(T));
+        }
+      }
+      template<class T>
+      static T load_le(const unsigned char* p){
+        if constexpr (is_integral<T>::value&&(sizeof(T)>1)) {
+          typename make_unsigned<T>::type u = 0;
+          for (size_t i=0;i!=sizeof(T);++i)
+            u|= typename make_unsigned<T>::type(p[i])<<(8*i);
+          return T(u);
+        } else {
+          T x;
+          std::memcpy(&x,p,sizeof(T));
+          return x;
+        }
+      }
+      // a word at a time, for telling damaged chunks apart, not for
+      // protection against deliberate changes
+      static uint64_t checksum(const unsigned char* p,size_t n){
+        uint64_t h = n;
+        const auto mix = [&h](const uint64_t& w){
+          h = (h^w)*uint64_t(0x9e3779b97f4a7c15ull);
+          h^= h>>32;
+        };
+        for (;n>=8;n-=8,p+=8) mix(load_le<uint64_t>(p));
+        uint64_t w = 0;
+        for (size_t i=0;i!=n;++i) w|=uint64_t(p[i])<<(8*i);
+        mix(w);
+        return h;
+      }
+      static void store(unsigned char* p,const patchmap_stream_header& h){
+        std::memcpy(p,h.magic,8);
+        store_le(p+ 8,h.version);
+        store_le(p+12,h.key_size);
+        store_le(p+16,h.mapped_size);
+        store_le(p+20,h.count);
+        store_le(p+28,h.chunks);
+      }
+      static patchmap_stream_header load_header(const unsigned char* p){
+        patchmap_stream_header h;
+        std::memcpy(h.magic,p,8);
+        h.version     = load_le<uint32_t>(p+ 8);
+        h.key_size    = load_le<uint32_t>(p+12);
+        h.mapped_size = load_le<uint32_t>(p+16);
+        h.count       = load_le<uint64_t>(p+20);
+        h.chunks      = load_le<uint64_t>(p+28);
+        return h;
+      }
+      static void store(unsigned char* p,const patchmap_snapshot_header& h){
+        std::memcpy(p,h.magic,8);
+        store_le(p+ 8,h.version);
+        store_le(p+12,h.hash_size);
+        store_le(p+16,h.mapped_size);
+        store_le(p+20,h.count);
+        store_le(p+28,h.chunks);
+        store_le(p+36,h.hash_identity);
+      }
+      static patchmap_snapshot_header load_snapshot_header(
+          const unsigned char* p){
+        patchmap_snapshot_header h;
+        std::memcpy(h.magic,p,8);
+        h.version       = load_le<uint32_t>(p+ 8);
+        h.hash_size     = load_le<uint32_t>(p+12);
+        h.mapped_size   = load_le<uint32_t>(p+16);
+        h.count         = load_le<uint64_t>(p+20);
+        h.chunks        = load_le<uint64_t>(p+28);
+        h.hash_identity = load_le<uint64_t>(p+36);
+        return h;
+      }
+      static void store(unsigned char* p,const patchmap_stream_chunk& c){
+        store_le(p   ,c.count);
+        store_le(p+ 8,c.length);
+        store_le(p+16,c.checksum);
+      }
+      static patchmap_stream_chunk load_chunk(const unsigned char* p){
+        return {load_le<uint64_t>(p),
+                load_le<uint64_t>(p+8),
+                load_le<uint64_t>(p+16)};
+      }
+      // call f(i) for every occupied bucket i in mask words [k0,k1) in
+      // table order, the first bucket of a word is its highest bit
+      template<class F>
+      static void visit_words(
+          const map_type& map,
+          const size_type& k0,
+          const size_type& k1,
+          F&& f){
+        constexpr size_type top = size_type(1)<<(digits<size_type>()-1);
+        for (size_type k=map.next_word(map.used_words(),0,k0);
+             k<k1;
+             k=map.next_word(map.used_words(),0,k+1)) {
+          for (size_type w=map.mask[k];w;) {
+            const size_type c = clz(w);
+            f(k*digits<size_type>()+c);
+            w^=top>>c;
+          }
+        }
+      }
+      // tells apart hash functions, or seeds of one, that give the same
+      // keys other hashes, which snapshots store instead of the keys
+      static uint64_t hash_identity(const map_type& map){
+        uint64_t id = 0;
+        for (const unsigned char b : {0x00,0x01,0x5a,0xff}) {
+          unsigned char bytes[sizeof(key_type)];
+          std::memset(bytes,b,sizeof(key_type));
+          key_type k;
+          std::memcpy(&k,bytes,sizeof(key_type));
+          id = rol(id,16)^uint64_t(map.order(k));
+        }
+        return id;
+      }
+      static void construct(
+          map_type& map,
+          const size_type& i,
+          const key_type& k,
+          const hash_type& ok,
+          const _mapped_type& v){
+        if constexpr (unhash_defined<hash,hash_type>::value) {
+          allocator_traits<alloc>::construct(map.allocator,map.data+i,ok,v);
+        } else {
+          allocator_traits<alloc>::construct(map.allocator,map.data+i,k,v);
+        }
+      }
+      // Write the chunks of chunk_words mask words in table order. The
+      // threads fill one batch of buffers at a time with encode(k0,k1,out),
+      // which appends the elements of mask words [k0,k1) to out and returns
+      // their number, and the buffers are then written in order.
+      template<class E>
+      static void write_chunks(
+          const map_type& map,
+          patchmap_ostream& out,
+          const parallel_policy& policy,
+          E&& encode){
+        const size_type words  = std::max(size_t(1),policy.chunk_words);
+        const size_type chunks = (map.masksize+words-1)/words;
+        const size_t threads = std::max(size_t(1),policy.threads);
+        vector<vector<unsigned char>> buffer(4*threads);
+        for (size_type c0=0;c0<chunks;c0+=buffer.size()) {
+          const size_type batch =
+            std::min(size_type(buffer.size()),chunks-c0);
+          std::atomic<size_type> next{0};
+          parallel_run(std::min(threads,size_t(batch)),[&](const size_t&){
+              while (true) {
+                const size_type b =
+                  next.fetch_add(1,std::memory_order_relaxed);
+                if (b>=batch) break;
+                const size_type c = c0+b;
+                vector<unsigned char>& buf = buffer[b];
+                buf.resize(patchmap_stream_chunk::bytes);
+                const uint64_t count =
+                  encode(c*words,std::min(map.masksize,(c+1)*words),buf);
+                const uint64_t length = buf.size()-patchmap_stream_chunk::bytes;
+                store(buf.data(),patchmap_stream_chunk{count,length,
+                      checksum(buf.data()+patchmap_stream_chunk::bytes,
+                               length)});
+              }
+            });
+          for (size_type b=0;b!=batch;++b)
+            out.write(buffer[b].data(),buffer[b].size());
+        }
+      }
+      static uint64_t chunk_count(
+          const map_type& map,
+          const parallel_policy& policy){
+        const size_type words = std::max(size_t(1),policy.chunk_words);
+        return (map.masksize+words-1)/words;
+      }
+      // Read the chunks of a stream of n elements in batches, each one
+      // after fits(chunk) accepted its header, and decode the chunks of a
+      // batch in parallel with decode(p,chunk,j), where p points to the
+      // elements, followed by 32 zero bytes, and j is the index of the
+      // first of them. decode returns false for a damaged chunk.
+      template<class C,class D>
+      static void read_chunks(
+          patchmap_istream& in,
+          const uint64_t& n,
+          const uint64_t& chunks,
+          const parallel_policy& policy,
+          C&& fits,
+          D&& decode){
+        const size_t threads = std::max(size_t(1),policy.threads);
+        vector<vector<unsigned char>> buffer(4*threads);
+        vector<uint64_t> at(buffer.size()+1);
+        uint64_t loaded = 0;
+        for (uint64_t c0=0;c0<chunks;c0+=buffer.size()) {
+          const size_t batch = std::min(uint64_t(buffer.size()),chunks-c0);
+          at[0] = loaded;
+          for (size_t b=0;b!=batch;++b) {
+            vector<unsigned char>& buf = buffer[b];
+            buf.resize(patchmap_stream_chunk::bytes);
+            in.read(buf.data(),buf.size());
+            const patchmap_stream_chunk c = load_chunk(buf.data());
+            if ((c.count>n-at[b])||(!fits(c)))
+              fail("damaged chunk in streamed patchmap");
+            buf.assign(patchmap_stream_chunk::bytes+c.length+32,0);
+            store(buf.data(),c);
+            in.read(buf.data()+patchmap_stream_chunk::bytes,c.length);
+            at[b+1] = at[b]+c.count;
+          }
+          loaded = at[batch];
+          std::atomic<size_t> next{0};
+          std::atomic<bool> damaged{false};
+          parallel_run(std::min(threads,batch),[&](const size_t&){
+              while (true) {
+                const size_t b = next.fetch_add(1,std::memory_order_relaxed);
+                if (b>=batch) break;
+                const patchmap_stream_chunk c = load_chunk(buffer[b].data());
+                const unsigned char* p =
+                  buffer[b].data()+patchmap_stream_chunk::bytes;
+                if ((checksum(p,c.length)!=c.checksum)||(!decode(p,c,at[b])))
+                  damaged = true;
+              }
+            });
+          if (damaged) fail("checksum mismatch in streamed patchmap");
+        }
+        if (loaded!=n) fail("truncated streamed patchmap");
+      }
+      // Write the header and then the chunks, each element as its key and
+      // its value.
+      static void save(
+          const map_type& map,
+          patchmap_ostream& out,
+          const parallel_policy& policy){
+        patchmap_stream_header h;
+        std::memcpy(h.magic,"PATCHSTR",8);
+        h.version     = patchmap_stream_header::current_version;
+        h.key_size    = key_size;
+        h.mapped_size = mapped_size;
+        h.count       = map.size();
+        h.chunks      = chunk_count(map,policy);
+        unsigned char bytes[patchmap_stream_header::bytes];
+        store(bytes,h);
+        out.write(bytes,sizeof(bytes));
+        write_chunks(map,out,policy,
+            [&](const size_type& k0,const size_type& k1,
+                vector<unsigned char>& out){
+              uint64_t count = 0;
+              for (size_type k=k0;k!=k1;++k) count+=popcount(map.mask[k]);
+              const size_t at = out.size();
+              out.resize(at+count*element_size);
+              unsigned char* p = out.data()+at;
+              visit_words(map,k0,k1,[&](const size_type& i){
+                  const typename map_type::value_type& v = map.data[i];
+                  if constexpr (unhash_defined<hash,hash_type>::value) {
+                    store_le(p,key_type(map.hasher.unhash(get<0>(v))));
+                  } else {
+                    store_le(p,key_type(get<0>(v)));
+                  }
+                  if constexpr (!is_set) store_le(p+key_size,get<1>(v));
+                  p+=element_size;
+                });
+              return count;
+            });
+      }
+      // Decode the chunks into one array of keys, values and hashes. The
+      // elements are then placed in one sweep over the table, after sorting
+      // them if the hash function of this map orders them differently.
+      static void load(
+          map_type& map,
+          patchmap_istream& in,
+          const parallel_policy& policy){
+        unsigned char bytes[patchmap_stream_header::bytes];
+        in.read(bytes,sizeof(bytes));
+        const patchmap_stream_header h = load_header(bytes);
+        if (std::memcmp(h.magic,"PATCHSTR",8)!=0)
+          fail("not a streamed patchmap");
+        if (h.version!=patchmap_stream_header::current_version)
+          fail("unknown version of a streamed patchmap");
+        if ((h.key_size!=key_size)||(h.mapped_size!=mapped_size))
+          fail("streamed patchmap of other types");
+        const uint64_t n = h.count;
+        vector<key_type> keys(n);
+        vector<_mapped_type> values(is_set?0:n);
+        vector<hash_type> oks(n);
+        read_chunks(in,n,h.chunks,policy,
+            [](const patchmap_stream_chunk& c){
+              return c.length==c.count*element_size;
+            },
+            [&](const unsigned char* p,
+                const patchmap_stream_chunk& c,
+                const uint64_t& first){
+              for (uint64_t j=first;j!=first+c.count;++j,p+=element_size) {
+                keys[j] = load_le<key_type>(p);
+                if constexpr (!is_set)
+                  values[j] = load_le<_mapped_type>(p+key_size);
+                oks[j] = map.order(keys[j]);
+              }
+              return true;
+            });
+        const auto in_order = [&](const size_t& j){
+          return map.is_less(keys[j-1],keys[j],oks[j-1],oks[j]);
+        };
+        size_t j = 1;
+        for (;(j<n)&&in_order(j);++j);
+        if (j<n) {
+          // written with another hash function
+          vector<size_t> perm(n);
+          for (size_t i=0;i!=n;++i) perm[i] = i;
+          std::sort(perm.begin(),perm.end(),
+              [&](const size_t& a,const size_t& b){
+                return map.is_less(keys[a],keys[b],oks[a],oks[b]);
+              });
+          vector<key_type> k(n);
+          vector<_mapped_type> v(is_set?0:n);
+          vector<hash_type> o(n);
+          for (size_t i=0;i!=n;++i) {
+            k[i] = keys[perm[i]];
+            if constexpr (!is_set) v[i] = values[perm[i]];
+            o[i] = oks[perm[i]];
+          }
+          keys.swap(k);
+          values.swap(v);
+          oks.swap(o);
+          for (j=1;(j<n)&&in_order(j);++j);
+          if (j<n) fail("repeated key in streamed patchmap");
+        }
+        patchmap_parallel<map_type>::assign_sorted(map,n,
+            [&](const size_t& j){ return oks[j]; },
+            [&](const size_t& j)->const key_type&{ return keys[j]; },
+            [&](const size_t& j,const size_type& i){
+              construct(map,i,keys[j],oks[j],
+                        is_set?_mapped_type():values[j]);
+            },policy.threads);
+      }
+      // Snapshots store the hashes of the keys instead of the keys, which
+      // the injective hash function maps back with unhash. In table order
+      // the hashes increase by gaps that are roughly geometric for random
+      // keys, so every chunk holds its first hash as it is and the gaps as
+      // Golomb-Rice codes with a parameter of its own, followed by the
+      // column of values, integers as varints, signed ones zigzag encoded,
+      // and other values as they are.
+      class bit_writer{
+        private:
+          vector<unsigned char>& out;
+          uint64_t acc = 0;
+          unsigned n = 0;
+        public:
+          explicit bit_writer(vector<unsigned char>& out):out(out) {}
+          // the lowest m<=32 bits of x
+          void put(const uint64_t& x,const unsigned& m){
+            acc|=(x&((uint64_t(1)<<m)-1))<<n;
+            n+=m;
+            for (;n>=8;n-=8,acc>>=8) out.push_back(acc);
+          }
+          void put_long(const uint64_t& x,const unsigned& m){
+            if (m>32) {
+              put(x,32);
+              put(x>>32,m-32);
+            } else {
+              put(x,m);
+            }
+          }
+          // q zeros and a one
+          void put_unary(uint64_t q){
+            for (;q>=32;q-=32) put(0,32);
+            put(uint64_t(1)<<q,q+1);
+          }
+          void flush(){
+            if (n) out.push_back(acc);
+            acc = 0;
+            n = 0;
+          }
+      };
+      // reads up to 24 bytes past the end of its bytes
+      class bit_reader{
+        private:
+          const unsigned char* p;
+          uint64_t pos = 0;
+          uint64_t end;
+          uint64_t peek() const {
+            return load_le<uint64_t>(p+pos/8)>>(pos%8);
+          }
+        public:
+          bit_reader(const unsigned char* p,const uint64_t& bytes)
+            :p(p),end(8*bytes) {}
+          uint64_t get(const unsigned& m){
+            const uint64_t x = peek()&((uint64_t(1)<<m)-1);
+            pos+=m;
+            return x;
+          }
+          uint64_t get_long(const unsigned& m){
+            if (m<=32) return get(m);
+            const uint64_t lo = get(32);
+            return lo|(get(m-32)<<32);
+          }
+          bool get_unary(uint64_t& q){
+            for (q=0;pos<end;q+=56,pos+=56) {
+              const uint64_t w = peek()&((uint64_t(1)<<56)-1);
+              if (w==0) continue;
+              q+=ctz(w);
+              pos+=ctz(w)+1;
+              return true;
+            }
+            return false;
+          }
+          bool good() const { return pos<=end; }
+          uint64_t bytes() const { return (pos+7)/8; }
+      };
+      static constexpr size_t max_value_bytes =
+        is_integral<_mapped_type>::value&&(sizeof(_mapped_type)>1)
+        ?(8*sizeof(_mapped_type)+6)/7:sizeof(_mapped_type);
+      template<class T>
+      static void put_value(vector<unsigned char>& out,const T& x){
+        if constexpr (is_integral<T>::value&&(sizeof(T)>1)) {
+          typedef typename make_unsigned<T>::type U;
+          U u = x;
+          if constexpr (is_signed<T>::value) u = x<0?~(u<<1):u<<1;
+          for (;u>=0x80;u>>=7) out.push_back((u&0x7f)|0x80);
+          out.push_back(u);
+        } else {
+          const size_t at = out.size();
+          out.resize(at+sizeof(T));
+          store_le(out.data()+at,x);
+        }
+      }
+      template<class T>
+      static bool get_value(
+          const unsigned char*& p,
+          const unsigned char* end,
+          T& x){
+        if constexpr (is_integral<T>::value&&(sizeof(T)>1)) {
+          typedef typename make_unsigned<T>::type U;
+          U u = 0;
+          for (unsigned s=0;;s+=7) {
+            if ((p==end)||(s>=digits<U>())) return false;
+            u|=U(*p&0x7f)<<s;
+            if (!(*p++&0x80)) break;
+          }
+          if constexpr (is_signed<T>::value) x = T(u&1?~(u>>1):u>>1);
+          else x = u;
+        } else {
+          if (size_t(end-p)<sizeof(T)) return false;
+          x = load_le<T>(p);
+          p+=sizeof(T);
+        }
+        return true;
+      }
+      // Append the chunk of the count increasing hashes from first to
+      // last, which visit(f) passes to f(ok,value) in order with their
+      // values, and which it is asked for twice.
+      template<class V>
+      static void encode_snapshot(
+          vector<unsigned char>& out,
+          const uint64_t& count,
+          const uint64_t& first,
+          const uint64_t& last,
+          V&& visit){
+        if (count==0) return;
+        // about the mean gap, which makes the unary part of a code two bits
+        // long on average
+        const unsigned r = count>1?log2((last-first)/(count-1)):0;
+        const size_t at = out.size();
+        out.resize(at+9);
+        store_le(out.data()+at,first);
+        out[at+8] = r;
+        bit_writer bits(out);
+        uint64_t prev = first;
+        visit([&](const uint64_t& ok,const _mapped_type&){
+            if (ok==first) return;
+            const uint64_t gap = ok-prev-1;
+            bits.put_unary(gap>>r);
+            bits.put_long(gap,r);
+            prev = ok;
+          });
+        bits.flush();
+        if constexpr (!is_set) {
+          visit([&](const uint64_t&,const _mapped_type& v){
+              put_value(out,v);
+            });
+        }
+      }
+      static bool snapshot_chunk_fits(const patchmap_stream_chunk& c){
+        return c.length<=9+c.count*(9+max_value_bytes);
+      }
+      // decode the chunk c at p into oks[0,c.count) and values[0,c.count),
+      // returns false if it is damaged
+      static bool decode_snapshot(
+          const unsigned char* p,
+          const patchmap_stream_chunk& c,
+          hash_type* oks,
+          _mapped_type* values){
+        if (c.count==0) return c.length==0;
+        if ((c.length<9)||(p[8]>=64)) return false;
+        uint64_t ok = load_le<uint64_t>(p);
+        const unsigned r = p[8];
+        bit_reader bits(p+9,c.length-9);
+        oks[0] = ok;
+        for (uint64_t j=1;j!=c.count;++j) {
+          uint64_t q;
+          if (!bits.get_unary(q)) return false;
+          ok+= ((q<<r)|bits.get_long(r))+1;
+          oks[j] = ok;
+        }
+        if (!bits.good()) return false;
+        const unsigned char* v = p+9+bits.bytes();
+        const unsigned char* end = p+c.length;
+        if constexpr (!is_set) {
+          for (uint64_t j=0;j!=c.count;++j)
+            if (!get_value(v,end,values[j])) return false;
+        }
+        return v==end;
+      }
+      static void save_snapshot(
+          const map_type& map,
+          patchmap_ostream& out,
+          const parallel_policy& policy){
+        static_assert(unhash_defined<hash,hash_type>::value,
+            "snapshots need an injective hash function with unhash");
+        patchmap_snapshot_header h;
+        std::memcpy(h.magic,"PATCHSNP",8);
+        h.version       = patchmap_snapshot_header::current_version;
+        h.hash_size     = sizeof(hash_type);
+        h.mapped_size   = mapped_size;
+        h.count         = map.size();
+        h.chunks        = chunk_count(map,policy);
+        h.hash_identity = hash_identity(map);
+        unsigned char bytes[patchmap_snapshot_header::bytes];
+        store(bytes,h);
+        out.write(bytes,sizeof(bytes));
+        write_chunks(map,out,policy,
+            [&](const size_type& k0,const size_type& k1,
+                vector<unsigned char>& out){
+              uint64_t count = 0, first = 0, last = 0;
+              visit_words(map,k0,k1,[&](const size_type& i){
+                  last = get<0>(map.data[i]);
+                  if (count++==0) first = last;
+                });
+              encode_snapshot(out,count,first,last,[&](auto&& f){
+                  visit_words(map,k0,k1,[&](const size_type& i){
+                      if constexpr (is_set) {
+                        f(get<0>(map.data[i]),_mapped_type());
+                      } else {
+                        f(get<0>(map.data[i]),get<1>(map.data[i]));
+                      }
+                    });
+                });
+              return count;
+            });
+      }
+      // read the header of a snapshot of hash function identity
+      static patchmap_snapshot_header read_snapshot_header(
+          patchmap_istream& in,
+          const uint64_t& identity){
+        unsigned char bytes[patchmap_snapshot_header::bytes];
+        in.read(bytes,sizeof(bytes));
+        const patchmap_snapshot_header h = load_snapshot_header(bytes);
+        if (std::memcmp(h.magic,"PATCHSNP",8)!=0)
+          fail("not a patchmap snapshot");
+        if (h.version!=patchmap_snapshot_header::current_version)
+          fail("unknown version of a patchmap snapshot");
+        if ((h.hash_size!=sizeof(hash_type))||(h.mapped_size!=mapped_size))
+          fail("patchmap snapshot of other types");
+        if (h.hash_identity!=identity)
+          fail("patchmap snapshot of another hash function");
+        return h;
+      }
+      static void load_snapshot(
+          map_type& map,
+          patchmap_istream& in,
+          const parallel_policy& policy){
+        static_assert(unhash_defined<hash,hash_type>::value,
+            "snapshots need an injective hash function with unhash");
+        const patchmap_snapshot_header h =
+          read_snapshot_header(in,hash_identity(map));
+        const uint64_t n = h.count;
+        vector<_mapped_type> values(is_set?0:n);
+        vector<hash_type> oks(n);
+        read_chunks(in,n,h.chunks,policy,
+            snapshot_chunk_fits,
+            [&](const unsigned char* p,
+                const patchmap_stream_chunk& c,
+                const uint64_t& first){
+              return decode_snapshot(p,c,oks.data()+first,
+                                     is_set?nullptr:values.data()+first);
+            });
+        for (size_t j=1;j<n;++j)
+          if (!(oks[j-1]<oks[j])) fail("damaged patchmap snapshot");
+        patchmap_parallel<map_type>::assign_sorted(map,n,
+            [&](const size_t& j){ return oks[j]; },
+            [&](const size_t& j){
+              return key_type(map.hasher.unhash(oks[j]));
+            },
+            [&](const size_t& j,const size_type& i){
+              allocator_traits<alloc>::construct(map.allocator,map.data+i,
+                  oks[j],is_set?_mapped_type():values[j]);
+            },policy.threads);
+      }
+      // The elements of a snapshot in hash order, decoded one chunk at a
+      // time.
+      class snapshot_cursor{
+        private:
+          patchmap_istream& in;
+          uint64_t chunks;
+          uint64_t left;
+          vector<unsigned char> buffer;
+          vector<hash_type> oks;
+          vector<_mapped_type> values;
+          size_t at = 0;
+          void fill(){
+            const hash_type last = oks.size()?oks.back():0;
+            const bool first = oks.empty();
+            oks.clear();
+            at = 0;
+            while (oks.empty()&&chunks) {
+              --chunks;
+              buffer.resize(patchmap_stream_chunk::bytes);
+              in.read(buffer.data(),buffer.size());
+              const patchmap_stream_chunk c = load_chunk(buffer.data());
+              if ((c.count>left)||(!snapshot_chunk_fits(c)))
+                fail("damaged chunk in patchmap snapshot");
+              buffer.assign(c.length+32,0);
+              in.read(buffer.data(),c.length);
+              oks.resize(c.count);
+              values.resize(is_set?0:c.count);
+              if ((checksum(buffer.data(),c.length)!=c.checksum)
+                ||(!decode_snapshot(buffer.data(),c,oks.data(),
+                                    is_set?nullptr:values.data())))
+                fail("checksum mismatch in patchmap snapshot");
+              for (size_t j=1;j<oks.size();++j)
+                if (!(oks[j-1]<oks[j])) fail("damaged patchmap snapshot");
+              if (oks.size()&&(!first)&&(!(last<oks[0])))
+                fail("damaged patchmap snapshot");
+              left-=c.count;
+            }
+            if (oks.empty()&&left) fail("truncated patchmap snapshot");
+          }
+        public:
+          snapshot_cursor(patchmap_istream& in,const uint64_t& identity)
+            :in(in) {
+            const patchmap_snapshot_header h =
+              read_snapshot_header(in,identity);
+            chunks = h.chunks;
+            left = h.count;
+            fill();
+          }
+          bool done() const { return at==oks.size(); }
+          const hash_type& ok() const { return oks[at]; }
+          _mapped_type value() const {
+            if constexpr (is_set) return _mapped_type();
+            else return values[at];
+          }
+          void next(){ if (++at==oks.size()) fill(); }
+      };
+      // Merge the snapshots of in into one written to out, with
+      // combine(older,newer) giving the value of a key that more than one
+      // of them hold, the later one being the newer. Holds a chunk of each
+      // of them and chunk elements of the merged snapshot. The header is
+      // written first with a count and a number of chunks of ~0, as they
+      // are only known at the end, and returned to be written over it.
+      template<class C>
+      static patchmap_snapshot_header merge_snapshots(
+          const vector<patchmap_istream*>& in,
+          patchmap_ostream& out,
+          C&& combine,
+          const size_t& chunk){
+        static_assert(unhash_defined<hash,hash_type>::value,
+            "snapshots need an injective hash function with unhash");
+        patchmap_snapshot_header h;
+        std::memcpy(h.magic,"PATCHSNP",8);
+        h.version       = patchmap_snapshot_header::current_version;
+        h.hash_size     = sizeof(hash_type);
+        h.mapped_size   = mapped_size;
+        h.count         = ~uint64_t(0);
+        h.chunks        = ~uint64_t(0);
+        h.hash_identity = hash_identity(map_type());
+        unsigned char bytes[patchmap_snapshot_header::bytes];
+        store(bytes,h);
+        out.write(bytes,sizeof(bytes));
+        h.count  = 0;
+        h.chunks = 0;
+        vector<snapshot_cursor> cursors;
+        cursors.reserve(in.size());
+        for (patchmap_istream* i : in) cursors.emplace_back(*i,h.hash_identity);
+        // the cursors that are not done, as a heap of the least hash and of
+        // the oldest snapshot among equal hashes
+        vector<size_t> heap;
+        const auto later = [&cursors](const size_t& a,const size_t& b){
+          if (cursors[a].ok()!=cursors[b].ok())
+            return cursors[a].ok()>cursors[b].ok();
+          return a>b;
+        };
+        for (size_t i=0;i!=cursors.size();++i)
+          if (!cursors[i].done()) heap.push_back(i);
+        std::make_heap(heap.begin(),heap.end(),later);
+        const auto pop = [&](){
+          std::pop_heap(heap.begin(),heap.end(),later);
+          return heap.back();
+        };
+        const auto advance = [&](const size_t& i){
+          cursors[i].next();
+          if (cursors[i].done()) heap.pop_back();
+          else std::push_heap(heap.begin(),heap.end(),later);
+        };
+        vector<hash_type> oks;
+        vector<_mapped_type> values;
+        vector<unsigned char> buffer;
+        const auto flush = [&](){
+          if (oks.empty()) return;
+          buffer.assign(patchmap_stream_chunk::bytes,0);
+          encode_snapshot(buffer,oks.size(),oks.front(),oks.back(),
+              [&](auto&& f){
+                for (size_t j=0;j!=oks.size();++j)
+                  f(oks[j],is_set?_mapped_type():values[j]);
+              });
+          const uint64_t length = buffer.size()-patchmap_stream_chunk::bytes;
+          store(buffer.data(),patchmap_stream_chunk{oks.size(),length,
+                checksum(buffer.data()+patchmap_stream_chunk::bytes,length)});
+          out.write(buffer.data(),buffer.size());
+          h.count+=oks.size();
+          ++h.chunks;
+          oks.clear();
+          values.clear();
+        };
+        while (heap.size()) {
+          size_t i = pop();
+          const hash_type ok = cursors[i].ok();
+          _mapped_type v = cursors[i].value();
+          advance(i);
+          while (heap.size()&&(cursors[heap.front()].ok()==ok)) {
+            i = pop();
+            if constexpr (!is_set) v = combine(v,cursors[i].value());
+            advance(i);
+          }
+          oks.push_back(ok);
+          if constexpr (!is_set) values.push_back(v);
+          if (oks.size()>=std::max(size_t(1),chunk)) flush();
+        }
+        flush();
+        return h;
+      }
+  };
+
+  class patchmap_std_ostream : public patchmap_ostream{
+    private:
+      std::ostream& out;
+    public:
+      explicit patchmap_std_ostream(std::ostream& out):out(out) {}
+      void write(const unsigned char* p,const size_t& n) override {
+        out.write(reinterpret_cast<const char*>(p),n);
+        if (!out) throw std::runtime_error(
+            string(typeid(patchmap_std_ostream).name())+": write failed");
+      }
+  };
+  class patchmap_std_istream : public patchmap_istream{
+    private:
+      std::istream& in;
+    public:
+      explicit patchmap_std_istream(std::istream& in):in(in) {}
+      void read(unsigned char* p,const size_t& n) override {
+        in.read(reinterpret_cast<char*>(p),n);
+        if (size_t(in.gcount())!=n) throw std::runtime_error(
+            string(typeid(patchmap_std_istream).name())
+            +": truncated streamed patchmap");
+      }
+  };
+#if defined(__unix__)||defined(__APPLE__)
+  class patchmap_fd_ostream : public patchmap_ostream{
+    private:
+      int fd;
+    public:
+      explicit patchmap_fd_ostream(const int& fd):fd(fd) {}
+      void write(const unsigned char* p,const size_t& n) override {
+        for (size_t i=0;i<n;) {
+          const ssize_t r = ::write(fd,p+i,n-i);
+          if ((r<0)&&(errno==EINTR)) continue;
+          if (r<=0) throw std::runtime_error(
+              string(typeid(patchmap_fd_ostream).name())+": write failed: "
+              +std::strerror(errno));
+          i+=r;
+        }
+      }
+  };
+  class patchmap_fd_istream : public patchmap_istream{
+    private:
+      int fd;
+    public:
+      explicit patchmap_fd_istream(const int& fd):fd(fd) {}
+      void read(unsigned char* p,const size_t& n) override {
+        for (size_t i=0;i<n;) {
+          const ssize_t r = ::read(fd,p+i,n-i);
+          if ((r<0)&&(errno==EINTR)) continue;
+          if (r<0) throw std::runtime_error(
+              string(typeid(patchmap_fd_istream).name())+": read failed: "
+              +std::strerror(errno));
+          if (r==0) throw std::runtime_error(
+              string(typeid(patchmap_fd_istream).name())
+              +": truncated streamed patchmap");
+          i+=r;
+        }
+      }
+  };
+#endif
+
+  // Write map to out in the portable streamed format, encoding chunks of
+  // policy.chunk_words mask words on policy.threads threads.
+  template<class map_type>
+  void save(
+      const map_type& map,
+      std::ostream& out,
+      const parallel_policy& policy = parallel_policy()){
+    patchmap_std_ostream o(out);
+    patchmap_stream<map_type>::save(map,o,policy);
+  }
+
+  // Replace the contents of map by a streamed patchmap read from in. The
+  // chunks are checked and decoded in parallel and the table is rebuilt in
+  // one sweep in hash order.
+  template<class map_type>
+  void load(
+      map_type& map,
+      std::istream& in,
+      const parallel_policy& policy = parallel_policy()){
+    patchmap_std_istream i(in);
+    patchmap_stream<map_type>::load(map,i,policy);
+  }
+
+#if defined(__unix__)||defined(__APPLE__)
+  template<class map_type>
+  void save(
+      const map_type& map,
+      const int& fd,
+      const parallel_policy& policy = parallel_policy()){
+    patchmap_fd_ostream o(fd);
+    patchmap_stream<map_type>::save(map,o,policy);
+  }
+
+  template<class map_type>
+  void load(
+      map_type& map,
+      const int& fd,
+      const parallel_policy& policy = parallel_policy()){
+    patchmap_fd_istream i(fd);
+    patchmap_stream<map_type>::load(map,i,policy);
+  }
+#endif
+
+  // Write map, whose hash function has to be injective with unhash, to
+  // out as a compressed snapshot of the hashes of its keys and of its
+  // values, encoding chunks on policy.threads threads.
+  template<class map_type>
+  void save_snapshot(
+      const map_type& map,
+      std::ostream& out,
+      const parallel_policy& policy = parallel_policy()){
+    patchmap_std_ostream o(out);
+    patchmap_stream<map_type>::save_snapshot(map,o,policy);
+  }
+
+  // Replace the contents of map by a snapshot read from in, which has to
+  // be written with the same hash function.
+  template<class map_type>
+  void load_snapshot(
+      map_type& map,
+      std::istream& in,
+      const parallel_policy& policy = parallel_policy()){
+    patchmap_std_istream i(in);
+    patchmap_stream<map_type>::load_snapshot(map,i,policy);
+  }
+
+#if defined(__unix__)||defined(__APPLE__)
+  template<class map_type>
+  void save_snapshot(
+      const map_type& map,
+      const int& fd,
+      const parallel_policy& policy = parallel_policy()){
+    patchmap_fd_ostream o(fd);
+    patchmap_stream<map_type>::save_snapshot(map,o,policy);
+  }
+
+  template<class map_type>
+  void load_snapshot(
+      map_type& map,
+      const int& fd,
+      const parallel_policy& policy = parallel_policy()){
+    patchmap_fd_istream i(fd);
+    patchmap_stream<map_type>::load_snapshot(map,i,policy);
+  }
+#endif
+
+  // Merge the snapshot files inputs, all written with the hash function of
+  // map_type, into the snapshot file output in one sequential pass over
+  // each, holding a chunk of each of them. combine(older,newer) gives the
+  // value of a key held by more than one of them, inputs later in the list
+  // being the newer, by default the newer value is kept. The output is
+  // written next to it first and then renamed, or removed if the merge
+  // fails. Returns the number of elements of the merged snapshot.
+  template<class map_type,class C>
+  uint64_t merge_snapshots(
+      const vector<string>& inputs,
+      const string& output,
+      C&& combine,
+      const size_t& chunk = size_t(1)<<16){
+    typedef patchmap_stream<map_type> stream_type;
+    vector<std::ifstream> files;
+    vector<patchmap_std_istream> streams;
+    vector<patchmap_istream*> in;
+    files.reserve(inputs.size());
+    streams.reserve(inputs.size());
+    for (const string& path : inputs) {
+      files.emplace_back(path,std::ios::binary);
+      if (!files.back()) stream_type::fail("can not read "+path);
+      streams.emplace_back(files.back());
+      in.push_back(&streams.back());
+    }
+    const string tmp = output+".tmp";
+    std::ofstream file(tmp,std::ios::binary|std::ios::trunc);
+    if (!file) stream_type::fail("can not write "+tmp);
+    patchmap_snapshot_header h;
+    try {
+      patchmap_std_ostream out(file);
+      h = stream_type::merge_snapshots(in,out,combine,chunk);
+      unsigned char bytes[patchmap_snapshot_header::bytes];
+      stream_type::store(bytes,h);
+      file.seekp(0);
+      out.write(bytes,sizeof(bytes));
+      file.close();
+      if ((!file)||std::rename(tmp.c_str(),output.c_str()))
+        stream_type::fail("can not write "+output);
+    } catch (...) {
+      if (file.is_open()) file.close();
+      std::remove(tmp.c_str());
+      throw;
+    }
+    return h.count;
+  }
+
+  template<class map_type>
+  uint64_t merge_snapshots(const vector<string>& inputs,const string& output){
+    typedef typename patchmap_stream<map_type>::_mapped_type mapped_type;
+    return merge_snapshots<map_type>(inputs,output,
+        [](const mapped_type&,const mapped_type& newer){ return newer; });
+  }
+}
+#endif // PATCH_MAP_STREAM_H
@@ -0,0 +1,140 @@
+#ifndef PERSISTENT_PATCH_MAP_H
+#define PERSISTENT_PATCH_MAP_H
+
+#include "patchmap_file.hpp"
+
+namespace whash{
+
+  // A patchmap that lives in a file mapped MAP_SHARED, in the format of
+  // patchmap_file.hpp, so that reopening it after a restart costs nothing.
+  //
+  // The first change after a checkpoint marks the file as modified on disk.
+  // checkpoint writes the table back and marks the file as clean again, and
+  // a file that is not clean, because its process died in between, is
+  // refused when it is opened until recover_patchmap rebuilt it. The
+  // destructor checkpoints.
+  //
+  // Changes are made in place in the mapping. If only the process died,
+  // the file holds every change it completed and recovery keeps them all.
+  // The change in progress may be lost, and an interrupted insertion may
+  // bring back an element erased before from the same run of buckets. If
+  // the machine failed, the pages changed after the last checkpoint may
+  // have reached the disk or not, each on its own, and recovery only makes
+  // a consistent table of what is there.
+  //
+  // To grow, the file is extended by a table of the new size, the elements
+  // are moved there in hash order and the header is switched to it. The
+  // old table is then given back to the file system as a hole.
+  template<class map_type>
+  class persistent_patchmap{
+    private:
+      typedef patchmap_file<map_type> file_type;
+    public:
+      typedef typename map_type::size_type size_type;
+      typedef typename file_type::_mapped_type mapped_type;
+    private:
+      patchmap_mapping file;
+      map_type table;
+      bool modified = false;
+      patchmap_file_header& header() const {
+        return *reinterpret_cast<patchmap_file_header*>(file.data());
+      }
+      void modify(){
+        if (modified) return;
+        header().state = patchmap_file_header::modified;
+        file.sync(0,sizeof(patchmap_file_header));
+        modified = true;
+      }
+      void grow(const size_type& n){
+        modify();
+        file_type::grow(file,table,n,[this](const patchmap_file_header& h){
+            file.sync(h.offset,h.mask_bytes+h.data_bytes);
+            header() = h;
+            file.sync(0,sizeof(patchmap_file_header));
+          });
+      }
+      void ensure_size(){
+        const size_type n = file_type::next_size(table);
+        if (n) grow(n);
+      }
+    public:
+      // open the table in path, or create an empty one with room for n
+      // elements if there is no such file
+      explicit persistent_patchmap(const string& path,const size_type& n = 0)
+        :table(0) {
+        if (::access(path.c_str(),F_OK)!=0) {
+          map_type empty(0);
+          empty.reserve(n);
+          save_patchmap(empty,path);
+        }
+        file = patchmap_mapping(path,true);
+        file_type::attach(table,file,path);
+      }
+      persistent_patchmap(const persistent_patchmap&) = delete;
+      persistent_patchmap& operator=(const persistent_patchmap&) = delete;
+      ~persistent_patchmap(){
+        try {
+          if (modified) checkpoint();
+        } catch (...) {}
+        file_type::detach(table);
+      }
+      // write all changes back to the file and mark it as clean
+      void checkpoint(){
+        const patchmap_file_header& h = header();
+        file.sync(h.offset,h.mask_bytes+h.data_bytes);
+        header().num_data = table.size();
+        header().state = patchmap_file_header::clean;
+        file.sync(0,sizeof(patchmap_file_header));
+        modified = false;
+      }
+      const map_type& operator*()  const { return  table; }
+      const map_type* operator->() const { return &table; }
+      template<class key_type>
+      const mapped_type* find(const key_type& k) const {
+        return file_type::find(table,k);
+      }
+      template<class key_type>
+      size_type count(const key_type& k) const { return find(k)!=nullptr; }
+      template<class key_type>
+      const mapped_type& at(const key_type& k) const {
+        const mapped_type* v = find(k);
+        if (v==nullptr) throw std::out_of_range(
+            std::string(typeid(*this).name())
+            +".at(key_type k) key not found"
+           );
+        return *v;
+      }
+      template<class key_type>
+      mapped_type& operator[](const key_type& k){
+        modify();
+        if (find(k)==nullptr) ensure_size();
+        return table[k];
+      }
+      // insert k with value v if k is not in the table yet, returns whether
+      // it was inserted
+      template<class key_type>
+      bool insert(const key_type& k,const mapped_type& v){
+        if (find(k)) return false;
+        (*this)[k] = v;
+        return true;
+      }
+      // insert k with value v or overwrite the value of k
+      template<class key_type>
+      void insert_or_assign(const key_type& k,const mapped_type& v){
+        (*this)[k] = v;
+      }
+      template<class key_type>
+      size_type erase(const key_type& k){
+        if (find(k)==nullptr) return 0;
+        modify();
+        return table.erase(k);
+      }
+      void reserve(const size_type& n){
+        const size_type m = file_type::reserve_size(table,n);
+        if (m) grow(m);
+      }
+      size_type size() const { return table.size(); }
+      bool empty() const { return table.empty(); }
+  };
+}
+#endif // PERSISTENT_PATCH_MAP_H
@@ -0,0 +1,172 @@
+#ifndef SEALED_PATCH_MAP_H
+#define SEALED_PATCH_MAP_H
+
+#include <atomic>
+#include <optional>
+#include "patchmap.hpp"
+
+namespace whash{
+
+#if defined(__cpp_lib_atomic_ref)
+  template<class T>
+  using atomic_value_ref = std::atomic_ref<T>;
+#else
+  // The part of std::atomic_ref a sealed_patchmap needs, for C++17 compilers
+  // with the GNU atomic builtins.
+  template<class T>
+  class atomic_value_ref{
+    static_assert(is_trivially_copyable<T>::value,
+        "atomic_value_ref needs a trivially copyable type");
+#ifndef __GNUC__
+    static_assert(sizeof(T)==0,
+        "atomic_value_ref needs std::atomic_ref or the GNU atomic builtins");
+#endif
+    private:
+      T* v;
+      static constexpr int fail_order(const std::memory_order& order){
+        if (order==std::memory_order_acq_rel) return __ATOMIC_ACQUIRE;
+        if (order==std::memory_order_release) return __ATOMIC_RELAXED;
+        return int(order);
+      }
+    public:
+      explicit atomic_value_ref(T& v):v(&v) {}
+      T load(const std::memory_order& order = std::memory_order_seq_cst)
+        const {
+        T r;
+        __atomic_load(v,&r,int(order));
+        return r;
+      }
+      void store(
+          T x,
+          const std::memory_order& order = std::memory_order_seq_cst) const {
+        __atomic_store(v,&x,int(order));
+      }
+      T exchange(
+          T x,
+          const std::memory_order& order = std::memory_order_seq_cst) const {
+        T r;
+        __atomic_exchange(v,&x,&r,int(order));
+        return r;
+      }
+      bool compare_exchange_weak(
+          T& expected,
+          T desired,
+          const std::memory_order& order = std::memory_order_seq_cst) const {
+        return __atomic_compare_exchange(v,&expected,&desired,true,
+            int(order),fail_order(order));
+      }
+      T fetch_add(
+          const T& d,
+          const std::memory_order& order = std::memory_order_seq_cst) const {
+        if constexpr (is_integral<T>::value) {
+          return __atomic_fetch_add(v,d,int(order));
+        } else {
+          T expected = load(std::memory_order_relaxed);
+          while (!compare_exchange_weak(expected,expected+d,order));
+          return expected;
+        }
+      }
+  };
+#endif
+
+  // A patchmap whose keys are fixed. Lookups read only the mask and the
+  // keys, which no longer change, so they take no lock, and values are only
+  // changed through atomic operations, so any number of threads can update
+  // them at once. There is no insert or erase, unseal gives the patchmap
+  // back for that.
+  template<class map_type>
+  class sealed_patchmap{
+    private:
+      class table : public map_type{
+        public:
+          using map_type::data;
+          using map_type::datasize;
+          using map_type::find_node;
+          explicit table(map_type&& map):map_type(std::move(map)) {}
+      };
+      table map;
+    public:
+      typedef typename map_type::size_type size_type;
+      typedef typename map_type::_mapped_type mapped_type;
+      typedef atomic_value_ref<mapped_type> reference;
+      explicit sealed_patchmap(map_type&& map):map(std::move(map)) {}
+      map_type unseal(){ return map_type(std::move(map)); }
+      // the value of k, to be accessed through a reference only while other
+      // threads may update it, or nullptr if k is not in the table
+      template<class key_type>
+      mapped_type* find(const key_type& k){
+        const size_type i = map.find_node(k);
+        if (i>=map.datasize) return nullptr;
+        return &get<1>(map.data[i]);
+      }
+      template<class key_type>
+      std::optional<reference> ref(const key_type& k){
+        mapped_type* v = find(k);
+        if (v==nullptr) return std::nullopt;
+        return reference(*v);
+      }
+      template<class key_type>
+      size_type count(const key_type& k) const {
+        return map.find_node(k)<map.datasize;
+      }
+      template<class key_type>
+      std::optional<mapped_type> load(
+          const key_type& k,
+          const std::memory_order& order = std::memory_order_seq_cst){
+        mapped_type* v = find(k);
+        if (v==nullptr) return std::nullopt;
+        return reference(*v).load(order);
+      }
+      // the following return whether k is in the table
+      template<class key_type>
+      bool store(
+          const key_type& k,
+          const mapped_type& x,
+          const std::memory_order& order = std::memory_order_seq_cst){
+        mapped_type* v = find(k);
+        if (v==nullptr) return false;
+        reference(*v).store(x,order);
+        return true;
+      }
+      template<class key_type>
+      bool add(
+          const key_type& k,
+          const mapped_type& d,
+          const std::memory_order& order = std::memory_order_relaxed){
+        mapped_type* v = find(k);
+        if (v==nullptr) return false;
+        reference(*v).fetch_add(d,order);
+        return true;
+      }
+      // replace the value x of k by f(x), retrying if it changed meanwhile
+      template<class key_type,class F>
+      bool update(
+          const key_type& k,
+          F&& f,
+          const std::memory_order& order = std::memory_order_relaxed){
+        mapped_type* v = find(k);
+        if (v==nullptr) return false;
+        const reference r(*v);
+        mapped_type expected = r.load(std::memory_order_relaxed);
+        while (!r.compare_exchange_weak(expected,f(expected),order));
+        return true;
+      }
+      template<class key_type>
+      bool max(
+          const key_type& k,
+          const mapped_type& x,
+          const std::memory_order& order = std::memory_order_relaxed){
+        return update(k,[&x](const mapped_type& y){ return y<x?x:y; },order);
+      }
+      template<class key_type>
+      bool min(
+          const key_type& k,
+          const mapped_type& x,
+          const std::memory_order& order = std::memory_order_relaxed){
+        return update(k,[&x](const mapped_type& y){ return x<y?x:y; },order);
+      }
+      size_type size() const { return map.size(); }
+      bool empty() const { return map.empty(); }
+  };
+}
+#endif // SEALED_PATCH_MAP_H
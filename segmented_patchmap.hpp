@@ -0,0 +1,247 @@
+#ifndef SEGMENTED_PATCH_MAP_H
+#define SEGMENTED_PATCH_MAP_H
+
+#include "concurrent_patchmap.hpp"
+#include "patchmap_file.hpp"
+
+namespace whash{
+
+  // A patchmap larger than memory. The hash space is split into
+  // 2^segment_bits intervals, as the shards of concurrent_patchmap, and
+  // each of them is an ordinary patchmap in a file of its own in the
+  // format of patchmap_file.hpp. At most resident segments are held in
+  // memory, the least recently used one is written back, if it was
+  // changed, and dropped to make room for another. A lookup in a resident
+  // segment costs one more shift of the hash and stamping the segment as
+  // used, the stamps are only compared when a segment is evicted.
+  //
+  // find_batch sorts lookups by segment, so each segment is loaded once per
+  // batch, and for_each visits all elements in hash order, loading each
+  // segment once. Pointers and references into a segment are valid until
+  // the next call that may load another segment. The files stay when the
+  // table is destroyed, with all changes written back, and are used again
+  // by a table opened on the same directory.
+  template<
+    class key_type,
+    class mapped_type,
+    class hash          = whash::hash<key_type>,
+    class equal         = std::equal_to<key_type>,
+    size_t segment_bits = 8
+  >
+  class segmented_patchmap{
+    private:
+      typedef shard_hash<hash,segment_bits> table_hash;
+      class table : public patchmap<key_type,mapped_type,table_hash,equal>{
+        public:
+          typedef patchmap<key_type,mapped_type,table_hash,equal> base;
+          typedef typename base::size_type size_type;
+          typedef typename base::hash_type hash_type;
+          using base::data;
+          using base::datasize;
+          using base::hasher;
+          using base::find_node;
+          using base::find_next;
+          table() = default;
+          explicit table(const base& other):base(other) {}
+          key_type key(const size_type& i) const {
+            if constexpr (unhash_defined<table_hash,hash_type>::value) {
+              return hasher.unhash(get<0>(data[i]));
+            } else {
+              return get<0>(data[i]);
+            }
+          }
+      };
+      typedef patchmap_file<typename table::base> file_type;
+    public:
+      typedef typename table::size_type size_type;
+      typedef typename table::hash_type hash_type;
+      typedef typename file_type::_mapped_type _mapped_type;
+      static constexpr size_type segment_count = size_type(1)<<segment_bits;
+    private:
+      struct segment{
+        unique_ptr<table> map;  // nullptr unless resident
+        size_type size = 0;
+        size_type used = 0;     // when it was used last
+        bool dirty = false;
+      };
+      string directory;
+      size_type resident;
+      unique_ptr<segment[]> segments;
+      vector<size_type> loaded;  // the resident segments
+      size_type num_data = 0;
+      size_type clock = 0;
+      size_type loads = 0;
+      hash hasher;
+      hash_type order(const key_type& k) const { return hasher(k); }
+      size_type segment_of(const hash_type& h) const {
+        return shr(h,digits<hash_type>()-segment_bits);
+      }
+      hash_type segment_order(const hash_type& h) const {
+        return rol(h,segment_bits);
+      }
+      string path(const size_type& i) const {
+        return directory+"/segment_"+to_string(i);
+      }
+      void write_back(segment& s,const size_type& i){
+        if (!s.dirty) return;
+        save_patchmap(static_cast<const typename table::base&>(*s.map),
+                      path(i));
+        s.dirty = false;
+      }
+      // drop the least recently used resident segment
+      void evict(){
+        size_type l = 0;
+        for (size_type j=1;j!=loaded.size();++j)
+          if (segments[loaded[j]].used<segments[loaded[l]].used) l = j;
+        segment& s = segments[loaded[l]];
+        write_back(s,loaded[l]);
+        s.map.reset();
+        loaded[l] = loaded.back();
+        loaded.pop_back();
+      }
+      table& load(const size_type& i){
+        segment& s = segments[i];
+        s.used = ++clock;
+        if (s.map) return *s.map;
+        if (loaded.size()>=resident) evict();
+        if (s.size) {
+          patchmap_view<typename table::base> view(path(i));
+          s.map.reset(new table(*view));
+        } else {
+          s.map.reset(new table());
+        }
+        loaded.push_back(i);
+        ++loads;
+        return *s.map;
+      }
+      // bucket of k in segment i, inserted with a default value if it was
+      // missing
+      _mapped_type& emplace(const key_type& k,const size_type& i){
+        segment& s = segments[i];
+        table& map = load(i);
+        const size_type n = map.size();
+        _mapped_type& v = map[k];
+        s.size += map.size()-n;
+        num_data += map.size()-n;
+        s.dirty = true;
+        return v;
+      }
+    public:
+      // open the table in directory, which is created if it does not exist,
+      // holding at most resident segments in memory
+      explicit segmented_patchmap(
+          const string& directory,
+          const size_type& resident = 16)
+        :directory(directory),resident(std::max(resident,size_type(1))),
+         segments(new segment[segment_count]) {
+        ::mkdir(directory.c_str(),0755);
+        for (size_type i=0;i!=segment_count;++i) {
+          const int fd = ::open(path(i).c_str(),O_RDONLY);
+          if (fd<0) continue;
+          patchmap_file_header h;
+          const bool ok = ::read(fd,&h,sizeof(h))==ssize_t(sizeof(h));
+          ::close(fd);
+          if (!ok) throw std::runtime_error(
+              string(typeid(*this).name())+": "+path(i)+" is truncated");
+          segments[i].size = h.num_data;
+          num_data += h.num_data;
+        }
+      }
+      segmented_patchmap(const segmented_patchmap&) = delete;
+      segmented_patchmap& operator=(const segmented_patchmap&) = delete;
+      ~segmented_patchmap(){
+        try {
+          flush();
+        } catch (...) {}
+      }
+      // write all changed resident segments back to their files
+      void flush(){
+        for (const size_type& i : loaded) write_back(segments[i],i);
+      }
+      const _mapped_type* find(const key_type& k){
+        const hash_type h = order(k);
+        const size_type i = segment_of(h);
+        if (segments[i].size==0) return nullptr;
+        const table& map = load(i);
+        const size_type j = map.find_node(k,segment_order(h));
+        if (j>=map.datasize) return nullptr;
+        return &get<1>(map.data[j]);
+      }
+      size_type count(const key_type& k){ return find(k)!=nullptr; }
+      const _mapped_type& at(const key_type& k){
+        const _mapped_type* v = find(k);
+        if (v==nullptr) throw std::out_of_range(
+            std::string(typeid(*this).name())
+            +".at(key_type k) key not found"
+           );
+        return *v;
+      }
+      // Call f(j,value) for each key j of keys[0,n), with a pointer to its
+      // value or nullptr if it is not in the table. The keys are visited
+      // grouped by segment, the segments resident already first.
+      template<class F>
+      void find_batch(const key_type* keys,const size_type& n,F&& f){
+        vector<pair<size_type,size_type>> todo(n);
+        for (size_type j=0;j!=n;++j) {
+          const hash_type h = order(keys[j]);
+          const size_type i = segment_of(h);
+          todo[j] = {(segments[i].map?0:segment_count)+i,j};
+        }
+        std::sort(todo.begin(),todo.end());
+        for (const auto& [s,j] : todo) {
+          const size_type i = s%segment_count;
+          const _mapped_type* v = nullptr;
+          if (segments[i].size) {
+            const table& map = load(i);
+            const size_type b = map.find_node(keys[j],
+                                              segment_order(order(keys[j])));
+            if (b<map.datasize) v = &get<1>(map.data[b]);
+          }
+          f(j,v);
+        }
+      }
+      _mapped_type& operator[](const key_type& k){
+        return emplace(k,segment_of(order(k)));
+      }
+      // insert k with value v if k is not in the table yet, returns whether
+      // it was inserted
+      bool insert(const key_type& k,const _mapped_type& v){
+        if (find(k)) return false;
+        (*this)[k] = v;
+        return true;
+      }
+      // insert k with value v or overwrite the value of k
+      void insert_or_assign(const key_type& k,const _mapped_type& v){
+        (*this)[k] = v;
+      }
+      size_type erase(const key_type& k){
+        const size_type i = segment_of(order(k));
+        segment& s = segments[i];
+        if (s.size==0) return 0;
+        if (!load(i).erase(k)) return 0;
+        --s.size;
+        --num_data;
+        s.dirty = true;
+        return 1;
+      }
+      // call f(key,value) for all elements in hash order, the values can not
+      // be changed on the way
+      template<class F>
+      void for_each(F&& f){
+        for (size_type i=0;i!=segment_count;++i) {
+          if (segments[i].size==0) continue;
+          table& map = load(i);
+          for (size_type j=map.find_next(0);
+               j<map.datasize;
+               j=map.find_next(j+1))
+            f(map.key(j),
+              static_cast<const _mapped_type&>(get<1>(map.data[j])));
+        }
+      }
+      size_type size() const { return num_data; }
+      bool empty() const { return num_data==0; }
+      // segments loaded from their files or created so far
+      size_type segment_loads() const { return loads; }
+  };
+}
+#endif // SEGMENTED_PATCH_MAP_H
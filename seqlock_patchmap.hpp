@@ -0,0 +1,383 @@
+#ifndef SEQLOCK_PATCH_MAP_H
+#define SEQLOCK_PATCH_MAP_H
+
+#include <atomic>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <thread>
+#include "patchmap.hpp"
+
+namespace whash{
+
+  // Index of the calling thread among all threads that ever read from a
+  // concurrent patchmap, used to spread readers over reader slots.
+  inline size_t concurrent_reader_id(){
+    static std::atomic<size_t> next{0};
+    thread_local const size_t id = next.fetch_add(1,std::memory_order_relaxed);
+    return id;
+  }
+
+  // Epoch based reclamation for one writer and many readers. A reader
+  // announces itself in the slot of its thread for the parity of the current
+  // epoch, the writer flips the epoch after unpublishing something and waits
+  // until no reader of the old parity is left before it frees it. Readers of
+  // different threads only share a cache line if there are more threads
+  // than slots.
+  template<size_t slots = 64>
+  class reader_epochs{
+    private:
+      struct alignas(64) slot{
+        std::atomic<size_t> active[2] = {0,0};
+      };
+      std::atomic<size_t> epoch{0};
+      slot reader[slots];
+    public:
+      size_t enter(){
+        slot& s = reader[concurrent_reader_id()%slots];
+        while (true) {
+          const size_t e = epoch.load();
+          s.active[e&1].fetch_add(1);
+          if (epoch.load()==e) return e;
+          s.active[e&1].fetch_sub(1);
+        }
+      }
+      void leave(const size_t& e){
+        reader[concurrent_reader_id()%slots].active[e&1].fetch_sub(1,
+            std::memory_order_release);
+      }
+      // wait until every reader that may have seen what was unpublished
+      // before this call has left
+      void synchronize(){
+        const size_t e = epoch.fetch_add(1);
+        for (size_t i=0;i!=slots;++i)
+          while (reader[i].active[e&1].load(std::memory_order_acquire))
+            std::this_thread::yield();
+      }
+  };
+
+  // A patchmap for many concurrent readers and writers.
+  //
+  // count, find and at take no lock and write no shared memory apart from
+  // the reader slot of their thread. The buckets are split into regions of
+  // 2^region_bits buckets with one sequence counter each. Displacement never
+  // crosses a free bucket, so every operation only looks at the run of
+  // occupied buckets around map(hash) and the free buckets bounding it. A
+  // writer locks the regions of this run by making their counters odd, in
+  // increasing order, and makes them even again when it is done. Writers in
+  // different regions do not wait for each other. A reader retries if any
+  // of the counters of its regions was odd or changed while it was reading.
+  //
+  // A resize takes a global lock exclusively, which writers otherwise only
+  // share. It builds a new table next to the old one, publishes it and frees
+  // the old one once no reader is left that may still use it.
+  //
+  // Readers copy buckets that may be written concurrently, so keys and
+  // values have to be trivially copyable. A region covers whole words of the
+  // mask and of its summaries, so region_bits has to be at least 12.
+  template<
+    class key_type,
+    class mapped_type,
+    class hash        = whash::hash<key_type>,
+    class equal       = std::equal_to<key_type>,
+    size_t region_bits = 12
+  >
+  class seqlock_patchmap{
+    static_assert(region_bits>=12,
+        "regions of seqlock_patchmap may not share words of the mask");
+    private:
+      class table : public patchmap<key_type,mapped_type,hash,equal>{
+        public:
+          typedef patchmap<key_type,mapped_type,hash,equal> base;
+          typedef typename base::size_type size_type;
+          typedef typename base::hash_type hash_type;
+          typedef typename base::value_type value_type;
+          typedef typename base::sizing_policy sizing_policy;
+          using base::data;
+          using base::datasize;
+          using base::masksize;
+          using base::mask;
+          using base::num_data;
+          using base::is_set;
+          using base::order;
+          using base::map;
+          using base::is_equal;
+          using base::find_node;
+          using base::find_node_interpol;
+          using base::place_node;
+          using base::remove_node;
+          using base::hasher;
+          using base::allocator;
+          static_assert(
+              is_trivially_copyable<
+                typename std::tuple_element<0,value_type>::type>::value
+            &&is_trivially_copyable<
+                typename std::tuple_element<1,value_type>::type>::value,
+              "seqlock_patchmap readers copy buckets while they are written");
+          unique_ptr<std::atomic<uint32_t>[]> seq;
+          size_type regions = 0;
+          explicit table(const size_type& n):base(n) { make_seq(); }
+          table(const table& other,const size_type& n):base(other) {
+            base::resize(n);
+            make_seq();
+          }
+          void make_seq(){
+            regions = (datasize>>region_bits)+1;
+            seq.reset(new std::atomic<uint32_t>[regions]);
+            for (size_type r=0;r!=regions;++r) seq[r].store(0);
+          }
+          // the free bucket before the run of occupied buckets containing i,
+          // or 0 if the run starts at the first bucket, or i if it is free
+          size_type patch_lo(const size_type& i) const {
+                  size_type k = i/digits<size_type>();
+            const size_type l = i%digits<size_type>();
+                  size_type w = (~mask[k])
+                               &((~size_type(0))<<(digits<size_type>()-1-l));
+            while (w==0) {
+              if (k==0) return 0;
+              w = ~mask[--k];
+            }
+            return k*digits<size_type>()+digits<size_type>()-1-ctz(w);
+          }
+          // the free bucket after the run of occupied buckets containing i,
+          // or the last bucket if the run ends there, or i if it is free
+          size_type patch_hi(const size_type& i) const {
+                  size_type k = i/digits<size_type>();
+            const size_type l = i%digits<size_type>();
+                  size_type w = (~mask[k])&((~size_type(0))>>l);
+            while (w==0) {
+              if (++k>=masksize) return datasize-1;
+              w = ~mask[k];
+            }
+            return std::min(k*digits<size_type>()+clz(w),datasize-1);
+          }
+          // find_node, looking at no bucket outside of [lo,hi]
+          size_type find_node_within(
+              const  key_type&  k,
+              const hash_type& ok,
+              const size_type& mok,
+              const size_type&  lo,
+              const size_type&  hi) const {
+            if (!is_set(mok)) return ~size_type(0);
+            if (is_equal({k,ok},get<0>(data[mok]))) return mok;
+            hash_type omi;
+            if constexpr (unhash_defined<hash,hash_type>::value)
+              omi =       get<0>(data[mok]);
+            else
+              omi = order(get<0>(data[mok]));
+            if (omi<ok) {
+              if (mok==hi) return ~size_type(0);
+              return find_node_interpol(k,ok,mok,mok,omi,true ,hi,0  ,false);
+            } else {
+              if (mok==lo) return ~size_type(0);
+              return find_node_interpol(k,ok,mok,lo ,0  ,false,mok,omi,true);
+            }
+          }
+          // make the counters of the regions of [lo,hi] odd, in increasing
+          // order, waiting for the writers holding them
+          void lock_regions(const size_type& lo,const size_type& hi){
+            for (size_type r=lo>>region_bits;r<=(hi>>region_bits);++r) {
+              while (true) {
+                uint32_t s = seq[r].load(std::memory_order_relaxed);
+                if ((!(s&1))&&seq[r].compare_exchange_weak(s,s+1,
+                      std::memory_order_acquire)) break;
+                std::this_thread::yield();
+              }
+            }
+            std::atomic_thread_fence(std::memory_order_release);
+          }
+          void unlock_regions(const size_type& lo,const size_type& hi){
+            for (size_type r=lo>>region_bits;r<=(hi>>region_bits);++r)
+              seq[r].fetch_add(1,std::memory_order_release);
+          }
+          // lock the regions of the run of occupied buckets containing i and
+          // return its bounds. The bounds are found before the lock is taken
+          // and may move meanwhile, so they are looked up again and the lock
+          // is taken anew if they are not in the same regions any more.
+          pair<size_type,size_type> lock_patch(const size_type& i){
+            while (true) {
+              const size_type lo = patch_lo(i);
+              const size_type hi = patch_hi(i);
+              lock_regions(lo,hi);
+              const size_type nlo = patch_lo(i);
+              const size_type nhi = patch_hi(i);
+              if (((nlo>>region_bits)==(lo>>region_bits))
+                &&((nhi>>region_bits)==(hi>>region_bits))) return {nlo,nhi};
+              unlock_regions(lo,hi);
+            }
+          }
+      };
+    public:
+      typedef typename table::size_type size_type;
+      typedef typename table::hash_type hash_type;
+    private:
+      std::atomic<table*> current;
+      std::atomic<size_type> num_data{0};
+      std::shared_mutex resizing;
+      mutable reader_epochs<> epochs;
+      // run f(table,bucket) under a validated read of the patch of k, the
+      // bucket is ~size_type(0) if k is not in the table
+      template<class F>
+      auto read(const key_type& k,F&& f) const {
+        const size_t e = epochs.enter();
+        const table* t = current.load(std::memory_order_acquire);
+        const hash_type  ok = t->order(k);
+        while (true) {
+          if (t->datasize==0) {
+            auto r = f(*t,~size_type(0));
+            epochs.leave(e);
+            return r;
+          }
+          const size_type mok = t->map(ok);
+          const size_type lo  = t->patch_lo(mok);
+          const size_type hi  = t->patch_hi(mok);
+          const size_type r0  = lo>>region_bits;
+          const size_type r1  = hi>>region_bits;
+          uint32_t s[4];
+          uint32_t* seq = s;
+          unique_ptr<uint32_t[]> many;
+          if (r1-r0>=4) {
+            many.reset(new uint32_t[r1-r0+1]);
+            seq = many.get();
+          }
+          bool stable = true;
+          for (size_type r=r0;r<=r1;++r) {
+            seq[r-r0] = t->seq[r].load(std::memory_order_acquire);
+            stable &= !(seq[r-r0]&1);
+          }
+          if (!stable) {
+            std::this_thread::yield();
+            continue;
+          }
+          // the bounds were found before the counters were read, check that
+          // they still enclose the run
+          if ( ((lo!=0)&&(lo!=mok)&&t->is_set(lo))
+             ||((hi+1!=t->datasize)&&(hi!=mok)&&t->is_set(hi)) ) continue;
+          const size_type i = t->find_node_within(k,ok,mok,lo,hi);
+          auto r = f(*t,i);
+          std::atomic_thread_fence(std::memory_order_acquire);
+          for (size_type j=r0;j<=r1;++j)
+            stable &= (t->seq[j].load(std::memory_order_relaxed)==seq[j-r0]);
+          if (stable) {
+            epochs.leave(e);
+            return r;
+          }
+        }
+      }
+      void publish(table* t){
+        table* old = current.exchange(t,std::memory_order_acq_rel);
+        epochs.synchronize();
+        delete old;
+      }
+      // make room for one more element, the table keeps no count of its
+      // own while writers share it
+      void grow(){
+        std::unique_lock<std::shared_mutex> lock(resizing);
+        table* t = current.load(std::memory_order_relaxed);
+        t->num_data = num_data.load(std::memory_order_relaxed);
+        typename table::sizing_policy policy(t->num_data,t->datasize);
+        if (policy.is_sufficient()) return;
+        publish(new table(*t,policy.nextsize()));
+      }
+    public:
+      explicit seqlock_patchmap(const size_type& n = 0)
+        :current(new table(n)) {}
+      seqlock_patchmap(const seqlock_patchmap&) = delete;
+      seqlock_patchmap& operator=(const seqlock_patchmap&) = delete;
+      ~seqlock_patchmap(){ delete current.load(); }
+      size_type count(const key_type& k) const {
+        return read(k,[](const table& t,const size_type& i){
+            return size_type(i<t.datasize);
+          });
+      }
+      std::optional<mapped_type> find(const key_type& k) const {
+        return read(k,[](const table& t,const size_type& i){
+            if (i<t.datasize) return std::optional<mapped_type>(get<1>(t.data[i]));
+            return std::optional<mapped_type>();
+          });
+      }
+      mapped_type at(const key_type& k) const {
+        const std::optional<mapped_type> v = find(k);
+        if (!v) throw std::out_of_range(
+            std::string(typeid(*this).name())
+            +".at(key_type k) key not found"
+           );
+        return *v;
+      }
+      size_type size() const {
+        return num_data.load(std::memory_order_relaxed);
+      }
+      bool empty() const { return size()==0; }
+      // insert k with value v if k is not in the table yet, returns whether
+      // it was inserted
+      bool insert(const key_type& k,const mapped_type& v){
+        return emplace(k,v,false);
+      }
+      // insert k with value v or overwrite the value of k
+      bool insert_or_assign(const key_type& k,const mapped_type& v){
+        return emplace(k,v,true);
+      }
+      size_type erase(const key_type& k){
+        std::shared_lock<std::shared_mutex> lock(resizing);
+        table* t = current.load(std::memory_order_relaxed);
+        if (t->datasize==0) return 0;
+        const hash_type  ok = t->order(k);
+        const size_type mok = t->map(ok);
+        const auto [lo,hi] = t->lock_patch(mok);
+        const size_type i = t->find_node_within(k,ok,mok,lo,hi);
+        if (i<t->datasize) {
+          t->remove_node(i);
+          num_data.fetch_sub(1,std::memory_order_relaxed);
+        }
+        t->unlock_regions(lo,hi);
+        return i<t->datasize;
+      }
+      void reserve(const size_type& n){
+        std::unique_lock<std::shared_mutex> lock(resizing);
+        table* t = current.load(std::memory_order_relaxed);
+        t->num_data = num_data.load(std::memory_order_relaxed);
+        if (3*n<2*(t->num_data+1)) return;
+        publish(new table(*t,n*3/2));
+      }
+    private:
+      bool emplace(const key_type& k,const mapped_type& v,const bool assign){
+        while (true) {
+          std::shared_lock<std::shared_mutex> lock(resizing);
+          table* t = current.load(std::memory_order_relaxed);
+          // count the element before it is placed, so that concurrent
+          // writers can not overfill the table together
+          const size_type n = num_data.fetch_add(1,std::memory_order_relaxed);
+          typename table::sizing_policy policy(n,t->datasize);
+          if (!policy.is_sufficient()) {
+            num_data.fetch_sub(1,std::memory_order_relaxed);
+            lock.unlock();
+            grow();
+            continue;
+          }
+          const hash_type  ok = t->order(k);
+          const size_type mok = t->map(ok);
+          // place_node takes one of the free buckets bounding the run of mok
+          // and shifts the buckets in between
+          const auto [lo,hi] = t->lock_patch(mok);
+          size_type i = t->find_node_within(k,ok,mok,lo,hi);
+          if (i<t->datasize) {
+            num_data.fetch_sub(1,std::memory_order_relaxed);
+            if (assign) get<1>(t->data[i]) = v;
+            t->unlock_regions(lo,hi);
+            return false;
+          }
+          i = t->place_node(k,ok,mok);
+          if constexpr (unhash_defined<hash,hash_type>::value) {
+            allocator_traits<typename table::allocator_type>::construct(
+                t->allocator,t->data+i,ok,v);
+          } else {
+            allocator_traits<typename table::allocator_type>::construct(
+                t->allocator,t->data+i,k,v);
+          }
+          t->unlock_regions(lo,hi);
+          return true;
+        }
+      }
+  };
+}
+#endif // SEQLOCK_PATCH_MAP_H
@@ -0,0 +1,246 @@
+#ifndef SHARED_PATCH_MAP_H
+#define SHARED_PATCH_MAP_H
+
+#include <atomic>
+#include <optional>
+#include <thread>
+#include "patchmap_file.hpp"
+
+namespace whash{
+
+  // Shared by the processes using a table in a shared memory object, in
+  // the first page of the object behind its patchmap_file_header. sequence
+  // is odd while the writer changes the table, generation counts the times
+  // it moved the table within the object.
+  struct alignas(64) shared_patchmap_control{
+    static constexpr size_t position = 256;
+    std::atomic<uint64_t> sequence{0};
+    std::atomic<uint64_t> generation{0};
+    std::atomic<uint64_t> size{0};
+    static_assert(std::atomic<uint64_t>::is_always_lock_free,
+        "the counters of a shared patchmap have to work across processes");
+  };
+
+  // A patchmap in a POSIX shared memory object, in the format of
+  // patchmap_file.hpp, written by one process and read by many, so that
+  // the processes of a host share one copy of a table. The object holds no
+  // pointers, only the offset of the table, and each process uses the
+  // table where its mapping of the object is.
+  //
+  // Changes are made under a process shared seqlock, a reader retries a
+  // lookup if the sequence was odd or changed while it was looking. To
+  // grow, the object is extended by a table of the new size, the elements
+  // are moved there in hash order, the header is switched to it and the
+  // old table is given back as a hole. Readers see the new generation and
+  // map the object anew.
+  //
+  // The writer creates the object, replacing one of the same name, and
+  // removes the name again when it is destroyed. Readers that are attached
+  // then keep the table as it was last.
+  template<class map_type>
+  class shared_patchmap{
+    private:
+      typedef patchmap_file<map_type> file_type;
+    public:
+      typedef typename map_type::size_type size_type;
+      typedef typename file_type::_mapped_type mapped_type;
+    private:
+      string name;
+      patchmap_mapping file;
+      map_type table;
+      patchmap_file_header& header() const {
+        return *reinterpret_cast<patchmap_file_header*>(file.data());
+      }
+      shared_patchmap_control& control() const {
+        return *reinterpret_cast<shared_patchmap_control*>(
+            file.data()+shared_patchmap_control::position);
+      }
+      // the writer holds the seqlock from begin to end
+      void begin(){
+        const uint64_t s = control().sequence.load(std::memory_order_relaxed);
+        control().sequence.store(s+1,std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+      }
+      void end(){
+        header().num_data = table.size();
+        control().size.store(table.size(),std::memory_order_relaxed);
+        control().sequence.fetch_add(1,std::memory_order_release);
+      }
+      void grow(const size_type& n){
+        file_type::grow(file,table,n,[this](const patchmap_file_header& h){
+            header() = h;
+            control().generation.fetch_add(1,std::memory_order_relaxed);
+          });
+      }
+      void ensure_size(){
+        const size_type n = file_type::next_size(table);
+        if (n) grow(n);
+      }
+    public:
+      // create the shared memory object name, as for shm_open, with an
+      // empty table with room for n elements
+      explicit shared_patchmap(const string& name,const size_type& n = 0)
+        :name(name),table(0) {
+        shm_unlink(name.c_str());
+        file = patchmap_mapping(
+            shm_open(name.c_str(),O_RDWR|O_CREAT|O_EXCL,0600),name,true);
+        map_type empty(0);
+        empty.reserve(n);
+        const patchmap_file_header h = file_type::header(empty);
+        file.resize(h.offset+h.mask_bytes+h.data_bytes);
+        std::memcpy(file.data(),&h,sizeof(h));
+        new (&control()) shared_patchmap_control;
+        file_type::attach(table,file,name);
+        // the new object is all zeros, an empty table apart from its fences
+        file_type::rehash(empty,table);
+      }
+      shared_patchmap(const shared_patchmap&) = delete;
+      shared_patchmap& operator=(const shared_patchmap&) = delete;
+      ~shared_patchmap(){
+        file_type::detach(table);
+        shm_unlink(name.c_str());
+      }
+      const map_type& operator*()  const { return  table; }
+      const map_type* operator->() const { return &table; }
+      template<class key_type>
+      const mapped_type* find(const key_type& k) const {
+        return file_type::find(table,k);
+      }
+      template<class key_type>
+      size_type count(const key_type& k) const { return find(k)!=nullptr; }
+      template<class key_type>
+      const mapped_type& at(const key_type& k) const {
+        const mapped_type* v = find(k);
+        if (v==nullptr) throw std::out_of_range(
+            std::string(typeid(*this).name())
+            +".at(key_type k) key not found"
+           );
+        return *v;
+      }
+      // insert k with value v if k is not in the table yet, returns whether
+      // it was inserted
+      template<class key_type>
+      bool insert(const key_type& k,const mapped_type& v){
+        if (find(k)) return false;
+        insert_or_assign(k,v);
+        return true;
+      }
+      // insert k with value v or overwrite the value of k
+      template<class key_type>
+      void insert_or_assign(const key_type& k,const mapped_type& v){
+        begin();
+        if (find(k)==nullptr) ensure_size();
+        table[k] = v;
+        end();
+      }
+      template<class key_type>
+      size_type erase(const key_type& k){
+        if (find(k)==nullptr) return 0;
+        begin();
+        const size_type n = table.erase(k);
+        end();
+        return n;
+      }
+      void reserve(const size_type& n){
+        const size_type m = file_type::reserve_size(table,n);
+        if (m==0) return;
+        begin();
+        grow(m);
+        end();
+      }
+      size_type size() const { return table.size(); }
+      bool empty() const { return table.empty(); }
+  };
+
+  // A process reading the table of a shared_patchmap. Lookups return
+  // copies of the values, as what they point to may change any time. Each
+  // thread has to read through a reader of its own.
+  template<class map_type>
+  class shared_patchmap_reader{
+    private:
+      typedef patchmap_file<map_type> file_type;
+    public:
+      typedef typename map_type::size_type size_type;
+      typedef typename file_type::_mapped_type mapped_type;
+    private:
+      string name;
+      mutable patchmap_mapping file;
+      mutable map_type table;
+      mutable uint64_t generation = ~uint64_t(0);
+      const shared_patchmap_control& control() const {
+        return *reinterpret_cast<const shared_patchmap_control*>(
+            file.data()+shared_patchmap_control::position);
+      }
+      // run f on the value of k, or nullptr if k is not in the table, under
+      // a validated read
+      template<class K,class F>
+      auto read(const K& k,F&& f) const {
+        while (true) {
+          const uint64_t s = control().sequence.load(std::memory_order_acquire);
+          if (s&1) {
+            std::this_thread::yield();
+            continue;
+          }
+          const uint64_t g = control().generation.load(
+              std::memory_order_relaxed);
+          if (g!=generation) {
+            patchmap_file_header h;
+            std::memcpy(&h,file.data(),sizeof(h));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (control().sequence.load(std::memory_order_relaxed)!=s) continue;
+            // the writer extends the object before it switches the header
+            file_type::detach(table);
+            file.refresh();
+            h.state = patchmap_file_header::clean;
+            file_type::check(table,h,file.size(),name);
+            file_type::attach(table,file.data(),h);
+            generation = g;
+            continue;
+          }
+          auto r = f(file_type::find_stable(table,k));
+          std::atomic_thread_fence(std::memory_order_acquire);
+          if (control().sequence.load(std::memory_order_relaxed)==s) return r;
+        }
+      }
+    public:
+      // attach to the shared memory object name of a shared_patchmap
+      explicit shared_patchmap_reader(const string& name)
+        :name(name),file(shm_open(name.c_str(),O_RDONLY,0),name,false),
+         table(0) {
+        if (file.size()<shared_patchmap_control::position
+                       +sizeof(shared_patchmap_control))
+          throw std::runtime_error(string(typeid(map_type).name())+": "
+                                   +name+" is not a shared patchmap");
+      }
+      shared_patchmap_reader(const shared_patchmap_reader&) = delete;
+      shared_patchmap_reader& operator=(const shared_patchmap_reader&) =delete;
+      ~shared_patchmap_reader(){ file_type::detach(table); }
+      template<class key_type>
+      std::optional<mapped_type> find(const key_type& k) const {
+        return read(k,[](const mapped_type* v){
+            if (v) return std::optional<mapped_type>(*v);
+            return std::optional<mapped_type>();
+          });
+      }
+      template<class key_type>
+      size_type count(const key_type& k) const {
+        return read(k,[](const mapped_type* v){
+            return size_type(v!=nullptr);
+          });
+      }
+      template<class key_type>
+      mapped_type at(const key_type& k) const {
+        const std::optional<mapped_type> v = find(k);
+        if (!v) throw std::out_of_range(
+            std::string(typeid(*this).name())
+            +".at(key_type k) key not found"
+           );
+        return *v;
+      }
+      size_type size() const {
+        return control().size.load(std::memory_order_relaxed);
+      }
+      bool empty() const { return size()==0; }
+  };
+}
+#endif // SHARED_PATCH_MAP_H
@@ -0,0 +1,100 @@
+#ifndef SNAPSHOT_PATCH_MAP_H
+#define SNAPSHOT_PATCH_MAP_H
+
+#include <atomic>
+#include <mutex>
+#include "seqlock_patchmap.hpp"
+
+namespace whash{
+
+  template<class map_type>
+  class published_patchmap;
+
+  // A patchmap that can not be modified any more. It takes over the arrays
+  // of the map it is made from, nothing is copied.
+  template<class map_type>
+  class frozen_patchmap{
+    private:
+      map_type table;
+      friend class published_patchmap<map_type>;
+    public:
+      typedef typename map_type::size_type size_type;
+      explicit frozen_patchmap(map_type&& map):table(std::move(map)) {}
+      frozen_patchmap(const frozen_patchmap&) = delete;
+      frozen_patchmap& operator=(const frozen_patchmap&) = delete;
+      const map_type& operator*()  const { return  table; }
+      const map_type* operator->() const { return &table; }
+      template<class key_type>
+      size_type count(const key_type& k) const { return table.count(k); }
+      template<class key_type>
+      decltype(auto) at(const key_type& k) const { return table.at(k); }
+      size_type size() const { return table.size(); }
+      bool empty() const { return table.empty(); }
+  };
+
+  // The current frozen_patchmap of a service, replaced as a whole by a
+  // writer and read by any number of threads.
+  //
+  // Readers take no lock and share no counter. They announce themselves in
+  // the reader slot of their thread for the current epoch, load the
+  // pointer to the snapshot and leave the epoch when they are done with it.
+  // publish swaps in the new snapshot and waits until no reader of the old
+  // epoch is left before it hands back the old map. A thread must therefore
+  // not publish while it holds a snapshot itself.
+  template<class map_type>
+  class published_patchmap{
+    public:
+      typedef frozen_patchmap<map_type> frozen_type;
+      // a snapshot pinned for as long as this object lives
+      class snapshot{
+        private:
+          const published_patchmap* owner;
+          size_t epoch;
+          const frozen_type* frozen;
+          friend class published_patchmap;
+          explicit snapshot(const published_patchmap& owner)
+            :owner(&owner),
+             epoch(owner.epochs.enter()),
+             frozen(owner.current.load(std::memory_order_acquire)) {}
+        public:
+          snapshot(const snapshot&) = delete;
+          snapshot& operator=(const snapshot&) = delete;
+          snapshot(snapshot&& other)
+            :owner(other.owner),epoch(other.epoch),frozen(other.frozen) {
+            other.owner = nullptr;
+          }
+          ~snapshot(){ if (owner) owner->epochs.leave(epoch); }
+          const frozen_type& operator*()  const { return *frozen; }
+          const frozen_type* operator->() const { return  frozen; }
+      };
+    private:
+      std::atomic<frozen_type*> current;
+      std::mutex writer;
+      mutable reader_epochs<> epochs;
+    public:
+      explicit published_patchmap(map_type&& map = map_type())
+        :current(new frozen_type(std::move(map))) {}
+      published_patchmap(const published_patchmap&) = delete;
+      published_patchmap& operator=(const published_patchmap&) = delete;
+      ~published_patchmap(){ delete current.load(); }
+      snapshot acquire() const { return snapshot(*this); }
+      // run f(frozen) on the current snapshot and return its result
+      template<class F>
+      auto read(F&& f) const {
+        const snapshot s(*this);
+        return f(*s);
+      }
+      // make map the current snapshot and hand back the map of the previous
+      // one once no reader uses it any more, ready to be rebuilt
+      map_type publish(map_type&& map){
+        frozen_type* next = new frozen_type(std::move(map));
+        std::lock_guard<std::mutex> lock(writer);
+        frozen_type* old = current.exchange(next,std::memory_order_acq_rel);
+        epochs.synchronize();
+        map_type previous(std::move(old->table));
+        delete old;
+        return previous;
+      }
+  };
+}
+#endif // SNAPSHOT_PATCH_MAP_H
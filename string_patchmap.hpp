@@ -0,0 +1,400 @@
+#ifndef STRING_PATCH_MAP_H
+#define STRING_PATCH_MAP_H
+
+#include <string_view>
+#include "patchmap.hpp"
+
+namespace whash{
+  using std::string_view;
+
+  // The key as it is stored in a bucket of a string_patchmap: the bytes of
+  // the string live in the arena of the map, the bucket only holds where they
+  // are, how many there are and their hash. For lookups the same struct points
+  // into the string of the caller instead.
+  struct arena_key{
+    const char* bytes = nullptr;
+    size_t length = 0;
+    size_t hash = 0;
+    string_view view() const { return string_view(bytes,length); }
+  };
+
+  struct arena_key_hash{ // the hash is cached, no need to look at the bytes
+    constexpr size_t digits() const {
+      return whash::digits<size_t>();
+    }
+    size_t operator()(const arena_key& k) const { return k.hash; }
+  };
+
+  struct arena_key_equal{
+    bool operator()(const arena_key& a,const arena_key& b) const {
+      if (a.hash!=b.hash) return false;
+      return a.view()==b.view();
+    }
+  };
+
+  struct arena_key_less{ // only ever asked when the hashes are equal
+    bool operator()(const arena_key& a,const arena_key& b) const {
+      return a.view()<b.view();
+    }
+  };
+
+  // Append-only byte storage. Blocks are never moved once allocated so the
+  // pointers handed out stay valid until the arena is cleared or destroyed.
+  // Erasing a key only accounts its bytes as garbage, they are reclaimed when
+  // the owning map compacts into a fresh arena.
+  template<class alloc = std::allocator<char>>
+  class string_arena{
+    public:
+      typedef typename allocator_traits<alloc>::size_type size_type;
+      typedef alloc allocator_type;
+    private:
+      struct block{
+        char*     bytes;
+        size_type capacity;
+        size_type used;
+      };
+      vector<
+        block,
+        typename allocator_traits<alloc>::template rebind_alloc<block>
+      > blocks;
+      size_type live = 0;
+      size_type capacity = 0;
+      allocator_type allocator;
+      void add_block(const size_type& n){
+        size_type c = blocks.empty()?size_type(4096):2*blocks.back().capacity;
+        c = std::min(c,size_type(1)<<24);
+        c = std::max(c,n);
+        blocks.push_back({allocator_traits<alloc>::allocate(allocator,c),c,0});
+        capacity+=c;
+      }
+    public:
+      string_arena(const allocator_type& allocator = allocator_type())
+        :blocks(allocator),allocator(allocator) {}
+      string_arena(const string_arena&) = delete;
+      string_arena(string_arena&& other) noexcept
+        :blocks(other.allocator),allocator(other.allocator) {
+        swap(blocks,other.blocks);
+        swap(live,other.live);
+        swap(capacity,other.capacity);
+      }
+      string_arena& operator=(const string_arena&) = delete;
+      // Whether the blocks of other can be taken over, else its bytes are
+      // copied into blocks of this allocator and move their addresses.
+      bool takes_blocks_of(const string_arena& other) const {
+        return allocator_traits<alloc>::propagate_on_container_move_assignment
+                 ::value
+             ||(allocator==other.allocator);
+      }
+      string_arena& operator=(string_arena&& other) noexcept(
+          allocator_traits<alloc>::propagate_on_container_move_assignment
+            ::value
+        ||allocator_traits<alloc>::is_always_equal::value){
+        if (this==&other) return *this;
+        clear();
+        if (!takes_blocks_of(other)) {
+          size_type used = 0;
+          for (const block& b : other.blocks) used+=b.used;
+          if (used) {
+            reserve(used);
+            block& to = blocks.back();
+            for (const block& b : other.blocks) {
+              memcpy(to.bytes+to.used,b.bytes,b.used);
+              to.used+=b.used;
+            }
+          }
+          live = other.live;
+          other.clear();
+          return *this;
+        }
+        if constexpr (
+            allocator_traits<alloc>::propagate_on_container_move_assignment
+              ::value)
+          allocator = std::move(other.allocator);
+        blocks = std::move(other.blocks);
+        other.blocks.clear();
+        live = other.live;
+        capacity = other.capacity;
+        other.live = 0;
+        other.capacity = 0;
+        return *this;
+      }
+      ~string_arena(){ clear(); }
+      // make sure the next n bytes can be appended without allocating
+      void reserve(const size_type& n){
+        if (blocks.empty()||(blocks.back().capacity-blocks.back().used<n))
+          add_block(n);
+      }
+      const char* append(const char* s,const size_type& n){
+        if (n==0) return nullptr;
+        reserve(n);
+        block& b = blocks.back();
+        char* p = b.bytes+b.used;
+        memcpy(p,s,n);
+        b.used+=n;
+        live+=n;
+        return p;
+      }
+      void release(const size_type& n){
+        assert(n<=live);
+        live-=n;
+      }
+      void clear(){
+        for (block& b : blocks)
+          allocator_traits<alloc>::deallocate(allocator,b.bytes,b.capacity);
+        blocks.clear();
+        live = 0;
+        capacity = 0;
+      }
+      size_type live_bytes()      const { return live; }
+      size_type allocated_bytes() const { return capacity; }
+      allocator_type get_allocator() const { return allocator; }
+  };
+
+  // A patchmap for string keys. Instead of one std::string per bucket the key
+  // bytes are appended to an arena owned by the map and the buckets only hold
+  // an arena_key, which is trivially copyable and carries the hash, so
+  // displacing elements is a plain copy and comparisons rarely touch the key
+  // bytes at all. The arena is compacted, in hash order, whenever the table is
+  // resized.
+  template<
+    class mapped_type,
+    class string_hash = std::hash<string_view>,
+    class alloc       = std::allocator<char>
+  >
+  class string_patchmap
+    : private patchmap<
+        arena_key,
+        mapped_type,
+        arena_key_hash,
+        arena_key_equal,
+        arena_key_less,
+        typename allocator_traits<alloc>::template rebind_alloc<
+          tuple<
+            arena_key,
+            typename conditional<
+              is_same<mapped_type,void>::value,
+              std::true_type,
+              mapped_type
+            >::type
+          >
+        >
+      >
+  {
+    private:
+      typedef patchmap<
+        arena_key,
+        mapped_type,
+        arena_key_hash,
+        arena_key_equal,
+        arena_key_less,
+        typename allocator_traits<alloc>::template rebind_alloc<
+          tuple<
+            arena_key,
+            typename conditional<
+              is_same<mapped_type,void>::value,
+              std::true_type,
+              mapped_type
+            >::type
+          >
+        >
+      > table_type;
+    public:
+      typedef typename table_type::size_type size_type;
+      typedef typename table_type::_mapped_type _mapped_type;
+    private:
+      using table_type::data;
+      using table_type::datasize;
+      using table_type::num_data;
+      using table_type::allocator;
+      using table_type::find_node;
+      using table_type::find_next;
+      using table_type::reserve_node;
+      typedef typename table_type::sizing_policy sizing_policy;
+      typedef typename table_type::allocator_type table_allocator;
+      string_arena<alloc> arena;
+      string_hash string_hasher;
+      arena_key probe(const string_view& k) const {
+        return {k.data(),k.size(),string_hasher(k)};
+      }
+      // copy all live keys into a fresh arena, in bucket order
+      void compact(){
+        string_arena<alloc> fresh(arena.get_allocator());
+        fresh.reserve(arena.live_bytes());
+        for (size_type i=find_next(0);i<datasize;i=find_next(i+1)){
+          arena_key& k = get<0>(data[i]);
+          k.bytes = fresh.append(k.bytes,k.length);
+        }
+        arena = std::move(fresh);
+      }
+      // reserve a bucket for a key that is not yet in the table, move its
+      // bytes into the arena and construct the element, growing the table
+      // first if needed
+      template<class... Args>
+      size_type insert_node(arena_key k,Args&&... args){
+        sizing_policy policy(num_data,datasize);
+        if (!policy.is_sufficient()) resize(policy.nextsize());
+        k.bytes = arena.append(k.bytes,k.length);
+        const size_type j = reserve_node(k);
+        allocator_traits<table_allocator>::construct(allocator,data+j,
+            k,std::forward<Args>(args)...);
+        return j;
+      }
+    public:
+      template<bool is_const>
+      class const_noconst_iterator {
+        friend class string_patchmap;
+        private:
+          size_type i;
+          typename conditional<is_const,
+                               const string_patchmap*,
+                                     string_patchmap*
+                              >::type map;
+        public:
+          typedef std::ptrdiff_t difference_type;
+          typedef std::forward_iterator_tag iterator_category;
+          const_noconst_iterator(
+              const size_type& i,
+              typename conditional<is_const,
+                                   const string_patchmap*,
+                                         string_patchmap*
+                                  >::type map)
+            :i(i),map(map) {}
+          template<bool is_const_other>
+          const_noconst_iterator(const const_noconst_iterator<is_const_other>& o)
+            :i(o.i),map(o.map) {}
+          template<bool is_const_other>
+          bool operator==(const const_noconst_iterator<is_const_other>& o) const {
+            if ((i>=map->datasize)&&(o.i>=o.map->datasize)) return true;
+            return i==o.i;
+          }
+          template<bool is_const_other>
+          bool operator!=(const const_noconst_iterator<is_const_other>& o) const {
+            return !((*this)==o);
+          }
+          const_noconst_iterator& operator++(){
+            i = map->find_next(i+1);
+            return *this;
+          }
+          const_noconst_iterator operator++(int){
+            const_noconst_iterator pre(*this);
+            ++(*this);
+            return pre;
+          }
+          auto operator*() const {
+            if constexpr (is_same<void,mapped_type>::value) {
+              return get<0>(map->data[i]).view();
+            } else if constexpr (is_const) {
+              return pair<string_view,const _mapped_type&>(
+                  get<0>(map->data[i]).view(),
+                  get<1>(map->data[i]));
+            } else {
+              return pair<string_view,_mapped_type&>(
+                  get<0>(map->data[i]).view(),
+                  get<1>(map->data[i]));
+            }
+          }
+      };
+      typedef const_noconst_iterator<false> iterator;
+      typedef const_noconst_iterator<true>  const_iterator;
+      string_patchmap(
+          const size_type& datasize = 0,
+          const alloc& allocator = alloc())
+        :table_type(datasize,table_allocator(allocator)),arena(allocator) {}
+      explicit string_patchmap(const alloc& allocator)
+        :string_patchmap(0,allocator) {}
+      string_patchmap(string_patchmap&& other) = default;
+      string_patchmap(const string_patchmap& other)
+        :table_type(other),
+         arena(allocator_traits<alloc>::select_on_container_copy_construction(
+               other.arena.get_allocator())) {
+        compact(); // the buckets still point into the arena of other
+      }
+      string_patchmap& operator=(string_patchmap&& other){
+        if (this==&other) return *this;
+        table_type::operator=(std::move(other));
+        string_hasher = std::move(other.string_hasher);
+        if (arena.takes_blocks_of(other.arena)) {
+          arena = std::move(other.arena);
+          return *this;
+        }
+        arena.clear();
+        compact(); // the buckets still point into the arena of other
+        other.clear();
+        return *this;
+      }
+      string_patchmap& operator=(const string_patchmap& other){
+        return *this = string_patchmap(other);
+      }
+      _mapped_type& operator[](const string_view& k){
+        const arena_key p = probe(k);
+        const size_type i = find_node(p);
+        if (i<datasize) return get<1>(data[i]);
+        const size_type j = insert_node(p,_mapped_type());
+        return get<1>(data[j]);
+      }
+      pair<iterator,bool> insert(
+          const string_view& k,
+          const _mapped_type& v = _mapped_type()){
+        const arena_key p = probe(k);
+        const size_type i = find_node(p);
+        if (i<datasize) return {iterator(i,this),false};
+        return {iterator(insert_node(p,v),this),true};
+      }
+      _mapped_type& at(const string_view& k){
+        const size_type i = find_node(probe(k));
+        if (i>=datasize) throw std::out_of_range(
+            std::string(typeid(*this).name())
+            +".at(string_view k) key not found, array index "
+            +to_string(i)+" out of bounds"
+           );
+        return get<1>(data[i]);
+      }
+      const _mapped_type& at(const string_view& k) const {
+        const size_type i = find_node(probe(k));
+        if (i>=datasize) throw std::out_of_range(
+            std::string(typeid(*this).name())
+            +".at(string_view k) key not found, array index "
+            +to_string(i)+" out of bounds"
+           );
+        return get<1>(data[i]);
+      }
+      size_type count(const string_view& k) const {
+        return (find_node(probe(k))<datasize);
+      }
+      iterator find(const string_view& k){
+        return iterator(find_node(probe(k)),this);
+      }
+      const_iterator find(const string_view& k) const {
+        return const_iterator(find_node(probe(k)),this);
+      }
+      size_type erase(const string_view& k){
+        if (!table_type::erase(probe(k))) return 0;
+        arena.release(k.size());
+        return 1;
+      }
+      void clear(){
+        table_type::clear();
+        arena.clear();
+      }
+      void resize(const size_type& n){
+        if (n<num_data) return;
+        table_type::resize(n);
+        compact();
+      }
+      void reserve(const size_type& n){ if (3*n>=2*(size()+1)) resize(n*3/2); }
+      iterator begin(){ return iterator(find_next(0),this); }
+      const_iterator begin() const { return const_iterator(find_next(0),this); }
+      const_iterator cbegin() const { return begin(); }
+      iterator end(){ return iterator(~size_type(0),this); }
+      const_iterator end() const { return const_iterator(~size_type(0),this); }
+      const_iterator cend() const { return end(); }
+      using table_type::size;
+      using table_type::empty;
+      using table_type::bucket_count;
+      using table_type::load_factor;
+      using table_type::check_ordering;
+      size_type arena_live_bytes()      const { return arena.live_bytes(); }
+      size_type arena_allocated_bytes() const { return arena.allocated_bytes(); }
+  };
+}
+#endif // STRING_PATCH_MAP_H
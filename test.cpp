@@ -1,3 +1,4 @@
+#include <fstream>
 #include <iostream>
 #include <limits>
 #include <cmath>
@@ -6,9 +7,28 @@
 #include <iomanip>
 #include <unordered_map>
 #include <chrono>
+#include <thread>
 #include "patchmap.hpp"
+#include "string_patchmap.hpp"
+#include "numa_allocator.hpp"
+#include "seqlock_patchmap.hpp"
+#include "concurrent_patchmap.hpp"
+#include "parallel_patchmap.hpp"
+#include "snapshot_patchmap.hpp"
+#include "sealed_patchmap.hpp"
+#include "patchmap_file.hpp"
+#include "persistent_patchmap.hpp"
+#include "patchmap_stream.hpp"
+#include "tracked_patchmap.hpp"
+#include "shared_patchmap.hpp"
+#include "segmented_patchmap.hpp"
+#include "patchmap_algebra.hpp"
+#include <sstream>
+#include <sys/wait.h>
 
 using whash::patchmap;
+using whash::small_patchmap;
+using whash::string_patchmap;
 
 using std::cout;
 using std::endl;
@@ -20,6 +40,7 @@ using std::vector;
 using std::tuple;
 using std::get;
 using std::allocator_traits;
+using std::to_string;
 
 void test_uint32_t(){
   std::minstd_rand mr;
@@ -173,6 +194,1280 @@ void test_string(){
   cout << "test_string() was successfully executed" << endl;
 }
 
+void test_string_patchmap(){
+  const size_t N = 1ull<<12;
+  vector<string> keys;
+  for (size_t i=0;i!=N;++i) {
+    keys.push_back(to_string(i*2654435761ull));
+    if (i%7==0) keys.back()+=string(64,'x'); // some keys longer than SSO
+  }
+  string_patchmap<size_t> test;
+  for (size_t i=0;i!=N;++i) test[keys[i]]=i;
+  if (test.size()!=N) {
+    cout << "test failed, string_patchmap lost keys" << endl;
+    exit(1);
+  }
+  for (size_t i=0;i<N;i+=3) test.erase(keys[i]);
+  for (size_t i=0;i!=N;++i) {
+    if (test.count(keys[i])!=(i%3!=0)) {
+      cout << "test failed, string_patchmap count is wrong" << endl;
+      exit(1);
+    }
+    if ((i%3!=0)&&(test.at(keys[i])!=i)) {
+      cout << "test failed, string_patchmap value does not match" << endl;
+      exit(1);
+    }
+  }
+  if (!test.insert(keys[0],0).second||test.insert(keys[1],7).second) {
+    cout << "test failed, string_patchmap insert is wrong" << endl;
+    exit(1);
+  }
+  test.resize(test.size()); // compacts the arena
+  const string_patchmap<size_t> other = test;
+  size_t bytes = 0;
+  for (const auto& elem : other) {
+    if (keys[elem.second]!=elem.first) {
+      cout << "test failed, string_patchmap iteration is wrong" << endl;
+      exit(1);
+    }
+    bytes+=elem.first.size();
+  }
+  if ((bytes!=other.arena_live_bytes())||(bytes!=test.arena_live_bytes())) {
+    cout << "test failed, string_patchmap arena is not compact" << endl;
+    exit(1);
+  }
+  cout << "test_string_patchmap() was successfully executed" << endl;
+}
+
+void test_small_patchmap(){
+  small_patchmap<uint32_t,uint32_t,16> test;
+  if (test.bucket_count()!=16) {
+    cout << "test failed, small_patchmap does not start inline" << endl;
+    exit(1);
+  }
+  for (uint32_t i=0;i!=12;++i) test[i]=i;
+  small_patchmap<uint32_t,uint32_t,16> moved(std::move(test));
+  if ((moved.size()!=12)||(test.size()!=0)||(moved.bucket_count()!=16)) {
+    cout << "test failed, moving an inline small_patchmap is wrong" << endl;
+    exit(1);
+  }
+  for (uint32_t i=12;i!=256;++i) moved[i]=i;
+  const small_patchmap<uint32_t,uint32_t,16> copy = moved;
+  for (uint32_t i=0;i!=256;++i) {
+    if ((copy.at(i)!=i)||(moved.at(i)!=i)) {
+      cout << "test failed, small_patchmap lost a value" << endl;
+      exit(1);
+    }
+  }
+  for (uint32_t i=0;i!=250;++i) moved.erase(i);
+  moved.resize(moved.size()); // back into the inline storage
+  moved.resize(moved.size()+1);
+  for (uint32_t i=250;i!=256;++i) {
+    if (moved.at(i)!=i) {
+      cout << "test failed, small_patchmap lost a value after shrinking"
+           << endl;
+      exit(1);
+    }
+  }
+  test = std::move(moved);
+  if ((test.size()!=6)||(!test.check_ordering())) {
+    cout << "test failed, move assigning a small_patchmap is wrong" << endl;
+    exit(1);
+  }
+  cout << "test_small_patchmap() was successfully executed" << endl;
+}
+
+class counting_resource : public std::pmr::memory_resource {
+  public:
+    size_t allocations = 0;
+    size_t live = 0;
+  private:
+    void* do_allocate(size_t bytes,size_t alignment) override {
+      ++allocations;
+      live+=bytes;
+      return std::pmr::new_delete_resource()->allocate(bytes,alignment);
+    }
+    void do_deallocate(void* p,size_t bytes,size_t alignment) override {
+      live-=bytes;
+      std::pmr::new_delete_resource()->deallocate(p,bytes,alignment);
+    }
+    bool do_is_equal(const std::pmr::memory_resource& o) const noexcept
+    override {
+      return this==&o;
+    }
+};
+
+void test_pmr_patchmap(){
+  counting_resource r0,r1;
+  {
+    whash::pmr::patchmap<uint32_t,uint32_t> test(&r0);
+    test.resize(1000);
+    if (r0.allocations!=1) {
+      cout << "test failed, mask and buckets are not allocated together"
+           << endl;
+      exit(1);
+    }
+    for (uint32_t i=0;i!=1000;++i) test[i]=i;
+    whash::pmr::patchmap<uint32_t,uint32_t> other(&r1);
+    other = test; // allocators of pmr containers do not propagate
+    if ((other.get_allocator().resource()!=&r1)||(r1.live==0)) {
+      cout << "test failed, pmr patchmap copy used the wrong resource" << endl;
+      exit(1);
+    }
+    whash::pmr::patchmap<uint32_t,uint32_t> moved(&r1);
+    moved = std::move(test); // different resource, moves element wise
+    static_assert(!std::is_nothrow_move_assignable<
+                    whash::pmr::patchmap<uint32_t,uint32_t>>::value
+                &&std::is_nothrow_move_assignable<
+                    patchmap<uint32_t,uint32_t>>::value,
+        "only move assignment that may allocate can throw");
+    if ((moved.size()!=1000)||(test.size()!=0)) {
+      cout << "test failed, pmr patchmap move assignment is wrong" << endl;
+      exit(1);
+    }
+    for (uint32_t i=0;i!=1000;++i) {
+      if ((moved.at(i)!=i)||(other.at(i)!=i)) {
+        cout << "test failed, pmr patchmap lost a value" << endl;
+        exit(1);
+      }
+    }
+    std::pmr::monotonic_buffer_resource arena(&r0);
+    whash::pmr::patchmap<uint32_t,uint32_t> a(&arena);
+    for (uint32_t i=0;i!=100;++i) a[i]=i;
+    swap(a,moved);
+    if ((a.size()!=1000)||(moved.size()!=100)||(a.at(999)!=999)) {
+      cout << "test failed, swapping pmr patchmaps is wrong" << endl;
+      exit(1);
+    }
+  }
+  if ((r0.live!=0)||(r1.live!=0)) {
+    cout << "test failed, pmr patchmap leaked memory" << endl;
+    exit(1);
+  }
+  cout << "test_pmr_patchmap() was successfully executed" << endl;
+}
+
+void test_pmr_string_patchmap(){
+  typedef string_patchmap<
+    size_t,
+    std::hash<std::string_view>,
+    std::pmr::polymorphic_allocator<char>
+  > map_type;
+  const size_t N = 1ull<<10;
+  vector<string> keys;
+  for (size_t i=0;i!=N;++i) keys.push_back(to_string(i*2654435761ull));
+  counting_resource r0,r1;
+  {
+    map_type test(&r0);
+    for (size_t i=0;i!=N;++i) test[keys[i]]=i; // compacts on every resize
+    map_type same(&r0), other(&r1);
+    same = std::move(test); // takes over the arena
+    same[keys[0]] = 0;
+    other = same;
+    map_type moved(&r1);
+    moved = std::move(same); // different resource, copies the key bytes
+    if ((moved.size()!=N)||(same.size()!=0)||(other.size()!=N)
+      ||(moved.arena_live_bytes()!=other.arena_live_bytes())) {
+      cout << "test failed, pmr string_patchmap assignment is wrong" << endl;
+      exit(1);
+    }
+    for (size_t i=0;i!=N;++i) {
+      if ((moved.at(keys[i])!=i)||(other.at(keys[i])!=i)) {
+        cout << "test failed, pmr string_patchmap lost a value" << endl;
+        exit(1);
+      }
+    }
+    if (same.arena_allocated_bytes()!=0) {
+      cout << "test failed, pmr string_patchmap kept the moved key bytes"
+           << endl;
+      exit(1);
+    }
+  }
+  if ((r0.live!=0)||(r1.live!=0)) {
+    cout << "test failed, pmr string_patchmap leaked memory" << endl;
+    exit(1);
+  }
+  cout << "test_pmr_string_patchmap() was successfully executed" << endl;
+}
+
+void test_numa_patchmap(){
+  typedef whash::numa_patchmap<uint64_t,uint64_t> map_type;
+  for (auto policy : {whash::numa_policy::interleave,
+                      whash::numa_policy::partition}) {
+    map_type test(map_type::allocator_type{policy});
+    for (uint64_t i=0;i!=1ull<<14;++i) test[i]=i; // large enough for mmap
+    map_type copy(test);
+    for (uint64_t i=0;i!=1ull<<14;++i) {
+      if ((copy.at(i)!=i)||(whash::numa_node_of(&test.at(i))<0)) {
+        cout << "test failed, numa_patchmap lost a value" << endl;
+        exit(1);
+      }
+    }
+  }
+  cout << "test_numa_patchmap() was successfully executed" << endl;
+}
+
+void test_extreme_load(){
+  const size_t N = 1ull<<14;
+  patchmap<uint64_t,uint64_t> test;
+  for (uint64_t i=0;i!=N;++i) test[i]=i;
+  test.resize(N+N/64); // load factor above 0.98
+  for (uint64_t i=0;i!=N/2;++i) {
+    test.erase(i);
+    test[N+i]=N+i;
+  }
+  size_t n = 0;
+  uint64_t last = 0;
+  for (auto it=test.begin();it!=test.end();++it,++n) {
+    if (it->first!=it->second) {
+      cout << "test failed, value does not match at high load" << endl;
+      exit(1);
+    }
+    last = it->first;
+  }
+  auto it = test.find(last);
+  for (;n>1;--n) --it;
+  if ((n!=1)||(it!=test.begin())||(test.size()!=N)||(!test.check_ordering())) {
+    cout << "test failed, iterating a table at high load is wrong" << endl;
+    exit(1);
+  }
+  patchmap<uint64_t,uint64_t> sparse(1ull<<20); // load factor below 0.0001
+  for (uint64_t i=0;i!=64;++i) sparse[i*i]=i;
+  n = 0;
+  for (auto it=sparse.begin();it!=sparse.end();++it,++n) {
+    if (it->first!=it->second*it->second) {
+      cout << "test failed, value does not match at low load" << endl;
+      exit(1);
+    }
+  }
+  for (uint64_t i=0;i!=64;++i) sparse.erase(i*i);
+  if ((n!=64)||(sparse.begin()!=sparse.end())) {
+    cout << "test failed, iterating a table at low load is wrong" << endl;
+    exit(1);
+  }
+  cout << "test_extreme_load() was successfully executed" << endl;
+}
+
+void test_iterator_arithmetic(){
+  for (uint64_t w : {0ull,1ull,~0ull,0x8000000000000001ull,
+                     0x0123456789abcdefull}) {
+    if ((whash::clz(w)!=uint64_t(w?__builtin_clzll(w):64))
+      ||(whash::ctz(w)!=uint64_t(w?__builtin_ctzll(w):64))) {
+      cout << "test failed, clz or ctz is wrong" << endl;
+      exit(1);
+    }
+    for (uint64_t r=0,i=0;i!=64;++i) {
+      if (!(w&(1ull<<(63-i)))) continue;
+      if (whash::select_bit(w,r++)!=i) {
+        cout << "test failed, select_bit is wrong" << endl;
+        exit(1);
+      }
+    }
+  }
+  std::mt19937_64 mr(7);
+  patchmap<uint64_t,uint64_t> test;
+  const size_t N = 1ull<<12;
+  for (size_t i=0;i!=N;++i) test[mr()]=i;
+  test.resize(N+N/8);
+  vector<uint64_t> keys;
+  for (auto it=test.begin();it!=test.end();++it) keys.push_back(it->first);
+  const auto begin = test.begin();
+  if ((size_t(test.end()-begin)!=N)||(begin-test.end()!=-ptrdiff_t(N))) {
+    cout << "test failed, distance from begin to end is wrong" << endl;
+    exit(1);
+  }
+  for (size_t i=0;i<N;i+=97) {
+    auto it = begin+i;
+    if ((it->first!=keys[i])||(size_t(it-begin)!=i)) {
+      cout << "test failed, iterator + or - is wrong" << endl;
+      exit(1);
+    }
+    if ((((it+(N-i-1))-=(N-i-1))!=it)||((test.end()-(N-i))!=it)) {
+      cout << "test failed, iterator -= is wrong" << endl;
+      exit(1);
+    }
+  }
+  if (begin+N!=test.end()) {
+    cout << "test failed, iterator does not end at end" << endl;
+    exit(1);
+  }
+  cout << "test_iterator_arithmetic() was successfully executed" << endl;
+}
+
+void test_fenced_patchmap(){
+  std::mt19937_64 mr(11);
+  whash::fenced_patchmap<uint64_t,uint64_t> test;
+  std::unordered_map<uint64_t,uint64_t> control;
+  for (size_t i=0;i!=1ull<<14;++i) {
+    const uint64_t k = mr()%(1ull<<12);
+    if (mr()%3) {
+      test[k]=i;
+      control[k]=i;
+    } else {
+      if (test.erase(k)!=control.erase(k)) {
+        cout << "test failed, fenced erase is wrong" << endl;
+        exit(1);
+      }
+    }
+  }
+  if ((test.size()!=control.size())||(!test.check_ordering())) {
+    cout << "test failed, fenced patchmap has wrong size or order" << endl;
+    exit(1);
+  }
+  for (uint64_t k=0;k!=1ull<<12;++k) {
+    if (test.count(k)!=control.count(k)) {
+      cout << "test failed, fenced lookup of " << k << " is wrong" << endl;
+      exit(1);
+    }
+    if (control.count(k)&&(test.at(k)!=control[k])) {
+      cout << "test failed, fenced value of " << k << " is wrong" << endl;
+      exit(1);
+    }
+  }
+  patchmap<uint64_t,uint64_t> plain;
+  for (auto it=control.begin();it!=control.end();++it) plain[it->first]=it->second;
+  test = plain;
+  for (auto it=control.begin();it!=control.end();++it) {
+    if (test.at(it->first)!=it->second) {
+      cout << "test failed, fenced patchmap assigned from plain is wrong" << endl;
+      exit(1);
+    }
+  }
+  whash::fenced_patchmap<string,size_t> strings;
+  for (size_t i=0;i!=4096;++i) strings[to_string(i)]=i;
+  for (size_t i=0;i<4096;i+=2) strings.erase(to_string(i));
+  for (size_t i=0;i!=4096;++i) {
+    if (strings.count(to_string(i))!=(i&1)) {
+      cout << "test failed, fenced lookup of strings is wrong" << endl;
+      exit(1);
+    }
+  }
+  cout << "test_fenced_patchmap() was successfully executed" << endl;
+}
+
+void test_seqlock_patchmap(){
+  const uint64_t N = 1ull<<12;
+  whash::seqlock_patchmap<uint64_t,uint64_t> test;
+  // the even keys are there from the start and are never erased
+  for (uint64_t i=0;i<N;i+=2) test.insert(i,3*i);
+  std::atomic<bool> done{false};
+  std::atomic<size_t> errors{0};
+  vector<std::thread> readers;
+  for (size_t t=0;t!=3;++t) {
+    readers.emplace_back([&,t](){
+        std::mt19937_64 mr(t);
+        while (!done.load()) {
+          const uint64_t k = mr()%N;
+          const auto v = test.find(k);
+          if ((k%2==0)&&(!v)) ++errors;
+          if (v&&(*v!=3*k)) ++errors;
+        }
+      });
+  }
+  // two writers on interleaved odd keys, growing the table into new keys
+  vector<std::thread> writers;
+  for (uint64_t w=0;w!=2;++w) {
+    writers.emplace_back([&,w](){
+        for (size_t r=0;r!=4;++r) {
+          for (uint64_t i=1+2*w;i<N;i+=4) test.insert(i,3*i);
+          for (uint64_t i=1+2*w;i<N;i+=4) test.erase(i);
+        }
+        for (uint64_t i=N+w;i<2*N;i+=2) test.insert(i,3*i);
+      });
+  }
+  for (auto& t : writers) t.join();
+  for (uint64_t i=1;i<N;i+=4) test.insert_or_assign(i,3*i);
+  done = true;
+  for (auto& t : readers) t.join();
+  if (errors) {
+    cout << "test failed, seqlock readers saw " << errors
+         << " inconsistent states" << endl;
+    exit(1);
+  }
+  for (uint64_t i=0;i!=2*N;++i) {
+    if (test.count(i)!=((i%2==0)||(i%4==1)||(i>=N))) {
+      cout << "test failed, seqlock patchmap lost or kept " << i << endl;
+      exit(1);
+    }
+  }
+  if ((test.size()!=N+N/2+N/4)||(test.at(5)!=15)) {
+    cout << "test failed, seqlock patchmap has wrong size or value" << endl;
+    exit(1);
+  }
+  cout << "test_seqlock_patchmap() was successfully executed" << endl;
+}
+
+void test_concurrent_patchmap(){
+  const uint64_t N = 1ull<<14;
+  whash::concurrent_patchmap<uint64_t,uint64_t> test;
+  vector<std::thread> writers;
+  for (uint64_t t=0;t!=4;++t) {
+    writers.emplace_back([&,t](){
+        for (uint64_t i=t;i<N;i+=4) test.insert(i,i);
+        for (uint64_t i=t;i<N;i+=8) test.erase(i);
+        for (uint64_t i=t;i<N;i+=4) test.update(i,[](uint64_t& v,bool){ ++v; });
+      });
+  }
+  for (auto& t : writers) t.join();
+  for (uint64_t i=0;i!=N;++i) {
+    // erased keys were inserted again with a default value by update
+    const auto v = test.find(i);
+    if ((!v)||(*v!=((i%8<4)?1:i+1))) {
+      cout << "test failed, concurrent patchmap lost " << i << endl;
+      exit(1);
+    }
+  }
+  if (test.size()!=N) {
+    cout << "test failed, concurrent patchmap has wrong size" << endl;
+    exit(1);
+  }
+  size_t n = 0;
+  uint64_t last = 0;
+  bool ordered = true;
+  test.for_each([&](const uint64_t& k,uint64_t&){
+      const uint64_t h = whash::hash<uint64_t>{}(k);
+      if (n++&&(h<=last)) ordered = false;
+      last = h;
+    });
+  if ((n!=N)||(!ordered)) {
+    cout << "test failed, concurrent patchmap is not visited in hash order"
+         << endl;
+    exit(1);
+  }
+  whash::concurrent_patchmap<string,size_t,std::hash<string>,
+                             std::equal_to<string>,2> strings;
+  for (size_t i=0;i!=1000;++i) strings.insert(to_string(i),i);
+  for (size_t i=0;i!=1000;++i) {
+    if (strings.at(to_string(i))!=i) {
+      cout << "test failed, concurrent patchmap of strings is wrong" << endl;
+      exit(1);
+    }
+  }
+  cout << "test_concurrent_patchmap() was successfully executed" << endl;
+}
+
+void test_parallel_build(){
+  const size_t N = 1ull<<15;
+  std::mt19937_64 mr(7);
+  // about a third of the keys appear more than once
+  vector<std::pair<uint64_t,uint64_t>> input(N);
+  for (size_t i=0;i!=N;++i) input[i] = {mr()%(2*N),i};
+  patchmap<uint64_t,uint64_t> test;
+  test[1] = 1;
+  whash::parallel_build(test,input.begin(),input.end(),4);
+  std::unordered_map<uint64_t,uint64_t> reference;
+  for (const auto& e : input) reference.emplace(e.first,e.second);
+  if ((test.size()!=reference.size())||(!test.check_ordering())) {
+    cout << "test failed, parallel build has wrong size or order" << endl;
+    exit(1);
+  }
+  for (const auto& e : reference) {
+    if ((test.count(e.first)!=1)||(test.at(e.first)!=e.second)) {
+      cout << "test failed, parallel build lost " << e.first << endl;
+      exit(1);
+    }
+  }
+  test.erase(input[0].first);
+  test[2*N] = 0;
+  if ((test.size()!=reference.size())||(!test.check_ordering())) {
+    cout << "test failed, parallel built patchmap can not be modified"
+         << endl;
+    exit(1);
+  }
+  whash::parallel_build(test,input.begin(),input.begin(),4);
+  if (!test.empty()) {
+    cout << "test failed, parallel build of nothing is not empty" << endl;
+    exit(1);
+  }
+  vector<std::pair<string,size_t>> strings;
+  for (size_t i=0;i!=3000;++i) strings.emplace_back(to_string(i%2000),i);
+  patchmap<string,size_t> stest;
+  whash::parallel_build(stest,strings.begin(),strings.end(),3);
+  if (stest.size()!=2000) {
+    cout << "test failed, parallel build of strings has wrong size" << endl;
+    exit(1);
+  }
+  for (size_t i=0;i!=2000;++i) {
+    if (stest.at(to_string(i))!=i) {
+      cout << "test failed, parallel build of strings is wrong" << endl;
+      exit(1);
+    }
+  }
+  cout << "test_parallel_build() was successfully executed" << endl;
+}
+
+void test_parallel_for_each(){
+  const uint64_t N = 1ull<<14;
+  patchmap<uint64_t,uint64_t> test;
+  for (uint64_t i=0;i!=N;++i) test[i] = i;
+  const whash::parallel_policy policy{4,2};
+  whash::for_each(policy,test,[](const uint64_t& k,uint64_t& v){ v+=k; });
+  const patchmap<uint64_t,uint64_t>& ctest = test;
+  std::atomic<uint64_t> visited{0},wrong{0};
+  whash::for_each(policy,ctest,[&](const uint64_t& k,const uint64_t& v){
+      ++visited;
+      if (v!=2*k) ++wrong;
+    });
+  if ((visited!=N)||wrong) {
+    cout << "test failed, parallel for_each visited " << visited
+         << " elements with " << wrong << " wrong values" << endl;
+    exit(1);
+  }
+  const uint64_t sum = whash::transform_reduce(policy,test,uint64_t(0),
+      std::plus<uint64_t>(),
+      [](const uint64_t& k,const uint64_t& v){ return v-k; });
+  if (sum!=N*(N-1)/2) {
+    cout << "test failed, parallel transform_reduce is " << sum << endl;
+    exit(1);
+  }
+  patchmap<string,size_t> strings;
+  for (size_t i=0;i!=1000;++i) strings[to_string(i)] = i;
+  const size_t longest = whash::transform_reduce(
+      whash::parallel_policy{3,1},strings,size_t(0),
+      [](const size_t& a,const size_t& b){ return std::max(a,b); },
+      [](const string& k,const size_t&){ return k.size(); });
+  patchmap<uint64_t,uint64_t> empty;
+  if ((longest!=3)||(whash::transform_reduce(policy,empty,uint64_t(7),
+          std::plus<uint64_t>(),
+          [](const uint64_t&,const uint64_t&){ return 1; })!=7)) {
+    cout << "test failed, parallel transform_reduce of strings or of an "
+         << "empty patchmap is wrong" << endl;
+    exit(1);
+  }
+  cout << "test_parallel_for_each() was successfully executed" << endl;
+}
+
+void test_published_patchmap(){
+  typedef patchmap<uint64_t,uint64_t> map_type;
+  const uint64_t N = 1ull<<10;
+  whash::published_patchmap<map_type> test;
+  std::atomic<bool> done{false};
+  std::atomic<size_t> errors{0};
+  vector<std::thread> readers;
+  for (size_t t=0;t!=3;++t) {
+    readers.emplace_back([&,t](){
+        std::mt19937_64 mr(t);
+        uint64_t last = 0;
+        while (!done.load()) {
+          // all keys of one snapshot belong to the same generation, which
+          // only ever grows
+          const auto s = test.acquire();
+          if (s->empty()) continue;
+          const uint64_t g = s->at(mr()%N);
+          if ((g<last)||(s->at(mr()%N)!=g)||(s->size()!=N)) ++errors;
+          last = g;
+        }
+      });
+  }
+  map_type next;
+  for (uint64_t g=1;g!=64;++g) {
+    for (uint64_t i=0;i!=N;++i) next[i] = g;
+    next = test.publish(std::move(next));
+    if ((g>1)&&((next.size()!=N)||(next.at(0)!=g-1))) {
+      cout << "test failed, published patchmap handed back wrong map" << endl;
+      exit(1);
+    }
+  }
+  done = true;
+  for (auto& t : readers) t.join();
+  if (errors) {
+    cout << "test failed, published patchmap readers saw " << errors
+         << " inconsistent snapshots" << endl;
+    exit(1);
+  }
+  if (test.read([](const auto& f){ return f.at(N-1); })!=63) {
+    cout << "test failed, published patchmap has wrong snapshot" << endl;
+    exit(1);
+  }
+  cout << "test_published_patchmap() was successfully executed" << endl;
+}
+
+void test_sealed_patchmap(){
+  typedef patchmap<uint64_t,uint64_t> map_type;
+  const uint64_t N = 1ull<<12;
+  map_type counts;
+  for (uint64_t i=0;i!=N;++i) counts[i] = 0;
+  whash::sealed_patchmap<map_type> test(std::move(counts));
+  vector<std::thread> threads;
+  for (uint64_t t=0;t!=4;++t) {
+    threads.emplace_back([&,t](){
+        for (size_t r=0;r!=8;++r)
+          for (uint64_t i=0;i!=N;++i) test.add(i,1);
+        test.add(N+t,1);
+      });
+  }
+  for (auto& t : threads) t.join();
+  threads.clear();
+  for (uint64_t t=0;t!=4;++t) {
+    threads.emplace_back([&,t](){
+        for (uint64_t i=0;i!=N;++i) test.max(i,32+t);
+      });
+  }
+  for (auto& t : threads) t.join();
+  for (uint64_t i=0;i!=N;++i) {
+    if (*test.load(i)!=35) {
+      cout << "test failed, sealed patchmap value of " << i << " is "
+           << *test.load(i) << endl;
+      exit(1);
+    }
+  }
+  if (test.count(N)||test.load(N)||test.min(N,0)||(test.size()!=N)) {
+    cout << "test failed, sealed patchmap has a key it should not" << endl;
+    exit(1);
+  }
+  test.min(7,3);
+  test.ref(8)->fetch_add(2);
+  counts = test.unseal();
+  if ((counts.size()!=N)||(counts[7]!=3)||(counts[8]!=37)) {
+    cout << "test failed, unsealed patchmap is wrong" << endl;
+    exit(1);
+  }
+  patchmap<string,double> sums;
+  sums["a"] = 0.5;
+  whash::sealed_patchmap<patchmap<string,double>> dtest(std::move(sums));
+  dtest.add(string("a"),1.0);
+  if (*dtest.load(string("a"))!=1.5) {
+    cout << "test failed, sealed patchmap of doubles is wrong" << endl;
+    exit(1);
+  }
+  cout << "test_sealed_patchmap() was successfully executed" << endl;
+}
+
+void test_merge_with(){
+  const uint64_t N = 1ull<<13;
+  std::mt19937_64 mr(11);
+  // partial counts of four threads, with keys that are in several of them
+  vector<patchmap<uint64_t,uint64_t>> partial(4);
+  std::unordered_map<uint64_t,uint64_t> reference;
+  for (size_t t=0;t!=4;++t) {
+    for (size_t i=0;i!=N;++i) {
+      const uint64_t k = mr()%(4*N);
+      ++partial[t][k];
+      ++reference[k];
+    }
+  }
+  patchmap<uint64_t,uint64_t> test = partial[0];
+  whash::merge_with(whash::parallel_policy{3},test,
+      partial.begin()+1,partial.end(),
+      [](uint64_t& a,const uint64_t& b){ a+=b; });
+  if ((test.size()!=reference.size())||(!test.check_ordering())) {
+    cout << "test failed, merged patchmap has wrong size or order" << endl;
+    exit(1);
+  }
+  for (const auto& e : reference) {
+    if ((test.count(e.first)!=1)||(test.at(e.first)!=e.second)) {
+      cout << "test failed, merged patchmap lost " << e.first << endl;
+      exit(1);
+    }
+  }
+  // maps sharing most keys give a table sized for the keys, not the maps
+  vector<patchmap<uint64_t,uint64_t>> shared(8);
+  for (size_t t=0;t!=8;++t)
+    for (uint64_t i=0;i!=N;++i) shared[t][i+t] = 1;
+  patchmap<uint64_t,uint64_t> counts;
+  whash::merge_with(whash::parallel_policy{4},counts,
+      shared.begin(),shared.end(),
+      [](uint64_t& a,const uint64_t& b){ a+=b; });
+  if ((counts.size()!=N+7)||(counts.at(7)!=8)
+    ||(counts.bucket_count()>2*counts.size())) {
+    cout << "test failed, merged patchmap is sized for the input maps"
+         << endl;
+    exit(1);
+  }
+  vector<patchmap<string,string>> words(3);
+  for (size_t t=0;t!=3;++t)
+    for (size_t i=t;i<1000;i+=t+1) words[t][to_string(i)] = to_string(t);
+  patchmap<string,string> stest;
+  whash::merge_with(whash::parallel_policy{2},stest,words.begin(),words.end(),
+      [](string& a,const string& b){ a+=b; });
+  for (size_t i=0;i!=1000;++i) {
+    string expected;
+    for (size_t t=0;t!=3;++t)
+      if ((i>=t)&&((i-t)%(t+1)==0)) expected+=to_string(t);
+    if ((stest.count(to_string(i))!=(!expected.empty()))
+      ||(expected.size()&&(stest.at(to_string(i))!=expected))) {
+      cout << "test failed, merged patchmap of strings is wrong at " << i
+           << endl;
+      exit(1);
+    }
+  }
+  cout << "test_merge_with() was successfully executed" << endl;
+}
+
+void test_patchmap_view(){
+  const uint64_t N = 1ull<<12;
+  const string path = "/tmp/test_patchmap_view_"+to_string(getpid());
+  patchmap<uint64_t,uint64_t> test;
+  for (uint64_t i=0;i!=N;++i) test[i*i] = i;
+  whash::save_patchmap(test,path);
+  {
+    whash::patchmap_view<patchmap<uint64_t,uint64_t>> view(path);
+    if ((view.size()!=N)||(view.count(3))||(view.find(5)!=nullptr)) {
+      cout << "test failed, patchmap view has wrong size or keys" << endl;
+      exit(1);
+    }
+    for (uint64_t i=0;i!=N;++i) {
+      if (view.at(i*i)!=i) {
+        cout << "test failed, patchmap view lost " << i*i << endl;
+        exit(1);
+      }
+    }
+    size_t n = 0;
+    for (auto it=view->begin();it!=view->end();++it)
+      n+=get<0>(*it)==get<1>(*it)*get<1>(*it);
+    if ((n!=N)||(!view->check_ordering())) {
+      cout << "test failed, patchmap view iterates wrongly" << endl;
+      exit(1);
+    }
+  }
+  bool refused = false;
+  try {
+    whash::patchmap_view<patchmap<uint32_t,uint32_t>> wrong(path);
+  } catch (const std::runtime_error&) {
+    refused = true;
+  }
+  if (!refused) {
+    cout << "test failed, patchmap view of the wrong type was opened" << endl;
+    exit(1);
+  }
+  patchmap<uint64_t,uint64_t> empty;
+  whash::save_patchmap(empty,path);
+  {
+    whash::patchmap_view<patchmap<uint64_t,uint64_t>> view(path);
+    if ((!view.empty())||view.count(0)) {
+      cout << "test failed, patchmap view of an empty table" << endl;
+      exit(1);
+    }
+  }
+  std::remove(path.c_str());
+  cout << "test_patchmap_view() was successfully executed" << endl;
+}
+
+void test_persistent_patchmap(){
+  typedef patchmap<uint64_t,uint64_t> map_type;
+  const uint64_t N = 1ull<<12;
+  const string path = "/tmp/test_persistent_patchmap_"+to_string(getpid());
+  std::remove(path.c_str());
+  {
+    whash::persistent_patchmap<map_type> test(path);
+    for (uint64_t i=0;i!=N;++i) test[i] = i;
+    for (uint64_t i=0;i<N;i+=2) test.erase(i);
+    test.checkpoint();
+    test.insert(N,N);
+  }
+  {
+    whash::persistent_patchmap<map_type> test(path);
+    if ((test.size()!=N/2+1)||(!test->check_ordering())) {
+      cout << "test failed, reopened persistent patchmap has wrong size"
+           << endl;
+      exit(1);
+    }
+    for (uint64_t i=0;i<=N;++i) {
+      if (test.count(i)!=((i%2)||(i==N))||(test.count(i)&&test.at(i)!=i)) {
+        cout << "test failed, persistent patchmap lost " << i << endl;
+        exit(1);
+      }
+    }
+    test.reserve(4*N);
+    test[N+1] = 1;
+    // a copy of a file that was changed after its checkpoint is refused
+    std::ifstream in(path,std::ios::binary);
+    std::ofstream out(path+".copy",std::ios::binary);
+    out << in.rdbuf();
+  }
+  bool refused = false;
+  try {
+    whash::patchmap_view<map_type> view(path+".copy");
+  } catch (const std::runtime_error&) {
+    refused = true;
+  }
+  whash::patchmap_view<map_type> view(path);
+  if ((!refused)||(view.size()!=N/2+2)||(view.at(N+1)!=1)) {
+    cout << "test failed, persistent patchmap was not checkpointed" << endl;
+    exit(1);
+  }
+  // a process that dies after changes it did not checkpoint
+  const pid_t child = fork();
+  if (child==0) {
+    whash::persistent_patchmap<map_type> test(path);
+    for (uint64_t i=N+2;i!=2*N+2;++i) test[i] = i;
+    for (uint64_t i=1;i<N/2;i+=2) test.erase(i);
+    _exit(0);
+  }
+  waitpid(child,nullptr,0);
+  refused = false;
+  try {
+    whash::persistent_patchmap<map_type> test(path);
+  } catch (const std::runtime_error&) {
+    refused = true;
+  }
+  const size_t recovered = whash::recover_patchmap<map_type>(path);
+  {
+    whash::persistent_patchmap<map_type> test(path);
+    bool same = refused&&(recovered==N+N/4+2)&&(test.size()==recovered)
+              &&test->check_ordering();
+    for (uint64_t i=0;i!=2*N+2;++i)
+      same &= test.count(i)==((i>=N)||((i>=N/2)&&(i%2)))
+            &&((!test.count(i))||(test.at(i)==(i==N+1?1:i)));
+    if (!same) {
+      cout << "test failed, persistent patchmap was not recovered" << endl;
+      exit(1);
+    }
+  }
+  std::remove(path.c_str());
+  std::remove((path+".copy").c_str());
+  cout << "test_persistent_patchmap() was successfully executed" << endl;
+}
+
+void test_stream_patchmap(){
+  const size_t N = 1ull<<14;
+  std::mt19937_64 mr(7);
+  patchmap<uint64_t,uint64_t> map;
+  patchmap<uint32_t,void> set;
+  for (size_t i=0;i!=N;++i) {
+    const uint64_t k = mr();
+    map[k] = i;
+    set.insert(uint32_t(k%(4*N)));
+  }
+  const whash::parallel_policy policy{3,4};
+  std::stringstream stream;
+  whash::save(map,stream,policy);
+  whash::save(set,stream,policy);
+  const string saved = stream.str();
+  // the elements come in hash order, so a map of the same hash function
+  // places them as they are read and does not have to sort them first
+  const char* p = saved.data()+whash::patchmap_stream_header::bytes;
+  bool ordered = true;
+  uint64_t last = 0;
+  for (size_t n=0;n!=map.size();) {
+    uint64_t chunk[3];
+    std::memcpy(chunk,p,sizeof(chunk));
+    p+=sizeof(chunk);
+    for (uint64_t j=0;j!=chunk[0];++j,++n,p+=2*sizeof(uint64_t)) {
+      uint64_t k;
+      std::memcpy(&k,p,sizeof(k));
+      const uint64_t h = whash::hash<uint64_t>()(k);
+      ordered &= (n==0)||(last<h);
+      last = h;
+    }
+  }
+  if (!ordered) {
+    cout << "test failed, streamed patchmap is not in hash order" << endl;
+    exit(1);
+  }
+  patchmap<uint64_t,uint64_t> map_loaded;
+  patchmap<uint32_t,void> set_loaded;
+  map_loaded[1] = 1;
+  whash::load(map_loaded,stream,{2,1});
+  whash::load(set_loaded,stream,{2,1});
+  if ((map_loaded.size()!=map.size())||(!map_loaded.check_ordering())
+    ||(set_loaded.size()!=set.size())||(!set_loaded.check_ordering())) {
+    cout << "test failed, loaded patchmap differs from the saved one" << endl;
+    exit(1);
+  }
+  for (const auto& kv : map) {
+    if ((!map_loaded.count(kv.first))||(map_loaded.at(kv.first)!=kv.second)) {
+      cout << "test failed, loaded map lost " << kv.first << endl;
+      exit(1);
+    }
+  }
+  for (const auto& k : set) {
+    if (!set_loaded.count(k)) {
+      cout << "test failed, loaded set lost " << k << endl;
+      exit(1);
+    }
+  }
+  // one changed byte in a chunk is noticed
+  string damaged = saved;
+  damaged[damaged.size()/4]^=1;
+  std::stringstream damaged_stream(damaged);
+  bool refused = false;
+  try {
+    whash::load(map_loaded,damaged_stream);
+  } catch (const std::runtime_error&) {
+    refused = true;
+  }
+  if (!refused) {
+    cout << "test failed, damaged stream was loaded" << endl;
+    exit(1);
+  }
+  cout << "test_stream_patchmap() was successfully executed" << endl;
+}
+
+void test_snapshot_patchmap(){
+  const size_t N = 1ull<<16;
+  std::mt19937_64 mr(11);
+  patchmap<uint64_t,void> set;
+  patchmap<uint32_t,int32_t> map;
+  for (size_t i=0;i!=N;++i) {
+    set.insert(mr());
+    map[uint32_t(mr())] = int32_t(i%1000)-500;
+  }
+  std::stringstream stream;
+  whash::save_snapshot(set,stream,{3,16});
+  // the gaps between N random 64 bit hashes take about 64-16+2 bits
+  if (stream.str().size()>N*(64-16+3)/8) {
+    cout << "test failed, snapshot of " << N << " hashes takes "
+         << stream.str().size() << " bytes" << endl;
+    exit(1);
+  }
+  whash::save_snapshot(map,stream,{3,16});
+  const string saved = stream.str();
+  patchmap<uint64_t,void> set_loaded;
+  patchmap<uint32_t,int32_t> map_loaded;
+  whash::load_snapshot(set_loaded,stream,{2,1});
+  whash::load_snapshot(map_loaded,stream,{2,1});
+  if ((set_loaded.size()!=set.size())||(!set_loaded.check_ordering())
+    ||(map_loaded.size()!=map.size())||(!map_loaded.check_ordering())) {
+    cout << "test failed, loaded snapshot differs from the saved one" << endl;
+    exit(1);
+  }
+  for (const auto& k : set) {
+    if (!set_loaded.count(k)) {
+      cout << "test failed, loaded snapshot lost " << k << endl;
+      exit(1);
+    }
+  }
+  for (const auto& kv : map) {
+    if ((!map_loaded.count(kv.first))||(map_loaded.at(kv.first)!=kv.second)) {
+      cout << "test failed, loaded snapshot lost " << kv.first << endl;
+      exit(1);
+    }
+  }
+  string damaged = saved;
+  damaged[damaged.size()*3/4]^=4;
+  std::stringstream damaged_stream(damaged);
+  bool refused = false;
+  try {
+    whash::load_snapshot(set_loaded,damaged_stream);
+    whash::load_snapshot(map_loaded,damaged_stream);
+  } catch (const std::runtime_error&) {
+    refused = true;
+  }
+  if (!refused) {
+    cout << "test failed, damaged snapshot was loaded" << endl;
+    exit(1);
+  }
+  cout << "test_snapshot_patchmap() was successfully executed" << endl;
+}
+
+void test_tracked_patchmap(){
+  typedef patchmap<uint64_t,uint64_t> map_type;
+  const size_t N = 1ull<<11;
+  std::mt19937_64 mr(13);
+  whash::tracked_patchmap<map_type> source;
+  whash::tracked_patchmap<map_type> replica;
+  // sparse, so that the few changes below touch few of its blocks
+  source.reserve(32*N);
+  vector<uint64_t> keys;
+  for (size_t i=0;i!=N;++i) {
+    keys.push_back(mr());
+    source[keys.back()] = i;
+  }
+  const auto same = [&](){
+    if ((replica.size()!=source.size())||(!replica->check_ordering()))
+      return false;
+    for (auto it=source->begin();it!=source->end();++it)
+      if ((!replica.count(it->first))||(replica.at(it->first)!=it->second))
+        return false;
+    return true;
+  };
+  std::stringstream full;
+  uint64_t since = source.snapshot_delta(full,0);
+  replica.apply_delta(full);
+  source[keys[1]]+= 1;
+  source.erase(keys[2]);
+  source[mr()] = 3;
+  std::stringstream delta;
+  since = source.snapshot_delta(delta,since);
+  if ((replica.apply_delta(delta)!=since)||(!same())
+    ||(delta.str().size()*4>full.str().size())) {
+    cout << "test failed, delta of " << delta.str().size()
+         << " bytes did not bring the replica up to date" << endl;
+    exit(1);
+  }
+  // a delta only applies to the epoch it was taken since
+  std::stringstream stale;
+  source[1] = 1;
+  source.snapshot_delta(stale,since-1);
+  bool refused = false;
+  try {
+    replica.apply_delta(stale);
+  } catch (const std::runtime_error&) {
+    refused = true;
+  }
+  source.reserve(128*N);
+  std::stringstream resized;
+  source.snapshot_delta(resized,since);
+  replica.apply_delta(resized);
+  if ((!refused)||(!same())) {
+    cout << "test failed, replica of a resized table differs" << endl;
+    exit(1);
+  }
+  cout << "test_tracked_patchmap() was successfully executed" << endl;
+}
+
+void test_shared_patchmap(){
+  typedef patchmap<uint64_t,uint64_t> map_type;
+  const uint64_t N = 1ull<<10;
+  const string name = "/test_shared_patchmap_"+to_string(getpid());
+  whash::shared_patchmap<map_type> writer(name);
+  for (uint64_t i=0;i!=N;++i) writer.insert(i,i);
+  int ready[2];
+  if (pipe(ready)!=0) exit(1);
+  const pid_t pid = fork();
+  if (pid==0) {
+    // the reader process follows the writer while it grows the table
+    whash::shared_patchmap_reader<map_type> reader(name);
+    if ((reader.at(N-1)!=N-1)||(write(ready[1],"r",1)!=1)) _exit(1);
+    const auto start = std::chrono::steady_clock::now();
+    while (reader.size()!=4*N) {
+      if (reader.at(N/2)!=N/2) _exit(1);
+      if (std::chrono::steady_clock::now()-start>std::chrono::seconds(60))
+        _exit(2);
+    }
+    for (uint64_t i=0;i!=4*N;++i)
+      if ((!reader.count(i))||(reader.at(i)!=i)) _exit(3);
+    _exit(reader.count(4*N)?4:0);
+  }
+  char c;
+  if (read(ready[0],&c,1)!=1) exit(1);
+  for (uint64_t i=N;i!=4*N;++i) writer.insert(i,i);
+  close(ready[0]);
+  close(ready[1]);
+  int status = -1;
+  waitpid(pid,&status,0);
+  if ((!WIFEXITED(status))||(WEXITSTATUS(status)!=0)
+    ||(!writer->check_ordering())) {
+    cout << "test failed, shared patchmap reader failed with status "
+         << status << endl;
+    exit(1);
+  }
+  cout << "test_shared_patchmap() was successfully executed" << endl;
+}
+
+void test_segmented_patchmap(){
+  typedef whash::segmented_patchmap<uint64_t,uint64_t,whash::hash<uint64_t>,
+                                    std::equal_to<uint64_t>,4> map_type;
+  const uint64_t N = 1ull<<12;
+  const string directory = "/tmp/test_segmented_patchmap_"+to_string(getpid());
+  std::mt19937_64 mr(11);
+  vector<uint64_t> keys(N);
+  for (uint64_t& k : keys) k = mr();
+  {
+    map_type test(directory,4);
+    for (uint64_t i=0;i!=N;++i) test[keys[i]] = i;
+    for (uint64_t i=0;i<N;i+=4) test.erase(keys[i]);
+    if ((test.size()!=N-N/4)||(test.segment_loads()<map_type::segment_count)) {
+      cout << "test failed, segmented patchmap has wrong size" << endl;
+      exit(1);
+    }
+    // a batch loads each segment at most once
+    const uint64_t loads = test.segment_loads();
+    size_t found = 0;
+    test.find_batch(keys.data(),N,[&](const size_t& j,const uint64_t* v){
+        if ((v!=nullptr)!=bool(j%4)||(v&&(*v!=j))) {
+          cout << "test failed, segmented patchmap lost " << keys[j] << endl;
+          exit(1);
+        }
+        found += v!=nullptr;
+      });
+    if ((found!=N-N/4)
+      ||(test.segment_loads()-loads>map_type::segment_count)) {
+      cout << "test failed, batch of segmented patchmap loaded "
+           << test.segment_loads()-loads << " segments" << endl;
+      exit(1);
+    }
+  }
+  map_type test(directory,2);
+  uint64_t last = 0;
+  size_t visited = 0;
+  bool ordered = true;
+  test.for_each([&](const uint64_t& k,const uint64_t& v){
+      const uint64_t h = whash::hash<uint64_t>{}(k);
+      ordered &= (visited==0)||(last<h);
+      ordered &= keys[v]==k;
+      last = h;
+      ++visited;
+    });
+  if ((!ordered)||(visited!=N-N/4)||(test.size()!=N-N/4)
+    ||(test.count(keys[0]))||(test.at(keys[1])!=1)) {
+    cout << "test failed, reopened segmented patchmap differs" << endl;
+    exit(1);
+  }
+  for (size_t i=0;i!=map_type::segment_count;++i)
+    std::remove((directory+"/segment_"+to_string(i)).c_str());
+  rmdir(directory.c_str());
+  cout << "test_segmented_patchmap() was successfully executed" << endl;
+}
+
+void test_merge_snapshots(){
+  typedef patchmap<uint32_t,int32_t> map_type;
+  const size_t N = 1ull<<12;
+  const string path = "/tmp/test_merge_snapshots_"+to_string(getpid());
+  std::mt19937_64 mr(17);
+  vector<map_type> maps(4);
+  map_type expected;
+  vector<string> inputs;
+  for (size_t i=0;i!=maps.size();++i) {
+    // the last one is empty
+    for (size_t j=0;j!=N*(i+1<maps.size());++j) {
+      const uint32_t k = mr()%(4*N);
+      maps[i][k] = int32_t(j);
+    }
+    for (const auto& kv : maps[i]) expected[kv.first]+=kv.second;
+    inputs.push_back(path+"_"+to_string(i));
+    std::ofstream out(inputs.back(),std::ios::binary);
+    whash::save_snapshot(maps[i],out,{2,4});
+  }
+  const uint64_t n = whash::merge_snapshots<map_type>(inputs,path,
+      [](const int32_t& a,const int32_t& b){ return a+b; },1000);
+  map_type merged;
+  std::ifstream in(path,std::ios::binary);
+  whash::load_snapshot(merged,in);
+  bool same = (n==expected.size())&&(merged.size()==expected.size());
+  for (const auto& kv : expected)
+    same &= merged.count(kv.first)&&(merged.at(kv.first)==kv.second);
+  // without combine the newest value is kept
+  whash::merge_snapshots<map_type>({inputs[1],inputs[0]},path);
+  std::ifstream newest(path,std::ios::binary);
+  whash::load_snapshot(merged,newest);
+  for (const auto& kv : maps[0]) same &= merged.at(kv.first)==kv.second;
+  for (const auto& kv : maps[1])
+    same &= maps[0].count(kv.first)||(merged.at(kv.first)==kv.second);
+  // a truncated input leaves neither the output nor a temporary file
+  const string truncated = path+"_truncated";
+  {
+    std::ifstream in(inputs[0],std::ios::binary);
+    const string bytes((std::istreambuf_iterator<char>(in)),
+                       std::istreambuf_iterator<char>());
+    std::ofstream out(truncated,std::ios::binary);
+    out.write(bytes.data(),bytes.size()/2);
+  }
+  const string failed = path+"_failed";
+  bool refused = false;
+  try {
+    whash::merge_snapshots<map_type>({truncated,inputs[1]},failed);
+  } catch (const std::runtime_error&) {
+    refused = true;
+  }
+  same &= refused&&(::access(failed.c_str(),F_OK)!=0)
+        &&(::access((failed+".tmp").c_str(),F_OK)!=0);
+  std::remove(truncated.c_str());
+  if (!same) {
+    cout << "test failed, merged snapshot differs" << endl;
+    exit(1);
+  }
+  for (const string& input : inputs) std::remove(input.c_str());
+  std::remove(path.c_str());
+  cout << "test_merge_snapshots() was successfully executed" << endl;
+}
+
+void test_patchmap_algebra(){
+  typedef patchmap<uint32_t,uint32_t> map_type;
+  const size_t N = 1ull<<12;
+  std::mt19937_64 mr(19);
+  map_type a, b, big;
+  big.reserve(16*N);
+  for (size_t i=0;i!=N;++i) a[mr()%(2*N)] = i;
+  for (size_t i=0;i!=N;++i) b[mr()%(2*N)] = i;
+  for (const auto& kv : a) big[kv.first] = kv.second;
+  // tables of the same elements but of other sizes are equal
+  if ((!(a==big))||(a!=big)||(a==b)) {
+    cout << "test failed, comparison of patchmaps is wrong" << endl;
+    exit(1);
+  }
+  map_type u, i, d;
+  i.reserve(N);
+  const size_t buckets = i.bucket_count();
+  whash::set_union(a,b,u);
+  whash::set_intersection(a,b,i);
+  whash::set_difference(a,b,d);
+  const map_type m = whash::merge(a,b,
+      [](const uint32_t& x,const uint32_t& y){ return x+y; });
+  bool same = u.check_ordering()&&i.check_ordering()&&d.check_ordering()
+            &&m.check_ordering()&&(i.bucket_count()==buckets);
+  size_t n_union = 0, n_intersection = 0, n_difference = 0;
+  for (uint32_t k=0;k!=2*N;++k) {
+    const bool in_a = a.count(k), in_b = b.count(k);
+    n_union+=in_a||in_b;
+    n_intersection+=in_a&&in_b;
+    n_difference+=in_a&&!in_b;
+    if (in_a||in_b)
+      same &= u.count(k)&&(u.at(k)==(in_a?a.at(k):b.at(k)))
+            &&(m.at(k)==(in_a?a.at(k):0)+(in_b?b.at(k):0));
+    if (in_a&&in_b) same &= i.count(k)&&(i.at(k)==a.at(k));
+    if (in_a&&!in_b) same &= d.count(k)&&(d.at(k)==a.at(k));
+  }
+  same &= (u.size()==n_union)&&(i.size()==n_intersection)
+        &&(d.size()==n_difference)&&(m.size()==n_union);
+  same &= whash::includes(u,a)&&whash::includes(a,i)&&whash::includes(a,d)
+        &&!whash::includes(a,b)&&!whash::includes(d,i);
+  // keys of a hash function that is not injective
+  patchmap<string,void> s, t;
+  for (size_t j=0;j!=N/4;++j) {
+    s.insert(to_string(mr()%N));
+    t.insert(to_string(mr()%N));
+  }
+  const patchmap<string,void> st = whash::set_intersection(s,t);
+  size_t n_st = 0;
+  for (const auto& k : s) n_st+=t.count(k);
+  for (const auto& k : st) same &= s.count(k)&&t.count(k);
+  same &= (st.size()==n_st)&&whash::includes(whash::set_union(s,t),t);
+  if (!same) {
+    cout << "test failed, set operation on patchmaps is wrong" << endl;
+    exit(1);
+  }
+  cout << "test_patchmap_algebra() was successfully executed" << endl;
+}
+
+void test_probe_sorted(){
+  typedef patchmap<uint32_t,uint32_t> map_type;
+  const size_t N = 1ull<<12;
+  std::mt19937_64 mr(23);
+  map_type a;
+  for (size_t i=0;i!=N;++i) a[mr()%(2*N)] = i;
+  // too large to be probed in the order of the keys
+  a.reserve(256*N);
+  vector<uint32_t> keys(3*N);
+  for (uint32_t& k : keys) k = mr()%(4*N);
+  vector<const uint32_t*> out;
+  whash::probe_sorted(a,keys,out);
+  bool same = out.size()==keys.size();
+  for (size_t j=0;same&&(j!=keys.size());++j)
+    same &= a.count(keys[j])?(out[j]&&(*out[j]==a.at(keys[j]))):!out[j];
+  // keys of a hash function that is not injective, each visited once, in
+  // a table small enough to be probed in the order of the keys and then
+  // in a large one
+  struct coarse_hash{
+    uint32_t operator()(const uint64_t& k) const {
+      return whash::hash<uint32_t>()(uint32_t(k>>2));
+    }
+  };
+  patchmap<uint64_t,uint64_t,coarse_hash> c;
+  for (size_t j=0;j!=N;++j) c[mr()%(2*N)] = j;
+  vector<uint64_t> ckeys(3*N);
+  for (uint64_t& k : ckeys) k = mr()%(4*N);
+  for (size_t pass=0;pass!=2;++pass) {
+    if (pass) c.reserve(256*N);
+    vector<size_t> visits(ckeys.size());
+    whash::probe_sorted(c,ckeys.data(),ckeys.size(),
+        [&](const size_t& j,const uint64_t* v){
+          ++visits[j];
+          same &= c.count(ckeys[j])?(v&&(*v==c.at(ckeys[j]))):!v;
+        });
+    for (const size_t& v : visits) same &= v==1;
+  }
+  map_type empty;
+  whash::probe_sorted(empty,keys,out);
+  for (const uint32_t* v : out) same &= !v;
+  if (!same) {
+    cout << "test failed, probe_sorted found wrong values" << endl;
+    exit(1);
+  }
+  cout << "test_probe_sorted() was successfully executed" << endl;
+}
+
 int main(){
   /*std::allocator<std::pair<string,string>> allocator;
   std::pair<string,string>* a =
@@ -182,6 +1477,31 @@ int main(){
   return 0;*/
   test_uint32_t();
   test_string();
+  test_string_patchmap();
+  test_small_patchmap();
+  test_pmr_patchmap();
+  test_pmr_string_patchmap();
+  test_numa_patchmap();
+  test_extreme_load();
+  test_iterator_arithmetic();
+  test_fenced_patchmap();
+  test_seqlock_patchmap();
+  test_concurrent_patchmap();
+  test_parallel_build();
+  test_parallel_for_each();
+  test_published_patchmap();
+  test_sealed_patchmap();
+  test_merge_with();
+  test_patchmap_view();
+  test_persistent_patchmap();
+  test_stream_patchmap();
+  test_snapshot_patchmap();
+  test_tracked_patchmap();
+  test_shared_patchmap();
+  test_segmented_patchmap();
+  test_merge_snapshots();
+  test_patchmap_algebra();
+  test_probe_sorted();
   cout << "all tests were executed successfully" << endl;
   return 0;
 }
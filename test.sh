@@ -1,12 +1,30 @@
 #!/bin/bash
-g++ \
-  -std=c++17\
-  -O3\
-  -Wfatal-errors\
-  -mpclmul\
-  -DNDEBUG\
-  -lboost_container\
-  -lprocps\
-  -o test \
-  test.cpp\
-&& ./test 2>&1 | tee test.log
+# Runs the tests with the scalar mask kernels and again with the AVX2 and
+# BMI2 ones and the AVX-512 ones, as far as this machine can run them.
+set -o pipefail
+target=$(g++ -march=native -Q --help=target)
+native(){
+  grep -q -- "-m$1 .*\[enabled\]" <<< "$target"
+}
+run(){
+  g++ \
+    -std=c++17\
+    -O3\
+    -Wfatal-errors\
+    -mpclmul\
+    -DNDEBUG\
+    -pthread\
+    "$@"\
+    -lboost_container\
+    -lprocps\
+    -o test \
+    test.cpp\
+  && ./test 2>&1 | tee test.log
+}
+run || exit 1
+if native avx2 && native bmi2; then
+  run -mavx2 -mbmi2 || exit 1
+fi
+if native avx512f && native avx512vpopcntdq && native bmi2; then
+  run -mavx512f -mavx512vpopcntdq -mbmi2 || exit 1
+fi
@@ -0,0 +1,272 @@
+#ifndef TRACKED_PATCH_MAP_H
+#define TRACKED_PATCH_MAP_H
+
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "patchmap.hpp"
+
+namespace whash{
+
+  // A delta starts with this header, in the byte order of the machine that
+  // wrote it, followed by blocks, each its index, its mask words and its
+  // buckets exactly as the patchmap holds them in memory. A full delta has
+  // all blocks of the table and can be applied to any map of the same type.
+  struct patchmap_delta_header{
+    static constexpr uint32_t current_version = 1;
+    static constexpr uint32_t native_order    = 0x01020304;
+    char     magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t size_size;
+    uint32_t value_size;
+    uint32_t full;
+    uint32_t reserved;
+    uint64_t datasize;
+    uint64_t num_data;
+    uint64_t since;  // the epoch the delta applies to, 0 if full
+    uint64_t until;  // the epoch it brings the table to
+    uint64_t blocks;
+  };
+
+  // A patchmap that keeps track of the blocks of buckets it changed, each
+  // the buckets of block_words mask words, a page for the default of 4 and
+  // 16 byte elements, so that a checkpoint needs to write only those
+  // blocks with their mask words.
+  //
+  // Changes are stamped with the current epoch. snapshot_delta(out,since)
+  // writes the blocks changed after epoch since and starts a new epoch, a
+  // replica that applied the deltas up to since is then brought up to date
+  // by apply_delta. A table that was resized after since can only be
+  // written in full. Inserting or erasing moves only elements within the
+  // run of occupied buckets around the element, so that run is what is
+  // marked. Values have to be changed through operator[] or
+  // insert_or_assign to be tracked.
+  template<class map_type,size_t block_words = 4>
+  class tracked_patchmap{
+    private:
+      class table : public map_type{
+        public:
+          using map_type::data;
+          using map_type::mask;
+          using map_type::datasize;
+          using map_type::masksize;
+          using map_type::num_data;
+          using map_type::find_node;
+          using map_type::full_words;
+          using map_type::used_words;
+          using map_type::next_word;
+          using map_type::prev_word;
+          using map_type::update_fences;
+          using map_type::check_ordering;
+      };
+    public:
+      typedef typename map_type::size_type size_type;
+      typedef typename map_type::value_type value_type;
+      typedef typename map_type::_mapped_type mapped_type;
+      static_assert(
+          is_trivially_copyable<
+            typename std::tuple_element<0,value_type>::type>::value
+        &&is_trivially_copyable<
+            typename std::tuple_element<1,value_type>::type>::value,
+          "only patchmaps of trivially copyable elements can be tracked");
+      static constexpr size_type block = block_words*digits<size_type>();
+    private:
+      table map;
+      vector<uint64_t> stamps;  // the last epoch each block changed in
+      uint64_t current = 1;
+      uint64_t resized = 1;     // the epoch the table got its size in
+      [[noreturn]] static void fail(const string& what){
+        throw std::runtime_error(
+            string(typeid(tracked_patchmap).name())+": "+what);
+      }
+      size_type blocks() const { return (map.datasize+block-1)/block; }
+      void mark(const size_type& lo,const size_type& hi){
+        for (size_type b=lo/block;b<=hi/block;++b) stamps[b] = current;
+      }
+      // the first bucket of the run of occupied buckets around bucket i
+      size_type run_begin(const size_type& i) const {
+        constexpr size_type d = digits<size_type>();
+        size_type k = i/d;
+        size_type w = (~map.mask[k])&((~size_type(0))<<(d-1-i%d));
+        while (w==0) {
+          if (k==0) return 0;
+          k = map.prev_word(map.full_words(),~size_type(0),k-1);
+          if (k==~size_type(0)) return 0;
+          w = ~map.mask[k];
+        }
+        return k*d+d-ctz(w);
+      }
+      // the last bucket of the run of occupied buckets around bucket i
+      size_type run_end(const size_type& i) const {
+        constexpr size_type d = digits<size_type>();
+        size_type k = i/d;
+        size_type w = (~map.mask[k])&((~size_type(0))>>(i%d));
+        while (w==0) {
+          k = map.next_word(map.full_words(),~size_type(0),k+1);
+          if (k>=map.masksize) return map.datasize-1;
+          w = ~map.mask[k];
+        }
+        return std::min(map.datasize,k*d+clz(w))-1;
+      }
+      void mark_run(const size_type& i){
+        mark(run_begin(i),run_end(i));
+      }
+      void check_resize(const size_type& datasize){
+        if (map.datasize==datasize) return;
+        stamps.assign(blocks(),current);
+        resized = current;
+      }
+      template<class F>
+      void write_block(const size_type& b,F&& write) const {
+        const size_type k0 = b*block_words;
+        const size_type k1 = std::min(map.masksize,k0+block_words);
+        const size_type i0 = b*block;
+        const size_type i1 = std::min(map.datasize,i0+block);
+        const uint64_t index = b;
+        write(&index,sizeof(index));
+        write(map.mask+k0,(k1-k0)*sizeof(size_type));
+        write(reinterpret_cast<const void*>(map.data+i0),
+              (i1-i0)*sizeof(value_type));
+      }
+    public:
+      explicit tracked_patchmap(map_type&& other = map_type())
+        :map() {
+        static_cast<map_type&>(map) = std::move(other);
+        stamps.assign(blocks(),current);
+      }
+      const map_type& operator*()  const { return  map; }
+      const map_type* operator->() const { return &map; }
+      // changes made now are stamped with this epoch
+      uint64_t epoch() const { return current; }
+      template<class key_type>
+      size_type count(const key_type& k) const { return map.count(k); }
+      template<class key_type>
+      const mapped_type& at(const key_type& k) const { return map.at(k); }
+      template<class key_type>
+      mapped_type& operator[](const key_type& k){
+        const size_type datasize = map.datasize;
+        const size_type n = map.size();
+        mapped_type& v = map[k];
+        check_resize(datasize);
+        const size_type i = map.find_node(k);
+        if (map.size()!=n) mark_run(i);
+        else mark(i,i);
+        return v;
+      }
+      // insert k with value v if k is not in the table yet, returns whether
+      // it was inserted
+      template<class key_type>
+      bool insert(const key_type& k,const mapped_type& v){
+        if (map.count(k)) return false;
+        (*this)[k] = v;
+        return true;
+      }
+      // insert k with value v or overwrite the value of k
+      template<class key_type>
+      void insert_or_assign(const key_type& k,const mapped_type& v){
+        (*this)[k] = v;
+      }
+      template<class key_type>
+      size_type erase(const key_type& k){
+        const size_type i = map.find_node(k);
+        if (i>=map.datasize) return 0;
+        mark_run(i);
+        const size_type datasize = map.datasize;
+        const size_type n = map.erase(k);
+        check_resize(datasize);
+        return n;
+      }
+      void reserve(const size_type& n){
+        const size_type datasize = map.datasize;
+        map.reserve(n);
+        check_resize(datasize);
+      }
+      size_type size() const { return map.size(); }
+      bool empty() const { return map.empty(); }
+      // Write the blocks changed after epoch since, or all blocks if since
+      // is 0 or the table was resized after it, and start a new epoch.
+      // Returns the epoch the delta brings a replica to, the since of the
+      // next delta.
+      uint64_t snapshot_delta(std::ostream& out,const uint64_t& since){
+        const bool full = since<resized;
+        patchmap_delta_header h;
+        std::memset(&h,0,sizeof(h));
+        std::memcpy(h.magic,"PATCHDLT",8);
+        h.version    = patchmap_delta_header::current_version;
+        h.byte_order = patchmap_delta_header::native_order;
+        h.size_size  = sizeof(size_type);
+        h.value_size = sizeof(value_type);
+        h.full       = full;
+        h.datasize   = map.datasize;
+        h.num_data   = map.num_data;
+        h.since      = full?0:since;
+        h.until      = current;
+        for (size_type b=0;b!=blocks();++b) h.blocks+=full||(stamps[b]>since);
+        const auto write = [&out](const void* p,const size_t& n){
+          out.write(reinterpret_cast<const char*>(p),n);
+        };
+        write(&h,sizeof(h));
+        for (size_type b=0;b!=blocks();++b)
+          if (full||(stamps[b]>since)) write_block(b,write);
+        if (!out) fail("writing a delta failed");
+        return current++;
+      }
+      // Apply a delta written by snapshot_delta of a table of the same
+      // type. Unless the delta is full, this table has to be at its since.
+      // Returns the epoch the table is at afterwards.
+      uint64_t apply_delta(std::istream& in){
+        const auto read = [&in](void* p,const size_t& n){
+          in.read(reinterpret_cast<char*>(p),n);
+          if (size_t(in.gcount())!=n) fail("truncated delta");
+        };
+        patchmap_delta_header h;
+        read(&h,sizeof(h));
+        if (std::memcmp(h.magic,"PATCHDLT",8)!=0) fail("not a delta");
+        if ((h.version!=patchmap_delta_header::current_version)
+          ||(h.byte_order!=patchmap_delta_header::native_order)
+          ||(h.size_size!=sizeof(size_type))
+          ||(h.value_size!=sizeof(value_type)))
+          fail("delta of another version, machine or type");
+        if (h.full) {
+          map.clear();
+          if (map.datasize!=h.datasize) map.resize(h.datasize);
+          stamps.assign(blocks(),current);
+          resized = current;
+        } else if ((h.datasize!=map.datasize)||(h.since!=current-1)) {
+          fail("delta does not apply to this table");
+        }
+        for (uint64_t n=0;n!=h.blocks;++n) {
+          uint64_t b;
+          read(&b,sizeof(b));
+          if (b>=blocks()) fail("damaged delta");
+          const size_type k0 = b*block_words;
+          const size_type k1 = std::min(map.masksize,k0+block_words);
+          const size_type i0 = b*block;
+          const size_type i1 = std::min(map.datasize,i0+block);
+          read(map.mask+k0,(k1-k0)*sizeof(size_type));
+          read(reinterpret_cast<void*>(map.data+i0),
+               (i1-i0)*sizeof(value_type));
+          for (size_type k=k0;k!=k1;++k) {
+            const size_type s = k/digits<size_type>();
+            const size_type bit =
+              size_type(1)<<(digits<size_type>()-1-k%digits<size_type>());
+            map.used_words()[s]&=~bit;
+            map.full_words()[s]&=~bit;
+            if (map.mask[k]) map.used_words()[s]|=bit;
+            if (map.mask[k]==~size_type(0)) map.full_words()[s]|=bit;
+          }
+          map.update_fences(i0,i1-1);
+          stamps[b] = current;
+        }
+        map.num_data = h.num_data;
+        assert(map.check_ordering());
+        current = h.until+1;
+        return h.until;
+      }
+  };
+}
+#endif // TRACKED_PATCH_MAP_H